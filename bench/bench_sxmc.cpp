@@ -8,21 +8,28 @@
 
 #ifdef __CUDACC__
 #include <cuda_profiler_api.h>
+#else
+#include "simd_kernels.h"
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
 #endif
 
 using namespace std;
 
-void fill_gaussian(std::vector<float> &samples)
+void fill_gaussian(std::vector<float> &samples, float sigma=1.0)
 {
     for (unsigned int i=0; i < samples.size(); i++)
-        samples[i] = gRandom->Gaus();
+        samples[i] = gRandom->Gaus(0.0, sigma);
 }
 
-void fill_clamped_gaussian(std::vector<float> &samples, float lower, float upper)
+void fill_clamped_gaussian(std::vector<float> &samples, float lower, float upper,
+                           float sigma=1.0)
 {
     for (unsigned int i=0; i < samples.size(); i++) {
         while (true) {
-            samples[i] = gRandom->Gaus();
+            samples[i] = gRandom->Gaus(0.0, sigma);
             if (samples[i] >= lower && samples[i] < upper)
                 break;
         }
@@ -30,18 +37,28 @@ void fill_clamped_gaussian(std::vector<float> &samples, float lower, float upper
 }
 
 
-void bench_pdfz()
+// Histogram throughput for Gaussian samples of width sigma, binned in
+// [-3, 3).  Narrow widths put most samples in a few bins, like a peaked
+// spectrum, which stresses contention on the histogram.
+void bench_pdfz_hist(const string &title, float sigma)
 {
     const int nsamples = 10000000;
     const int neval_points = 100000;
     const int nbins = 1000;
 
-    cout << "pdfz benchmark\n"
-            "--------------\n"
-            "Config: # of samples = " << nsamples << "\n"
+    cout << title << "\n"
+         << string(title.size(), '-') << "\n"
+         << "Config: # of samples = " << nsamples << "\n"
+         << "        sample sigma = " << sigma << "\n"
          << "        # of evaluation points = " << neval_points << "\n"
          << "        # of bins = " << nbins << "\n"
          << "        # of systematics = 1\n";
+#ifdef _OPENMP
+    cout << "        # of host threads = " << omp_get_max_threads() << "\n";
+#endif
+#ifndef __CUDACC__
+    cout << "        host SIMD = " << simd::name(simd::active()) << "\n";
+#endif
 
     std::vector<double> lower(1);
     std::vector<double> upper(1);
@@ -54,13 +71,14 @@ void bench_pdfz()
     nbins_vec[0] = nbins;
 
     std::vector<float> samples(nsamples);
-    fill_gaussian(samples);
+    fill_gaussian(samples, sigma);
+    std::vector<int> weights(nsamples, 1);
 
-    pdfz::EvalHist evaluator(samples, 1, 1, lower, upper, nbins_vec);
+    pdfz::EvalHist evaluator(samples, weights, 1, 1, lower, upper, nbins_vec);
 
     // Setup for evaluation
     vector<float> eval_points(neval_points);
-    fill_clamped_gaussian(eval_points, lower[0], upper[0]);
+    fill_clamped_gaussian(eval_points, lower[0], upper[0], sigma);
 
     hemi::Array<float> pdf_values(neval_points, true);
     hemi::Array<unsigned int> norm (1, true);
@@ -100,6 +118,79 @@ void bench_pdfz()
 }
 
 
+void bench_pdfz()
+{
+    bench_pdfz_hist("pdfz benchmark", 1.0);
+}
+
+
+// A narrow peak, e.g. 0vbb, covering about ten of the 1000 bins
+void bench_pdfz_peaked()
+{
+    bench_pdfz_hist("pdfz peaked benchmark", 0.01);
+}
+
+
+void bench_pdfz_kernel()
+{
+    // A KDE is for low-statistics PDFs, so fewer samples than bench_pdfz
+    const int nsamples = 10000;
+    const int neval_points = 100000;
+
+    cout << "pdfz kernel density benchmark\n"
+            "-----------------------------\n"
+            "Config: # of samples = " << nsamples << "\n"
+         << "        # of evaluation points = " << neval_points << "\n"
+         << "        # of systematics = 1\n";
+#ifdef _OPENMP
+    cout << "        # of host threads = " << omp_get_max_threads() << "\n";
+#endif
+
+    std::vector<double> lower(1, -3.0);
+    std::vector<double> upper(1, 3.0);
+    std::vector<double> bandwidth_scale(1, 1.0);
+
+    pdfz::ShiftSystematic shift(0,0);
+
+    std::vector<float> samples(nsamples);
+    fill_gaussian(samples);
+
+    pdfz::EvalKernel evaluator(samples, 1, 1, lower, upper, bandwidth_scale);
+
+    // Setup for evaluation
+    vector<float> eval_points(neval_points);
+    fill_clamped_gaussian(eval_points, lower[0], upper[0]);
+
+    hemi::Array<float> pdf_values(neval_points, true);
+    hemi::Array<unsigned int> norm (1, true);
+    hemi::Array<double> params(1, true);
+    params.writeOnlyHostPtr()[0] = 0.0f;
+
+    evaluator.SetEvalPoints(eval_points);
+    evaluator.SetPDFValueBuffer(&pdf_values);
+    evaluator.SetNormalizationBuffer(&norm);
+    evaluator.SetParameterBuffer(&params);
+    evaluator.AddSystematic(shift);
+
+    cout << "        bandwidth = " << evaluator.GetBandwidth()[0] << "\n";
+
+    // Warmup
+    evaluator.EvalAsync();
+    evaluator.EvalFinished();
+
+    const int nreps = 10;
+    TStopwatch timer;
+    timer.Start();
+    for (int i=0; i < nreps; i++) {
+        evaluator.EvalAsync();
+        evaluator.EvalFinished();
+    }
+    timer.Stop();
+
+    double points_per_second = neval_points * nreps / timer.RealTime();
+    cout << "# of points evaluated per second: " << points_per_second << "\n";
+}
+
 void bench_pdfz_group()
 {
     // Benchmark parameters
@@ -181,10 +272,12 @@ void bench_pdfz_group()
     // Initialize evaluators
     pdfz::EvalHist *evaluators[nsignals];
     std::vector<float> samples;
+    std::vector<int> weights;
     for (int i = 0; i < nsignals; i++) {
         samples.resize(nsamples[i]);
         fill_gaussian(samples);
-        pdfz::EvalHist *evaluator = new pdfz::EvalHist(samples, 1, 1, lower, upper, nbins_vec);
+        weights.assign(nsamples[i], 1);
+        pdfz::EvalHist *evaluator = new pdfz::EvalHist(samples, weights, 1, 1, lower, upper, nbins_vec);
 
         evaluator->SetEvalPoints(eval_points);
         evaluator->SetPDFValueBuffer(&pdf_values, neval_points * i);
@@ -227,12 +320,16 @@ int main(int argc, char **argv)
 {
     if (argc != 2) {
         cerr << "Usage: bench_sxmc [benchmark_name]\n";
-        cerr << "  Available benchmarks: pdfz pdfz_group\n";
+        cerr << "  Available benchmarks: pdfz pdfz_peaked pdfz_kernel pdfz_group\n";
         return 1;
     }
 
     if (string("pdfz") == argv[1])
         bench_pdfz();
+    else if (string("pdfz_peaked") == argv[1])
+        bench_pdfz_peaked();
+    else if (string("pdfz_kernel") == argv[1])
+        bench_pdfz_kernel();
     else if (string("pdfz_group") == argv[1])
         bench_pdfz_group();
     else {
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <vector>
 #include <assert.h>
+#include <sys/stat.h>
 #include <json/value.h>
 #include <json/reader.h>
 #include <TFile.h>
@@ -14,6 +15,8 @@
 #include <TH1D.h>
 #include <TH2F.h>
 #include <TMath.h>
+#include <TROOT.h>
+#include <RVersion.h>
 
 #include <sxmc/signals.h>
 #include <sxmc/config.h>
@@ -124,10 +127,19 @@ FitConfig::FitConfig(std::string filename) {
   // fit parameters
   const Json::Value fit_params = root["fit"];
   this->experiments = fit_params["experiments"].asInt();
+  this->parallel_experiments = \
+    fit_params.get("parallel_experiments", 1).asInt();
+  this->seed = fit_params.get("seed", 0).asUInt();
   this->steps = fit_params["steps"].asInt();
   this->burnin_fraction = fit_params.get("burnin_fraction", 0.1).asFloat();
   this->output_file = fit_params.get("output_file", "fit_spectrum").asString();
   this->debug_mode = fit_params.get("debug_mode", false).asBool();
+  this->chains = fit_params.get("chains", 1).asInt();
+  this->max_temperature = fit_params.get("max_temperature", 10.0).asFloat();
+  this->swap_interval = fit_params.get("swap_interval", 10).asInt();
+  this->adaptive = fit_params.get("adaptive", false).asBool();
+  this->binned = fit_params.get("binned", false).asBool();
+  this->pdf_cache = fit_params.get("pdf_cache", "").asString();
 
   // find observables we want to fit for
   for (Json::Value::const_iterator it=fit_params["observables"].begin();
@@ -198,6 +210,16 @@ FitConfig::FitConfig(std::string filename) {
     signal_names.push_back((*it).asString());
   }
 
+  // samples passing cuts are cached across runs, if configured
+  PDFCache cache(this->pdf_cache);
+
+  // Signals are added in configuration order, each either built from files
+  // or sampled from a chain of signals built from files. All of the
+  // building is done after the configuration is read, in parallel.
+  std::vector<SignalFiles> files;
+  std::vector<ChainedSignal> chained;
+  std::vector<std::pair<bool, size_t> > order;  // (chained, index)
+
   // loop over all possible signals
   const Json::Value all_signals = root["signals"];
   for (Json::Value::const_iterator it=all_signals.begin();
@@ -215,129 +237,223 @@ FitConfig::FitConfig(std::string filename) {
 
     // check if we are building our pdf out of multiple contributions
     if (signal_params.isMember("pdfs")){
-      // loop over contributions
+      std::vector<SignalFiles> contribs;
+      for (Json::Value::const_iterator jt=signal_params["pdfs"].begin();
+          jt!=signal_params["pdfs"].end();++jt){
+        contribs.push_back(get_signal_files(jt.key().asString(),
+              signal_params["pdfs"][jt.key().asString()]));
+      }
+
       if (!signal_params.get("chain",true)){
         // its not chained, treat each part as a separate signal
-        for (Json::Value::const_iterator jt=signal_params["pdfs"].begin();
-            jt!=signal_params["pdfs"].end();++jt){
-
-          // extract parameters for this pdf
-          const Json::Value contrib_params = signal_params["pdfs"][jt.key().asString()];
-          std::string name = jt.key().asString();
-          std::string title = contrib_params.get("title", name).asString();
-          std::string category = contrib_params.get("category","").asString();
-          float sigma = contrib_params.get("constraint", 0.0).asFloat() * this->live_time * this->efficiency_corr;
-          float nexpected = contrib_params["rate"].asFloat() * this->live_time * this->efficiency_corr;
-          std::vector<std::string> filenames;
-          int rootfile = 0;
-          for (Json::Value::const_iterator kt=contrib_params["files"].begin();
-              kt!=contrib_params["files"].end();++kt){
-            filenames.push_back((*kt).asString());
-            if ((*kt).asString().compare ((*kt).asString().length() - 4, 4, "root") == 0)
-              rootfile = 1;
-          }
-
-          if (rootfile)
-            this->signals.push_back(Signal(name,title,nexpected,sigma,category,this->sample_fields,
-                  this->observables,this->cuts,this->systematics,filenames));
-          else
-            this->signals.push_back(Signal(name,title,nexpected,sigma,category,this->hdf5_fields,this->sample_fields,
-                  this->observables,this->cuts,this->systematics,filenames));
+        for (size_t i=0;i<contribs.size();i++){
+          order.push_back(std::make_pair(false, files.size()));
+          files.push_back(contribs[i]);
         }
       }else{
         // it is chained, get each contribution as a pdfz and add them
-        std::vector<Signal> pdfs;
-        std::vector<double> params;
-        int nexpected_total = 0;
-        double efficiency_total = 0;
-        for (Json::Value::const_iterator jt=signal_params["pdfs"].begin();
-            jt!=signal_params["pdfs"].end();++jt){
-
-          // extract parameters for this pdf
-          const Json::Value contrib_params = signal_params["pdfs"][jt.key().asString()];
-          std::string name = jt.key().asString();
-          std::string title = contrib_params.get("title", name).asString();
-          std::string category = contrib_params.get("category","").asString();
-          float sigma = contrib_params.get("constraint", 0.0).asFloat() * this->live_time * this->efficiency_corr;
-          float nexpected = contrib_params["rate"].asFloat() * this->live_time * this->efficiency_corr;
-          std::vector<std::string> filenames;
-          int rootfile = 0;
-          for (Json::Value::const_iterator kt=contrib_params["files"].begin();
-              kt!=contrib_params["files"].end();++kt){
-            filenames.push_back((*kt).asString());
-            if ((*kt).asString().compare ((*kt).asString().length() - 4, 4, "root") == 0)
-              rootfile = 1;
-          }
+        order.push_back(std::make_pair(true, chained.size()));
+        chained.push_back(ChainedSignal());
+        ChainedSignal& chain = chained.back();
+        chain.name = it.key().asString();
+        chain.params = signal_params;
+
+        // the combined samples are determined by the contributions
+        chain.key.add("chain");
+        chain.key.add(chain.name);
+        for (size_t i=0;i<contribs.size();i++){
+          chain.key.add(signal_cache_key(contribs[i]).str());
+          chain.key.add(contribs[i].nexpected);
+        }
 
-          if (rootfile)
-            pdfs.push_back(Signal(name,title,nexpected,sigma,category,this->sample_fields,
-                  this->observables,this->cuts,this->systematics,filenames));
-          else
-            pdfs.push_back(Signal(name,title,nexpected,sigma,category,this->hdf5_fields,this->sample_fields,
-                  this->observables,this->cuts,this->systematics,filenames));
-          params.push_back(pdfs.back().nexpected*10.0);
-          nexpected_total += pdfs.back().nexpected;
-          efficiency_total += pdfs.back().nexpected/pdfs.back().efficiency;
+        chain.cached = cache.load(chain.key, chain.combined);
+        if (chain.cached){
+          std::cout << "FitConfig::CreateMultiPDFSignal: Loaded combined pdf for " << chain.name
+            << " from PDF cache" << std::endl;
+        }else{
+          for (size_t i=0;i<contribs.size();i++){
+            chain.parts.push_back(files.size());
+            files.push_back(contribs[i]);
+          }
         }
-        efficiency_total = nexpected_total/efficiency_total;
-
-        // Now sample all these pdfs to get samples with the correct relative weighting
-        std::cout << "FitConfig::CreateMultiPDFSignal: Generating combined pdf for " << it.key().asString() << std::endl;
-        for (size_t i=0;i<this->systematics.size();i++)
-          params.push_back(0);
-        std::pair<std::vector<float>, std::vector<int> > samples = make_fake_dataset(pdfs,this->systematics,this->observables,params,true);
-
-        // Now create a new pdf from these samples
-        std::string name = it.key().asString();
-        std::string title = signal_params.get("title", name).asString();
-        std::string category = signal_params.get("category","").asString();
-        float sigma = signal_params.get("constraint", 0.0).asFloat() * this->live_time * this->efficiency_corr;
-        float nexpected = signal_params.get("rate",nexpected_total).asFloat() * this->live_time * this->efficiency_corr;
-        this->signals.push_back(Signal(name,title,nexpected,sigma,category,
-              this->observables,this->cuts,this->systematics,samples.first,this->sample_fields,samples.second));
-
-        // correct for efficiency
-        this->signals.back().efficiency *= efficiency_total;
-        this->signals.back().nevents_physical /= efficiency_total;
-        this->signals.back().sigma *= efficiency_total;
-        std::cout << "CORRECTED TO " << this->signals.back().nevents_physical << " " << this->signals.back().nevents << " " << this->signals.back().efficiency << std::endl;
-
-        float years = 1.0 * this->signals.back().nevents / (this->signals.back().nexpected / this->live_time);
-
-        std::cout << "FitConfig::CreateMultiPDFSignal: Initialized PDF for " << name
-          << " using " << this->signals.back().nevents << " events (" << years << " y)"
-          << std::endl;
       }
     }else{
-      // extract parameters for this pdf
-      std::string name = it.key().asString();
-      std::string title = signal_params.get("title", name).asString();
-      std::string category = signal_params.get("category","").asString();
-      float sigma = signal_params.get("constraint", 0.0).asFloat() * this->live_time * this->efficiency_corr;
-      float nexpected = signal_params["rate"].asFloat() * this->live_time * this->efficiency_corr;
-      std::vector<std::string> filenames;
-      int rootfile = 0;
-      for (Json::Value::const_iterator it=signal_params["files"].begin();
-          it!=signal_params["files"].end();++it){
-        filenames.push_back((*it).asString());
-        if ((*it).asString().compare ((*it).asString().length() - 4, 4, "root") == 0)
-          rootfile = 1;
-      }
-      if (rootfile)
-        this->signals.push_back(Signal(name,title,nexpected,sigma,category,this->sample_fields,
-              this->observables,this->cuts,this->systematics,filenames));
-      else
-        this->signals.push_back(Signal(name,title,nexpected,sigma,category,this->hdf5_fields,this->sample_fields,
-              this->observables,this->cuts,this->systematics,filenames));
+      order.push_back(std::make_pair(false, files.size()));
+      files.push_back(get_signal_files(it.key().asString(), signal_params));
     }
   }
+
+  std::vector<Signal*> file_signals;
+  load_signals(files, &cache, file_signals);
+
+  // Sample the parts of each chain to get samples with the correct
+  // relative weighting. This draws random numbers, so is done in order.
+  for (size_t ichain=0;ichain<chained.size();ichain++){
+    ChainedSignal& chain = chained[ichain];
+    if (chain.cached){
+      continue;
+    }
+
+    std::vector<Signal> pdfs;
+    std::vector<double> params;
+    int nexpected_total = 0;
+    double efficiency_total = 0;
+    for (size_t i=0;i<chain.parts.size();i++){
+      pdfs.push_back(*file_signals[chain.parts[i]]);
+      params.push_back(pdfs.back().nexpected*10.0);
+      nexpected_total += pdfs.back().nexpected;
+      efficiency_total += pdfs.back().nexpected/pdfs.back().efficiency;
+    }
+    efficiency_total = nexpected_total/efficiency_total;
+
+    std::cout << "FitConfig::CreateMultiPDFSignal: Generating combined pdf for " << chain.name << std::endl;
+    for (size_t i=0;i<this->systematics.size();i++)
+      params.push_back(0);
+    std::pair<std::vector<float>, std::vector<int> > samples = make_fake_dataset(pdfs,this->systematics,this->observables,params,true);
+
+    chain.combined.nfields = this->sample_fields.size();
+    chain.combined.column_major = false;
+    chain.combined.samples.swap(samples.first);
+    chain.combined.weights.swap(samples.second);
+    chain.combined.nevents_physical = 0;
+    chain.combined.nevents = 0;
+    chain.combined.nexpected = nexpected_total;
+    chain.combined.efficiency = efficiency_total;
+    cache.store(chain.key, chain.combined);
+  }
+
+  // Now create a new pdf from the samples of each chain
+  std::vector<Signal*> chained_signals(chained.size(), NULL);
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (int i=0;i<(int) chained.size();i++){
+    chained_signals[i] = build_chained_signal(chained[i]);
+  }
+
+  for (size_t i=0;i<order.size();i++){
+    if (order[i].first){
+      this->signals.push_back(*chained_signals[order[i].second]);
+    }else{
+      this->signals.push_back(*file_signals[order[i].second]);
+    }
+  }
+
+  // the signals are copied, and the PDFs of chain parts are not used again
+  for (size_t i=0;i<file_signals.size();i++)
+    delete file_signals[i];
+  for (size_t i=0;i<chained_signals.size();i++)
+    delete chained_signals[i];
+}
+
+SignalFiles FitConfig::get_signal_files(const std::string& name,
+    const Json::Value& params) const {
+  SignalFiles files;
+  files.name = name;
+  files.title = params.get("title", name).asString();
+  files.category = params.get("category","").asString();
+  files.sigma = params.get("constraint", 0.0).asFloat() * this->live_time * this->efficiency_corr;
+  files.nexpected = params["rate"].asFloat() * this->live_time * this->efficiency_corr;
+  files.rootfile = false;
+  for (Json::Value::const_iterator it=params["files"].begin();
+      it!=params["files"].end();++it){
+    files.filenames.push_back((*it).asString());
+    if ((*it).asString().compare ((*it).asString().length() - 4, 4, "root") == 0)
+      files.rootfile = true;
+  }
+  return files;
+}
+
+PDFCacheKey FitConfig::signal_cache_key(const SignalFiles& files) const {
+  if (files.rootfile)
+    return Signal::cache_key("",std::vector<std::string>(),this->sample_fields,
+        this->observables,this->cuts,this->systematics,files.filenames);
+  return Signal::cache_key(files.name,this->hdf5_fields,this->sample_fields,
+      this->observables,this->cuts,this->systematics,files.filenames);
+}
+
+Signal* FitConfig::load_signal(const SignalFiles& files, const PDFCache* cache) {
+  std::vector<std::string> filenames(files.filenames);
+  if (files.rootfile)
+    return new Signal(files.name,files.title,files.nexpected,files.sigma,files.category,this->sample_fields,
+        this->observables,this->cuts,this->systematics,filenames,cache);
+  return new Signal(files.name,files.title,files.nexpected,files.sigma,files.category,this->hdf5_fields,this->sample_fields,
+      this->observables,this->cuts,this->systematics,filenames,cache);
+}
+
+void FitConfig::load_signals(const std::vector<SignalFiles>& files,
+    const PDFCache* cache, std::vector<Signal*>& signals) {
+  // Signals are independent, so each is built by one thread. Starting
+  // with the largest inputs keeps the slowest signal from starting last.
+  std::vector<std::pair<double, int> > sizes;
+  for (size_t i=0;i<files.size();i++){
+    double size = 0;
+    for (size_t j=0;j<files[i].filenames.size();j++){
+      struct stat st;
+      if (stat(files[i].filenames[j].c_str(), &st) == 0)
+        size += st.st_size;
+    }
+    sizes.push_back(std::make_pair(-size, (int) i));
+  }
+  std::sort(sizes.begin(), sizes.end());
+
+  // Older ROOT has no thread-safety switch; read_float_columns_ttree then
+  // reads one file at a time across all signals
+#if defined(_OPENMP) && ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+  ROOT::EnableThreadSafety();
+#endif
+
+  signals.assign(files.size(), NULL);
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (int i=0;i<(int) sizes.size();i++){
+    int index = sizes[i].second;
+    signals[index] = load_signal(files[index], cache);
+  }
+}
+
+Signal* FitConfig::build_chained_signal(ChainedSignal& chain) {
+  int nexpected_total = chain.combined.nexpected;
+  double efficiency_total = chain.combined.efficiency;
+
+  std::string title = chain.params.get("title", chain.name).asString();
+  std::string category = chain.params.get("category","").asString();
+  float sigma = chain.params.get("constraint", 0.0).asFloat() * this->live_time * this->efficiency_corr;
+  float nexpected = chain.params.get("rate",nexpected_total).asFloat() * this->live_time * this->efficiency_corr;
+  Signal* signal = new Signal(chain.name,title,nexpected,sigma,category,
+      this->observables,this->cuts,this->systematics,chain.combined.samples,this->sample_fields,chain.combined.weights);
+
+  // correct for efficiency
+  signal->efficiency *= efficiency_total;
+  signal->nevents_physical /= efficiency_total;
+  signal->sigma *= efficiency_total;
+  std::cout << "CORRECTED TO " << signal->nevents_physical << " " << signal->nevents << " " << signal->efficiency << std::endl;
+
+  float years = 1.0 * signal->nevents / (signal->nexpected / this->live_time);
+
+  std::cout << "FitConfig::CreateMultiPDFSignal: Initialized PDF for " << chain.name
+    << " using " << signal->nevents << " events (" << years << " y)"
+    << std::endl;
+  return signal;
 }
 
 void FitConfig::print() const {
   std::cout << "Fit:" << std::endl
     << "  Fake experiments: " << this->experiments << std::endl
+    << "  Concurrent experiments: " << this->parallel_experiments << std::endl
+    << "  Random seed: " << this->seed << std::endl
     << "  MCMC steps: " << this->steps << std::endl
     << "  Burn-in fraction: " << this->burnin_fraction << std::endl
+    << "  Adaptive proposal: " << (this->adaptive ? "yes" : "no") << std::endl
+    << "  Binned likelihood: " << (this->binned ? "yes" : "no") << std::endl
+    << "  Chains: " << this->chains << std::endl;
+  if (this->chains > 1) {
+    std::cout << "  Max. temperature: " << this->max_temperature << std::endl
+      << "  Swap interval: " << this->swap_interval << std::endl;
+  }
+  std::cout
+    << "  PDF cache: " << (this->pdf_cache.empty() ? "none" : this->pdf_cache) << std::endl
     << "  Output plot: " << this->output_file << std::endl;
 
   std::cout << "Experiment:" << std::endl
@@ -31,6 +31,37 @@ template <class T>
 size_t get_index_with_append(std::vector<T>& v, T o);
 
 
+/**
+ * \struct SignalFiles
+ *
+ * Parameters of a signal PDF built from files
+ */
+struct SignalFiles {
+  std::string name;  //!< string identifier
+  std::string title;  //!< histogram title in ROOT-LaTeX format
+  std::string category;  //!< category for plotting purposes
+  float nexpected;  //!< events expected in this fit
+  float sigma;  //!< constraint
+  std::vector<std::string> filenames;  //!< root or hdf5 files
+  bool rootfile;  //!< read root files rather than hdf5
+};
+
+
+/**
+ * \struct ChainedSignal
+ *
+ * A signal PDF sampled from the sum of several signals built from files
+ */
+struct ChainedSignal {
+  std::string name;  //!< string identifier
+  Json::Value params;  //!< signal parameters from the configuration
+  std::vector<size_t> parts;  //!< indices of the parts among signals from files
+  PDFCacheKey key;  //!< PDF cache key of the combined samples
+  PDFCacheEntry combined;  //!< combined samples, from the cache or the parts
+  bool cached;  //!< combined samples were found in the cache
+};
+
+
 /**
  * \class FitConfig
  * \brief Manages the configuration of a fit
@@ -53,12 +84,19 @@ class FitConfig {
     void print() const;
 
     unsigned experiments;  //!< number of ensemble experiments
+    unsigned parallel_experiments;  //!< experiments run concurrently
+    unsigned seed;  //!< random seed, 0 to choose one at run time
     unsigned steps;  //!< number of mcmc steps
     float confidence;  //!< confidence level for results (e.g. 0.9)
     float live_time;  //!< experiment live time in years
     float efficiency_corr;  //!< overall efficiency correction
     float burnin_fraction;  //!< fraction of steps to use for burn-in period
     bool debug_mode;  //!< enable/disable debugging mode (accept/save all)
+    unsigned chains;  //!< number of parallel-tempering chains
+    float max_temperature;  //!< temperature of the hottest chain
+    unsigned swap_interval;  //!< steps between chain swap proposals
+    bool adaptive;  //!< use the adaptive Metropolis proposal
+    bool binned;  //!< fit the data histogrammed in the PDF binning
     std::string output_file;  //!< base filename for output
     std::vector<Signal> signals;  //!< signal histograms and metadata
     std::vector<Systematic> systematics;  //!< Systematics used in PDFs
@@ -69,6 +107,31 @@ class FitConfig {
 
     std::vector<std::string> hdf5_fields; //!< Default Name and order of fields in hdf5 files
 
+    std::string pdf_cache;  //!< directory of cached PDF samples, "" for none
+
+  protected:
+    /** Read the parameters of a signal built from files */
+    SignalFiles get_signal_files(const std::string& name,
+                                 const Json::Value& params) const;
+
+    /** Get the PDF cache key of a signal built from files */
+    PDFCacheKey signal_cache_key(const SignalFiles& files) const;
+
+    /** Build a signal from files, using the PDF cache if there is one */
+    Signal* load_signal(const SignalFiles& files, const PDFCache* cache);
+
+    /**
+     * Build signals from files in parallel, largest input first.
+     *
+     * \param files Parameters of each signal
+     * \param cache PDF cache, or NULL
+     * \param signals Set to the signals, in the same order as files
+     */
+    void load_signals(const std::vector<SignalFiles>& files,
+                      const PDFCache* cache, std::vector<Signal*>& signals);
+
+    /** Build a chained signal from its combined samples */
+    Signal* build_chained_signal(ChainedSignal& chain);
 };
 
 #endif  // __CONFIG_H__
@@ -1,14 +1,13 @@
 #include <string>
 #include <sstream>
+#include <algorithm>
 #include <TH1F.h>
 #include <TMath.h>
-#include <TNtuple.h>
-#include <TEnv.h>
-#include <TDirectory.h>
 #include <assert.h>
 
 #include <sxmc/likelihood.h>
 #include <sxmc/errors.h>
+#include <sxmc/sample_store.h>
 
 std::string Interval::str() {
   float lower_error = this->point_estimate - this->lower;
@@ -89,7 +88,7 @@ ContourError::ContourError(LikelihoodSpace* _lspace, float _cl)
 
 
 ContourError::~ContourError() {
-  contour_points->Delete();
+  delete contour_points;
 }
 
 
@@ -100,23 +99,17 @@ Interval ContourError::get_interval(std::string name, float point_estimate) {
   interval.point_estimate = point_estimate;
   interval.coverage = -1;
 
-  // Plot projection of the requested parameter from the reduced space
-  int default_nbins = 100;
-  gEnv->GetValue("Hist.Binning.1D.x", default_nbins);
-  gEnv->SetValue("Hist.Binning.1D.x", 20000);
-  this->contour_points->Draw((name + ">>_hp").c_str(), "", "goff");
-  gEnv->SetValue("Hist.Binning.1D.x", default_nbins);
-  TH1F* hp = dynamic_cast<TH1F*>(gDirectory->FindObject("_hp"));
-  assert(hp);
-  hp->SetDirectory(NULL);
-
-  // Find extrema
-  int ll_bin = hp->FindFirstBinAbove(0);
-  interval.lower = hp->GetBinLowEdge(ll_bin);
-
-  int ul_bin = hp->FindLastBinAbove(0);
-  interval.upper = hp->GetBinLowEdge(ul_bin) +
-                   hp->GetBinWidth(ul_bin);
+  // Find extrema of the requested parameter in the reduced space
+  const float* v = this->contour_points->get_column(name);
+  size_t n = this->contour_points->get_entries();
+  assert(n > 0);
+
+  interval.lower = v[0];
+  interval.upper = v[0];
+  for (size_t i=1; i<n; i++) {
+    interval.lower = std::min(interval.lower, v[i]);
+    interval.upper = std::max(interval.upper, v[i]);
+  }
 
   return interval;
 }
@@ -9,8 +9,8 @@
 
 #include <string>
 
-class TNtuple;
 class LikelihoodSpace;
+class SampleStore;
 
 /** Types of error estimators. */
 typedef enum { ERROR_PROJECTION, ERROR_CONTOUR } ErrorType;
@@ -113,7 +113,8 @@ class ContourError : public ErrorEstimator {
     virtual Interval get_interval(std::string name, float point_estimate);
 
   protected:
-    TNtuple* contour_points;  //!< Likelihood space samples within the contour
+    SampleStore* contour_points;  //!< Likelihood space samples within the
+                                  //!< contour
 };
 
 #endif  // __ERRORS_H__
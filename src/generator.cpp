@@ -10,6 +10,7 @@
 
 #include <sxmc/generator.h>
 #include <sxmc/signals.h>
+#include <sxmc/rng.h>
 
 std::pair<std::vector<float>, std::vector<int> >   sample_pdf(TH1* hist, long int nsamples, long int maxsamples)
 {
@@ -149,9 +150,14 @@ std::pair<std::vector<float>, std::vector<int> >   sample_pdf(TH1* hist, long in
 std::pair<std::vector<float>, std::vector<int> >  make_fake_dataset(std::vector<Signal>& signals,
                                      std::vector<Systematic>& systematics,
                                      std::vector<Observable>& observables,
-                                     std::vector<double> params, bool poisson, int maxsamples) {
+                                     std::vector<double> params, bool poisson, int maxsamples,
+                                     unsigned long long seed, unsigned experiment) {
   std::cout << "make_fake_dataset: Generating dataset..." << std::endl;
 
+  if (seed == 0) {
+    seed = gRandom->Integer(2147483647) + 1;
+  }
+
   std::vector<double> syst_vals;
   for (size_t i=signals.size();i<signals.size()+systematics.size();i++){
     syst_vals.push_back(params[i]); 
@@ -167,9 +173,20 @@ std::pair<std::vector<float>, std::vector<int> >  make_fake_dataset(std::vector<
   std::vector<int> weights;
   std::vector<unsigned> observed(signals.size());
   for (size_t i=0;i<signals.size();i++){
-    observed[i] = \
-      dynamic_cast<pdfz::EvalHist*>(signals[i].histogram)->RandomSample(events,weights,params[i],
-          syst_vals,upper,lower,poisson,maxsamples);
+    RNGState rng;
+    rng_init(&rng, seed, experiment, RNG_FAKE_DATA_CHAIN, i);
+    pdfz::EvalHist* hist = dynamic_cast<pdfz::EvalHist*>(signals[i].histogram);
+
+    // Above maxsamples, fluctuating each bin costs far less than drawing
+    // the events one at a time
+    if (poisson && params[i] > maxsamples) {
+      observed[i] = hist->BinnedSample(events, weights, params[i], syst_vals,
+                                       upper, lower, maxsamples, &rng);
+    }
+    else {
+      observed[i] = hist->RandomSample(events, weights, params[i], syst_vals,
+                                       upper, lower, poisson, maxsamples, &rng);
+    }
 
     std::cout << "make_fake_dataset: " << signals[i].name << ": "
               << observed[i] << " events (" << signals[i].nexpected
@@ -180,6 +197,70 @@ std::pair<std::vector<float>, std::vector<int> >  make_fake_dataset(std::vector<
 }
 
 
+std::pair<std::vector<float>, std::vector<int> > bin_dataset(const std::vector<float>& data,
+                                     const std::vector<int>& weights,
+                                     const std::vector<Observable>& observables) {
+  const size_t nobs = observables.size();
+  const size_t nevents = data.size() / nobs;
+
+  // data column i holds the observable with field index i, as in the PDFs
+  std::vector<double> lower(nobs), upper(nobs);
+  std::vector<int> nbins(nobs), bin_stride(nobs);
+  for (size_t i=0; i<nobs; i++) {
+    for (size_t j=0; j<nobs; j++) {
+      if (observables[j].field_index == i) {
+        lower[i] = observables[j].lower;
+        upper[i] = observables[j].upper;
+        nbins[i] = observables[j].bins;
+        break;
+      }
+    }
+  }
+  size_t total_nbins = 1;
+  for (int i=nobs-1; i>=0; i--) {
+    bin_stride[i] = total_nbins;
+    total_nbins *= nbins[i];
+  }
+
+  std::vector<long long> counts(total_nbins, 0);
+  for (size_t i=0; i<nevents; i++) {
+    int bin_id = 0;
+    bool in_range = true;
+    // same bin assignment as the pdfz histogram
+    for (size_t j=0; j<nobs; j++) {
+      double x = data[i * nobs + j];
+      if (x < lower[j] || x >= upper[j]) {
+        in_range = false;
+        break;
+      }
+      bin_id += (int) ((x - lower[j]) * (nbins[j] / (upper[j] - lower[j]))) *
+                bin_stride[j];
+    }
+    if (in_range) {
+      counts[bin_id] += weights[i];
+    }
+  }
+
+  std::vector<float> centers;
+  std::vector<int> bin_weights;
+  for (size_t b=0; b<total_nbins; b++) {
+    if (counts[b] == 0) {
+      continue;
+    }
+    for (size_t j=0; j<nobs; j++) {
+      int ibin = (b / bin_stride[j]) % nbins[j];
+      centers.push_back(lower[j] + (ibin + 0.5) * (upper[j] - lower[j]) / nbins[j]);
+    }
+    bin_weights.push_back(counts[b]);
+  }
+
+  std::cout << "bin_dataset: " << nevents << " events in "
+            << bin_weights.size() << " occupied bins" << std::endl;
+
+  return std::make_pair(centers, bin_weights);
+}
+
+
 unsigned nint(float nexpected)
 {
   return TMath::Nint(nexpected);
@@ -16,9 +16,8 @@
 /**
  * Make a fake data set.
  *
- * Create a fake data set by extracting ROOT histograms from each signal's PDF
- * and sampling. Only works for signals with 1, 2, or 3 observables.
- * Systematics are applied to PDFs before sampling.
+ * Create a fake data set by sampling each signal's PDF histogram, with
+ * systematics applied, within the bounds of the observables.
  *
  * The output array of sampled observations is in a row-major format like:
  *
@@ -31,6 +30,11 @@
  * \param observables List of Observables common to all PDFs
  * \param params List of parameters (normalizations then systematics)
  * \param poisson If true, Poisson-distribute the signal rates
+ * \param maxsamples Above this many events per signal, use weighted events;
+ *                   Poisson data sets this large are fluctuated bin by bin
+ * \param seed Random seed, or 0 to draw one from gRandom
+ * \param experiment Experiment index; signal j draws from the stream
+ *                   (seed, experiment, RNG_FAKE_DATA_CHAIN, j)
  * \return Array with samples
  */
 
@@ -38,7 +42,29 @@ std::pair<std::vector<float>, std::vector<int> > make_fake_dataset(std::vector<S
                                      std::vector<Systematic>& systematics,
                                      std::vector<Observable>& observables,
                                      std::vector<double> params,
-                                     bool poisson=true, int maxsamples=1e7);
+                                     bool poisson=true, int maxsamples=1e7,
+                                     unsigned long long seed=0,
+                                     unsigned experiment=0);
+
+/**
+ * Histogram a data set into the PDF binning.
+ *
+ * Bins the events with the same bounds and bin counts as the signal PDFs,
+ * and returns one event at the center of each occupied bin, weighted by the
+ * number of events in it. Events outside the bounds are dropped. Since the
+ * histogram PDFs are constant within a bin, the extended likelihood of the
+ * binned data set is the binned Poisson likelihood, and differs from that of
+ * the original events only by a constant. A fit then costs O(nbins) rather
+ * than O(nevents) per step.
+ *
+ * \param data Event observables, row-major as from make_fake_dataset
+ * \param weights Event weights
+ * \param observables List of Observables common to all PDFs
+ * \return Bin centers and counts of the occupied bins
+ */
+std::pair<std::vector<float>, std::vector<int> > bin_dataset(const std::vector<float>& data,
+                                     const std::vector<int>& weights,
+                                     const std::vector<Observable>& observables);
 
 /* Uses ROOT to sample a histogram, but determines
  * whether it is a TH1,TH2,TH3 and responds appropriately
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <hdf5.h>
 #include <hdf5_hl.h>
 
@@ -85,3 +86,200 @@ close_file:
     return status;
 }
 
+
+
+// Select rows [first, first + count) of the given sorted columns, merging
+// adjacent columns into a single block
+static herr_t select_columns(hid_t space, const std::vector<unsigned int>& columns,
+                             hsize_t first, hsize_t count) {
+    herr_t status = H5Sselect_none(space);
+    size_t i = 0;
+    while (status >= 0 && i < columns.size()) {
+        size_t j = i + 1;
+        while (j < columns.size() && columns[j] == columns[j - 1] + 1) {
+            j++;
+        }
+        hsize_t start[2] = { first, columns[i] };
+        hsize_t block[2] = { count, j - i };
+        status = H5Sselect_hyperslab(space, H5S_SELECT_OR, start, NULL,
+                                     block, NULL);
+        i = j;
+    }
+    return status;
+}
+
+
+// Read rows [first, first + count) of the selected columns into buffer
+static herr_t read_column_chunk(hid_t dataset_id, hid_t file_space,
+                                const std::vector<unsigned int>& columns,
+                                hsize_t first, hsize_t count,
+                                std::vector<float>& buffer) {
+    hsize_t mem_dims[2] = { count, columns.size() };
+    herr_t status;
+    buffer.resize(count * columns.size());
+
+#ifdef _OPENMP
+    #pragma omp critical(hdf5)
+#endif
+    {
+        hid_t mem_space = H5Screate_simple(2, mem_dims, NULL);
+        status = mem_space < 0 ? -1 : 0;
+        if (status >= 0) {
+            status = select_columns(file_space, columns, first, count);
+        }
+        if (status >= 0) {
+            status = H5Dread(dataset_id, H5T_NATIVE_FLOAT, mem_space, file_space,
+                             H5P_DEFAULT, &buffer[0]);
+        }
+        if (mem_space >= 0) {
+            H5Sclose(mem_space);
+        }
+    }
+
+    return status;
+}
+
+
+herr_t read_float_columns_hdf5(const std::string &filename,
+                               const std::string &dataset,
+                               const std::vector<unsigned int> &columns,
+                               const std::vector<ColumnCut> &cuts,
+                               std::vector<float> &data,
+                               size_t &nrows,
+                               size_t chunk_rows) {
+    hid_t file_id, dataset_id = -1, file_space = -1;
+    herr_t status;
+    hsize_t dims[2] = { 0, 0 };
+
+    // The HDF5 library is not thread-safe as usually built, so every call
+    // into it, from any thread reading any file, is in this critical section
+#ifdef _OPENMP
+    #pragma omp critical(hdf5)
+#endif
+    {
+        file_id = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+        if (file_id >= 0) {
+            dataset_id = H5Dopen2(file_id, dataset.c_str(), H5P_DEFAULT);
+        }
+        if (dataset_id >= 0) {
+            file_space = H5Dget_space(dataset_id);
+        }
+        status = file_space < 0 ? -1 : 0;
+        if (status >= 0 && H5Sget_simple_extent_ndims(file_space) != 2) {
+            status = -1;
+        }
+        if (status >= 0) {
+            status = H5Sget_simple_extent_dims(file_space, dims, NULL);
+        }
+    }
+
+    // Columns read from the file, in increasing order, and where each
+    // output and cut column is found among them
+    std::vector<unsigned int> read_columns(columns);
+    for (size_t i=0; i<cuts.size(); i++) {
+        read_columns.push_back(cuts[i].column);
+    }
+    std::sort(read_columns.begin(), read_columns.end());
+    read_columns.erase(std::unique(read_columns.begin(), read_columns.end()),
+                       read_columns.end());
+    if (!read_columns.empty() && read_columns.back() >= dims[1]) {
+        status = -1;
+    }
+
+    std::vector<size_t> column_index(columns.size());
+    for (size_t i=0; i<columns.size(); i++) {
+        column_index[i] = std::lower_bound(read_columns.begin(), read_columns.end(),
+                                           columns[i]) - read_columns.begin();
+    }
+    std::vector<size_t> cut_index(cuts.size());
+    for (size_t i=0; i<cuts.size(); i++) {
+        cut_index[i] = std::lower_bound(read_columns.begin(), read_columns.end(),
+                                        cuts[i].column) - read_columns.begin();
+    }
+
+    const hsize_t nchunks = (dims[0] + chunk_rows - 1) / chunk_rows;
+    const size_t nread = read_columns.size();
+    std::vector<float> buffers[2];
+
+    if (status >= 0 && nchunks > 0 && nread > 0) {
+        status = read_column_chunk(dataset_id, file_space, read_columns, 0,
+                                   std::min<hsize_t>(chunk_rows, dims[0]),
+                                   buffers[0]);
+    }
+
+    for (hsize_t ichunk=0; ichunk < nchunks && status >= 0; ichunk++) {
+        herr_t next_status = 0;
+
+        // Read the next chunk while filtering this one. Only one thread
+        // calls into HDF5 at a time.
+#ifdef _OPENMP
+        #pragma omp parallel sections num_threads(2)
+#endif
+        {
+#ifdef _OPENMP
+            #pragma omp section
+#endif
+            {
+                hsize_t first = (ichunk + 1) * chunk_rows;
+                if (first < dims[0] && nread > 0) {
+                    next_status = read_column_chunk(
+                        dataset_id, file_space, read_columns, first,
+                        std::min<hsize_t>(chunk_rows, dims[0] - first),
+                        buffers[(ichunk + 1) % 2]);
+                }
+            }
+
+#ifdef _OPENMP
+            #pragma omp section
+#endif
+            {
+                const float* buffer = nread > 0 ? &buffers[ichunk % 2][0] : NULL;
+                size_t count = std::min<hsize_t>(chunk_rows, dims[0] - ichunk * chunk_rows);
+                size_t n = data.size();
+                data.resize(n + count * columns.size());
+
+                for (size_t irow=0; irow<count; irow++) {
+                    const float* row = buffer + irow * nread;
+                    bool pass = true;
+                    for (size_t i=0; i<cuts.size(); i++) {
+                        float v = row[cut_index[i]];
+                        if (v < cuts[i].lower || v > cuts[i].upper) {
+                            pass = false;
+                            break;
+                        }
+                    }
+                    if (!pass) {
+                        continue;
+                    }
+                    for (size_t i=0; i<columns.size(); i++) {
+                        data[n++] = row[column_index[i]];
+                    }
+                }
+
+                data.resize(n);
+            }
+        }
+
+        status = next_status;
+    }
+
+    if (status >= 0) {
+        nrows += dims[0];
+    }
+
+#ifdef _OPENMP
+    #pragma omp critical(hdf5)
+#endif
+    {
+        if (file_space >= 0) {
+            H5Sclose(file_space);
+        }
+        if (dataset_id >= 0) {
+            H5Dclose(dataset_id);
+        }
+        if (file_id >= 0) {
+            H5Fclose(file_id);
+        }
+    }
+    return status;
+}
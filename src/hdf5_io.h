@@ -43,5 +43,43 @@ int read_float_vector_hdf5(const std::string& filename,
                            std::vector<float>& data, 
                            std::vector<unsigned int>& rank);
 
+/**
+ * \struct ColumnCut
+ *
+ * A range a column must fall in (inclusive) for its row to be read
+ */
+struct ColumnCut {
+  unsigned int column;  //!< Index of the column in the dataset
+  double lower;  //!< Lower limit
+  double upper;  //!< Upper limit
+};
+
+/**
+ * Opens an HDF5 file and reads some columns of a two-dimensional float
+ * dataset, keeping only the rows that pass all of the cuts.
+ *
+ * Rows are read chunk_rows at a time, selecting only the columns that are
+ * needed with hyperslabs, so memory use is bounded by the chunk size and
+ * the output. With OpenMP, the next chunk is read while the current one
+ * is filtered. It may be called from several threads at once; their
+ * calls into HDF5 are serialized, but filtering is not.
+ *
+ * \param filename Name of file to read from
+ * \param dataset Name of the HDF5 dataset to read
+ * \param columns Columns to read, in the order they are stored in data
+ * \param cuts Cuts to apply to each row
+ * \param data Passing rows are appended to this, row-major
+ * \param nrows Incremented by the number of rows in the dataset
+ * \param chunk_rows Number of rows to read at a time
+ * \return Status code, negative in case of failure
+ */
+int read_float_columns_hdf5(const std::string& filename,
+                            const std::string& dataset,
+                            const std::vector<unsigned int>& columns,
+                            const std::vector<ColumnCut>& cuts,
+                            std::vector<float>& data,
+                            size_t& nrows,
+                            size_t chunk_rows=65536);
+
 #endif // __HDF5_IO_H__
 
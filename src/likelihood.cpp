@@ -3,24 +3,42 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <algorithm>
 #include <assert.h>
 #include <TNtuple.h>
-#include <TEnv.h>
 #include <TH1F.h>
-#include <TDirectory.h>
 
 #include <sxmc/likelihood.h>
 #include <sxmc/errors.h>
+#include <sxmc/sample_store.h>
 #include <sxmc/utils.h>
 
-LikelihoodSpace::LikelihoodSpace(TNtuple* _samples) {
+LikelihoodSpace::LikelihoodSpace(SampleStore* _samples) {
   this->samples = _samples;
   this->ml_params = extract_best_fit(this->ml);
 }
 
 
 LikelihoodSpace::~LikelihoodSpace() {
-  samples->Delete();
+  delete samples;
+}
+
+
+std::vector<std::string> LikelihoodSpace::get_parameter_names() {
+  std::vector<std::string> names;
+  for (size_t i=0; i<this->samples->get_ncolumns(); i++) {
+    std::string name = this->samples->get_names()[i];
+    if (name == "likelihood") {
+      continue;
+    }
+    names.push_back(name);
+  }
+  return names;
+}
+
+
+TNtuple* LikelihoodSpace::get_ntuple(std::string name) {
+  return this->samples->to_ntuple(name);
 }
 
 
@@ -44,16 +62,8 @@ void LikelihoodSpace::print_best_fit() {
 
 void LikelihoodSpace::print_correlations() {
   std::cout << "-- Correlation matrix --" << std::endl;
-  std::vector<float> correlations = get_correlation_matrix(this->samples);
-
-  std::vector<std::string> names;
-  for (int i=0; i<this->samples->GetListOfBranches()->GetEntries(); i++) {
-    std::string name = this->samples->GetListOfBranches()->At(i)->GetName();
-    if (name == "likelihood") {
-      continue;
-    }
-    names.push_back(name);
-  }
+  std::vector<float> correlations = get_correlation_matrix(*this->samples);
+  std::vector<std::string> names = get_parameter_names();
 
   for(size_t i=0; i<names.size(); i++) {
     std::cout << std::setw(20) << names[i] << " ";
@@ -68,95 +78,54 @@ void LikelihoodSpace::print_correlations() {
 
 
 TH1F* LikelihoodSpace::get_projection(std::string name) {
-  int default_nbins = 100;
-  gEnv->GetValue("Hist.Binning.1D.x", default_nbins);
-  gEnv->SetValue("Hist.Binning.1D.x", 10000);
-  this->samples->Draw((name + ">>_hp").c_str(), "", "goff");
-  gEnv->SetValue("Hist.Binning.1D.x", default_nbins);
-  TH1F* hp = dynamic_cast<TH1F*>(gDirectory->FindObject("_hp"));
-  assert(hp);
-  hp->SetDirectory(NULL);
-
-  return hp;
-}
-
-
-TNtuple* LikelihoodSpace::get_contour(float delta) {
-  TNtuple* contour = (TNtuple*) this->samples->Clone("lscontour");
-  contour->Reset();
-
-  // Get list of branch names
-  std::vector<std::string> names;
-  for (int i=0; i<this->samples->GetListOfBranches()->GetEntries(); i++) {
-    std::string name = this->samples->GetListOfBranches()->At(i)->GetName();
-    if (name == "likelihood") {
-      continue;
-    }
-    names.push_back(name);
+  const float* v = this->samples->get_column(name);
+  size_t n = this->samples->get_entries();
+
+  float lower = (n > 0 ? v[0] : 0);
+  float upper = lower;
+  for (size_t i=0; i<n; i++) {
+    lower = std::min(lower, v[i]);
+    upper = std::max(upper, v[i]);
   }
 
-  float* params_branch = new float[names.size()];
-  for (size_t i=0; i<names.size(); i++) {
-    this->samples->SetBranchAddress(names[i].c_str(), &params_branch[i]);
+  // pad the range so the maximum falls inside the last bin
+  float pad = (upper > lower ? 1e-4 * (upper - lower) : 1);
+  TH1F* hp = new TH1F("_hp", name.c_str(), 10000, lower - pad, upper + pad);
+  hp->SetDirectory(NULL);
+  for (size_t i=0; i<n; i++) {
+    hp->Fill(v[i]);
   }
 
-  float ml_branch;
-  this->samples->SetBranchAddress("likelihood", &ml_branch);
-
-  // Build a new TNtuple with samples inside the contour
-  float* v = new float[names.size() + 1];
-  for (int i=0; i<this->samples->GetEntries(); i++) {
-    this->samples->GetEntry(i);
-    if (ml_branch < this->ml + delta) {
-      for (size_t j=0; j<names.size(); j++) {
-        v[j] = params_branch[j];
-      }
-      v[names.size()] = ml_branch;
-      contour->Fill(v);
-    }
-  }
+  return hp;
+}
 
-  this->samples->ResetBranchAddresses();
-  delete[] v;
 
-  return contour;
+SampleStore* LikelihoodSpace::get_contour(float delta) {
+  return this->samples->select_below("likelihood", this->ml + delta);
 }
 
 
 std::map<std::string, Interval>
 LikelihoodSpace::extract_best_fit(float& ml, ErrorType error_type) {
-  // Get list of branch names
-  std::vector<std::string> names;
-  for (int i=0; i<this->samples->GetListOfBranches()->GetEntries(); i++) {
-    std::string name = this->samples->GetListOfBranches()->At(i)->GetName();
-    if (name == "likelihood") {
-      continue;
-    }
-    names.push_back(name);
-  }
+  std::vector<std::string> names = get_parameter_names();
 
   // Extract likelihood-maximizing parameters
-  float* params_branch = new float[names.size()];
-  for (size_t j=0; j<names.size(); j++) {
-    this->samples->SetBranchAddress(names[j].c_str(), &params_branch[j]);
-  }
-
-  float ml_branch;
-  this->samples->SetBranchAddress("likelihood", &ml_branch);
-
-  float* params = new float[names.size()];
+  const float* likelihood = this->samples->get_column("likelihood");
+  size_t best = 0;
   ml = 1e9;
-  for (int j=0; j<this->samples->GetEntries(); j++) {
-    this->samples->GetEntry(j);
-    if (ml_branch < ml) {
-      ml = ml_branch;
-      for (size_t k=0; k<names.size(); k++) {
-        params[k] = params_branch[k];
-      }
+  for (size_t j=0; j<this->samples->get_entries(); j++) {
+    if (likelihood[j] < ml) {
+      ml = likelihood[j];
+      best = j;
     }
   }
 
-  this->samples->ResetBranchAddresses();
+  std::vector<float> params(names.size(), 0);
+  if (this->samples->get_entries() > 0) {
+    for (size_t k=0; k<names.size(); k++) {
+      params[k] = this->samples->get_column(names[k])[best];
+    }
+  }
 
   // Extract errors
   ErrorEstimator* error = NULL;
@@ -178,7 +147,6 @@ LikelihoodSpace::extract_best_fit(float& ml, ErrorType error_type) {
   }
 
   delete error;
-  delete[] params;
 
   return best_fit;
 }
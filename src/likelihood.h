@@ -9,8 +9,10 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include <sxmc/errors.h>
+#include <sxmc/sample_store.h>
 
 class TNtuple;
 class TH1F;
@@ -18,19 +20,19 @@ class TH1F;
 /**
  * Likelihood space.
  *
- * Wraps a TNtuple containing samples from the likelihood function, providing
- * statistics functions.
+ * Wraps a SampleStore containing samples from the likelihood function,
+ * providing statistics functions. The last column holds the likelihood.
  */
 class LikelihoodSpace {
   public:
     /**
      * Constructor.
      *
-     * Note: The instance takes over ownership of the samples TNtuple!
+     * Note: The instance takes over ownership of the samples!
      *
      * \param samples A set of samples of the likelihood space
      */
-    LikelihoodSpace(TNtuple* samples);
+    LikelihoodSpace(SampleStore* samples);
 
     /** Destructor. */
     virtual ~LikelihoodSpace();
@@ -56,9 +58,9 @@ class LikelihoodSpace {
      * Get points within a given distance of the maximum.
      *
      * \param delta Number of likelihood units from max to include
-     * \returns TNtuple with requested samples
+     * \returns SampleStore with requested samples (caller owns)
      */
-    TNtuple* get_contour(float delta);
+    SampleStore* get_contour(float delta);
 
     /**
      * Extract the best-fit parameters and uncertainties.
@@ -70,10 +72,22 @@ class LikelihoodSpace {
     std::map<std::string, Interval>
     extract_best_fit(float& ml, ErrorType error_type=ERROR_CONTOUR);
 
-    TNtuple* GetSamples(){return samples;};
+    /** Get the samples of the likelihood function. */
+    const SampleStore* get_samples() const { return samples; }
+
+    /**
+     * Export the samples to a new TNtuple.
+     *
+     * \param name Name of the TNtuple
+     * \returns TNtuple with all samples (caller owns)
+     */
+    TNtuple* get_ntuple(std::string name="lspace");
 
   private:
-    TNtuple* samples;  //!< Samples of the likelihood function
+    /** Get the names of the parameters, i.e. all columns but likelihood. */
+    std::vector<std::string> get_parameter_names();
+
+    SampleStore* samples;  //!< Samples of the likelihood function
     std::map<std::string, Interval> ml_params;  //!< Likelihood-maximizing pars
     float ml;  //!< The maximum likelihood (negative for NLL)
 };
@@ -1,21 +1,23 @@
 #include <iostream>
 #include <vector>
 #include <cmath>
+#include <cstring>
 #include <string>
+#include <sstream>
+#include <algorithm>
 #include <assert.h>
 #include <hemi/hemi.h>
 #include <TH1D.h>
-#include <TH1F.h>
 #include <TH2F.h>
 #include <TF1.h>
-#include <TNtuple.h>
 #include <TRandom.h>
 #include <TStopwatch.h>
-#include <TDirectory.h>
 
 #include <sxmc/mcmc.h>
 #include <sxmc/signals.h>
 #include <sxmc/likelihood.h>
+#include <sxmc/sample_store.h>
+#include <sxmc/utils.h>
 
 #ifndef __HEMI_ARRAY_H__
 #define __HEMI_ARRAY_H__
@@ -24,7 +26,9 @@
 
 MCMC::MCMC(const std::vector<Signal>& signals,
            const std::vector<Systematic>& systematics,
-           const std::vector<Observable>& observables) {
+           const std::vector<Observable>& observables,
+           unsigned long long seed, unsigned experiment)
+    : seed(seed), experiment(experiment) {
   this->nsignals = signals.size();
   this->nsystematics = systematics.size();
   this->nobservables = observables.size();
@@ -54,242 +58,644 @@ MCMC::MCMC(const std::vector<Signal>& signals,
       systematics[i].sigma;
   }
 
-  // references to pdfz::Eval histograms
+  this->parameter_fixed.resize(this->nparameters, false);
+  for (size_t i=0; i<this->nsystematics; i++) {
+    this->parameter_fixed[this->nsignals + i] = systematics[i].fixed;
+  }
+
+  // references to pdfz::Eval histograms, and the parameters each depends on
   this->pdfs.resize(this->nsignals);
+  this->pdf_parameters.resize(this->nsignals);
   for (size_t i=0; i<this->nsignals; i++) {
     this->pdfs[i] = signals[i].histogram;
+    std::vector<int> pars = this->pdfs[i]->GetSystematicParameters();
+    for (size_t j=0; j<pars.size(); j++) {
+      this->pdf_parameters[i].push_back(this->nsignals + pars[j]);
+    }
   }
 
-  // list of parameters for output ntuple
+  // list of parameters for output samples
   for (size_t i=0; i<signals.size(); i++) {
-    this->varlist += (signals[i].name + ":");
     this->parameter_names.push_back(signals[i].name);
   }
   for (size_t i=0; i<systematics.size(); i++) {
-    this->varlist += (systematics[i].name + ":");
     this->parameter_names.push_back(systematics[i].name);
   }
-  this->varlist += "likelihood";
   this->parameter_names.push_back("likelihood");
+}
+
+
+MCMC::~MCMC() {
+  delete parameter_means;
+  delete parameter_sigma;
+}
+
 
-  this->rngs = new hemi::Array<RNGState>(this->nparameters, true);
+/**
+ * \struct LUTColumn
+ * \brief Records the parameters a lookup table column was evaluated at
+ */
+struct LUTColumn {
+  LUTColumn() : valid(false) {}
 
-  // if compiling device code, initialize the RNGs
+  /** True if the column holds the PDF evaluated at the given parameters */
+  bool matches(const double* v, const std::vector<size_t>& pars) const {
+    if (!valid) {
+      return false;
+    }
+    for (size_t i=0; i<pars.size(); i++) {
+      if (key[i] != v[pars[i]]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /** Record the parameters the column is evaluated at */
+  void set(const double* v, const std::vector<size_t>& pars) {
+    key.resize(pars.size());
+    for (size_t i=0; i<pars.size(); i++) {
+      key[i] = v[pars[i]];
+    }
+    valid = true;
+  }
+
+  bool valid;  //!< false until the column is first written
+  std::vector<double> key;  //!< values of the parameters the pdf depends on
+};
+
+
+/**
+ * Copy one PDF's column between lookup tables
+ *
+ * \param dst Destination lookup table
+ * \param dst_offset Offset of the column in dst
+ * \param src Source lookup table
+ * \param src_offset Offset of the column in src
+ * \param n Length of the column
+ */
+static void copy_lut_column(hemi::Array<float>& dst, size_t dst_offset,
+                            hemi::Array<float>& src, size_t src_offset,
+                            size_t n) {
 #ifdef __CUDACC__
-  this->rngs->writeOnlyHostPtr();
-  int bs = 128;
-  int nb = this->nparameters / bs + 1;
-  assert(nb < 8);
-  init_device_rngs<<<nb, bs>>>(this->nparameters, 1234, this->rngs->ptr());
+  checkCuda(cudaMemcpy(dst.ptr() + dst_offset, src.readOnlyPtr() + src_offset,
+                       n * sizeof(float), cudaMemcpyDeviceToDevice));
 #else
-  this->rngs->writeOnlyHostPtr();
+  memcpy(dst.ptr() + dst_offset, src.readOnlyPtr() + src_offset,
+         n * sizeof(float));
 #endif
 }
 
 
-MCMC::~MCMC() {
-  delete parameter_means;
-  delete parameter_sigma;
-  delete rngs;
-}
+/**
+ * \struct Chain
+ * \brief Per-chain buffers for a (possibly tempered) random walk
+ */
+struct Chain {
+  Chain(size_t nparameters, size_t nsignals, unsigned nnllthreads,
+        unsigned sync_interval, double _temperature)
+      : temperature(_temperature), lut_offset(0),
+        lut_columns(nsignals), cache_columns(nsignals),
+        steps(0), accepted(0), swaps_proposed(0), swaps_accepted(0) {
+    current_vector = new hemi::Array<double>(nparameters, true);
+    proposed_vector = new hemi::Array<double>(nparameters, true);
+    proposed_vector->writeOnlyHostPtr();  // touch to set valid
+    normalizations = new hemi::Array<unsigned>(nsignals, true);
+    normalizations->writeOnlyHostPtr();
+    current_nll = new hemi::Array<double>(1, true);
+    current_nll->writeOnlyHostPtr();
+    proposed_nll = new hemi::Array<double>(1, true);
+    proposed_nll->writeOnlyHostPtr();
+    jump_width = new hemi::Array<float>(nparameters, true);
+    event_partial_sums = new hemi::Array<double>(nnllthreads, true);
+    event_partial_sums->writeOnlyHostPtr();
+    event_total_sum = new hemi::Array<double>(1, true);
+    event_total_sum->writeOnlyHostPtr();
+    jump_counter = new hemi::Array<int>(1, true);
+    jump_counter->writeOnlyHostPtr()[0] = 0;
+    accept_counter = new hemi::Array<int>(1, true);
+    accept_counter->writeOnlyHostPtr()[0] = 0;
+    jump_buffer = new hemi::Array<float>(sync_interval * (nparameters + 1),
+                                         true);
+    cholesky = new hemi::Array<double>(nparameters * nparameters, true);
+    jump_z = new hemi::Array<double>(nparameters, true);
+    jump_z->writeOnlyHostPtr();
+    adapted = false;
+    covariance.reset(nparameters);
+    rngs = new hemi::Array<RNGState>(nparameters, true);
+#ifdef __CUDACC__
+    checkCuda(cudaStreamCreate(&stream));
+#else
+    stream = 0;
+#endif
+  }
+
+  ~Chain() {
+    delete current_vector;
+    delete proposed_vector;
+    delete normalizations;
+    delete current_nll;
+    delete proposed_nll;
+    delete jump_width;
+    delete event_partial_sums;
+    delete event_total_sum;
+    delete jump_counter;
+    delete accept_counter;
+    delete jump_buffer;
+    delete cholesky;
+    delete jump_z;
+    delete rngs;
+#ifdef __CUDACC__
+    cudaStreamDestroy(stream);
+#endif
+  }
 
+  double temperature;  //!< chain temperature
+  size_t lut_offset;  //!< offset of this chain's PDF values in the lut
+  hemi::Array<RNGState>* rngs;  //!< generator for each parameter
+  hemi::Array<double>* current_vector;  //!< current parameters
+  hemi::Array<double>* proposed_vector;  //!< proposed parameters
+  hemi::Array<unsigned>* normalizations;  //!< normalizations after systs
+  hemi::Array<double>* current_nll;  //!< NLL at the current parameters
+  hemi::Array<double>* proposed_nll;  //!< NLL at the proposed parameters
+  hemi::Array<float>* jump_width;  //!< jump distribution widths
+  hemi::Array<double>* event_partial_sums;  //!< event term partial sums
+  hemi::Array<double>* event_total_sum;  //!< event term total
+  hemi::Array<int>* jump_counter;  //!< number of steps in jump buffer
+  hemi::Array<int>* accept_counter;  //!< number of accepted steps in buffer
+  hemi::Array<float>* jump_buffer;  //!< steps, transferred periodically
+  hemi::Array<double>* cholesky;  //!< adaptive proposal covariance factor
+  hemi::Array<double>* jump_z;  //!< scratch space for correlated jumps
+  RunningCovariance covariance;  //!< running covariance of the chain
+  bool adapted;  //!< true once the proposal covariance is set
+  cudaStream_t stream;  //!< stream for this chain's kernels
+  std::vector<LUTColumn> lut_columns;  //!< state of each pdf's lut column
+  std::vector<LUTColumn> cache_columns;  //!< state of the current-state copy
+  unsigned long steps;  //!< total steps taken
+  unsigned long accepted;  //!< total steps accepted
+  unsigned long swaps_proposed;  //!< swaps proposed with the next chain
+  unsigned long swaps_accepted;  //!< swaps accepted with the next chain
+};
+
+
+/**
+ * Update a chain's adaptive Metropolis proposal (Haario et al., 2001)
+ *
+ * Adds the buffered steps to the chain's running covariance, then sets the
+ * proposal covariance to 2.4^2/d times the sample covariance of the d free
+ * parameters, with a small diagonal regularization. The proposal is left as
+ * it is until there are enough samples and every free parameter has moved,
+ * or if the covariance is not positive definite.
+ *
+ * \param c The chain
+ * \param njumps Number of steps in the chain's jump buffer
+ * \param fixed Parameters which are held constant
+ */
+static void adapt_proposal(Chain* c, int njumps,
+                           const std::vector<bool>& fixed) {
+  size_t n = fixed.size();
+  const float* buffer = c->jump_buffer->readOnlyHostPtr();
+  for (int j=0; j<njumps; j++) {
+    c->covariance.add(buffer + j * (n + 1));
+  }
 
-LikelihoodSpace* MCMC::operator()(std::vector<float>& data, std::vector<int>& weights, unsigned nsteps,
-                                  float burnin_fraction, const bool debug_mode,
-                                  unsigned sync_interval) {
-  // cuda/hemi block sizes
-  int bs = 128;
-  int nb = this->nsignals / bs + 1;
-  assert(nb < 8);
+  size_t nfree = std::count(fixed.begin(), fixed.end(), false);
+  if (nfree == 0 || c->covariance.entries() < 10 * nfree) {
+    return;
+  }
 
-  unsigned burnin_steps = nsteps * burnin_fraction;
+  // fixed parameters are decoupled, and get zero width below
+  const double scale = 2.4 * 2.4 / nfree;
+  std::vector<double> cov(n * n, 0);
+  for (size_t i=0; i<n; i++) {
+    for (size_t j=0; j<=i; j++) {
+      if (fixed[i] || fixed[j]) {
+        cov[i * n + j] = cov[j * n + i] = (i == j ? 1 : 0);
+        continue;
+      }
+      cov[i * n + j] = cov[j * n + i] = \
+        scale * c->covariance.covariance(i, j);
+    }
+  }
+  for (size_t i=0; i<n; i++) {
+    if (!fixed[i]) {
+      if (!(cov[i * n + i] > 0)) {
+        return;
+      }
+      cov[i * n + i] *= 1 + 1e-6;
+    }
+  }
 
-  // Ntuple to hold likelihood space
-  TNtuple* nt = new TNtuple("lspace", "Likelihood space",
-                            this->varlist.c_str());
+  std::vector<double> l;
+  if (!cholesky_decompose(cov, n, l)) {
+    return;
+  }
+  for (size_t i=0; i<n; i++) {
+    if (fixed[i]) {
+      l[i * n + i] = 0;
+    }
+  }
 
-  // buffers for current and proposed parameter vectors
-  hemi::Array<double> current_vector(this->nparameters, true);
-  for (size_t i=0; i<this->nparameters; i++) {
-    current_vector.writeOnlyHostPtr()[i] = \
-      this->parameter_means->readOnlyHostPtr()[i];
+  c->cholesky->copyFromHost(&l.front(), l.size());
+  c->adapted = true;
+}
+
+
+/**
+ * Root mean square deviation of a column of samples
+ *
+ * \param v The samples
+ * \param n The number of samples
+ * \returns The RMS about the mean
+ */
+static double column_rms(const float* v, size_t n) {
+  if (n == 0) {
+    return 0;
   }
+  double sum = 0;
+  double sum2 = 0;
+  for (size_t i=0; i<n; i++) {
+    sum += v[i];
+    sum2 += v[i] * v[i];
+  }
+  double mean = sum / n;
+  return sqrt(std::max(sum2 / n - mean * mean, 0.0));
+}
 
-  hemi::Array<double> proposed_vector(this->nparameters, true);
-  proposed_vector.writeOnlyHostPtr();  // touch to set valid
 
-  // buffer for normalizations after application of systematics
-  hemi::Array<unsigned> normalizations(this->nsignals, true);
-  normalizations.writeOnlyHostPtr();
+void MCMC::log(const std::string& message) const {
+  // numbered from one, as in the ensemble output
+  std::ostringstream line;
+  line << "MCMC: Experiment " << this->experiment + 1 << ": " << message
+       << "\n";
+  std::cout << line.str() << std::flush;
+}
 
-  // buffers for nll values at current and proposed parameter vectors
-  hemi::Array<double> current_nll(1, true);
-  current_nll.writeOnlyHostPtr();
 
-  hemi::Array<double> proposed_nll(1, true);
-  proposed_nll.writeOnlyHostPtr();
+LikelihoodSpace* MCMC::operator()(std::vector<float>& data, std::vector<int>& weights, unsigned nsteps,
+                                  float burnin_fraction, const bool debug_mode,
+                                  unsigned sync_interval, unsigned nchains,
+                                  float max_temperature,
+                                  unsigned swap_interval, bool adaptive) {
+  assert(nchains > 0);
+
+  unsigned burnin_steps = nsteps * burnin_fraction;
+
+  // Columnar store to hold likelihood space
+  SampleStore* samples = new SampleStore(this->parameter_names);
+  if (debug_mode || 2 * burnin_steps >= nsteps) {
+    samples->reserve(nsteps);
+  }
+  else {
+    samples->reserve(nsteps - 2 * burnin_steps);
+  }
 
   // create hemi buffer for weighting data points
   hemi::Array<int> dataweights(data.size(), true);
   dataweights.copyFromHost(&weights.front(), weights.size());
 
-  // initial standard deviations for each dimension
-  hemi::Array<float> jump_width(this->nparameters, true);
-  const float scale_factor = 2.4 * 2.4 / this->nparameters;  // Haario, 2001
-  for (size_t i=0; i<this->nparameters; i++) {
-    float mean = max(this->parameter_means->readOnlyHostPtr()[i], 10.0);
-    float sigma = this->parameter_sigma->readOnlyHostPtr()[i];
-    float width = (sigma > 0 ? sigma : sqrt(mean));
-    jump_width.writeOnlyHostPtr()[i] = 0.1 * width * scale_factor;
+  // geometric temperature ladder, from the cold chain to max_temperature
+  std::vector<double> temperatures(nchains, 1.0);
+  for (unsigned k=1; k<nchains; k++) {
+    temperatures[k] = pow(max_temperature, 1.0 * k / (nchains - 1));
   }
 
-  // buffers for computing event term in nll
-  hemi::Array<double> event_partial_sums(this->nnllthreads, true);
-  event_partial_sums.writeOnlyHostPtr();
+  // swap decisions use the stream after the cold chain's parameters
+  RNGState swap_rng;
+  rng_init(&swap_rng, this->seed, this->experiment, 0, this->nparameters);
+
+  // with floating systematics the PDFs are evaluated at each chain's
+  // proposed vector, so every chain needs its own lookup table
+  size_t nevents = data.size() / this->nobservables;
+  size_t nluts = (this->nsystematics > 0 ? nchains : 1);
+  hemi::Array<float> lut(nevents * this->nsignals * nluts, true);
 
-  hemi::Array<double> event_total_sum(1, true);    
-  event_total_sum.writeOnlyHostPtr();
+  // PDF values at each chain's current parameters, so that a column can be
+  // restored rather than recomputed when a proposal leaves its pdf's
+  // systematics where they were
+  hemi::Array<float> lut_cache(this->nsystematics > 0 ? lut.size() : 1, true);
+  size_t npdf_evals = 0;
+  size_t npdf_reused = 0;
 
-  // buffer of jumps, transferred from gpu periodically
-  hemi::Array<int> jump_counter(1, true);
-  jump_counter.writeOnlyHostPtr()[0] = 0;
+  const float scale_factor = 2.4 * 2.4 / this->nparameters;  // Haario, 2001
+  const unsigned adapt_interval = std::min(sync_interval, 1000u);
+
+  std::vector<Chain*> chains(nchains);
+  for (unsigned k=0; k<nchains; k++) {
+    Chain* c = new Chain(this->nparameters, this->nsignals, this->nnllthreads,
+                         sync_interval, temperatures[k]);
+    c->lut_offset = (nluts > 1 ? k * nevents * this->nsignals : 0);
+
+    // one stream per parameter of each chain
+    for (size_t i=0; i<this->nparameters; i++) {
+      rng_init(c->rngs->writeOnlyHostPtr() + i, this->seed, this->experiment,
+               k, i);
+    }
 
-  hemi::Array<int> accept_counter(1, true);
-  accept_counter.writeOnlyHostPtr()[0] = 0;
+    for (size_t i=0; i<this->nparameters; i++) {
+      c->current_vector->writeOnlyHostPtr()[i] = \
+        this->parameter_means->readOnlyHostPtr()[i];
+    }
 
-  hemi::Array<float> jump_buffer(sync_interval * (this->nparameters + 1),
-                                 true);
+    // initial standard deviations for each dimension, wider for hot chains;
+    // fixed parameters never move
+    for (size_t i=0; i<this->nparameters; i++) {
+      float mean = max(this->parameter_means->readOnlyHostPtr()[i], 10.0);
+      float sigma = this->parameter_sigma->readOnlyHostPtr()[i];
+      float width = (sigma > 0 ? sigma : sqrt(mean));
+      c->jump_width->writeOnlyHostPtr()[i] = \
+        (this->parameter_fixed[i] ? 0 :
+         0.1 * width * scale_factor * sqrt(c->temperature));
+    }
 
-  float* jump_vector = new float[this->nparameters + 1];
+    chains[k] = c;
+  }
 
   // set up histogram and perform initial evaluation
-  size_t nevents = data.size() / this->nobservables;
-  hemi::Array<float> lut(nevents * this->nsignals, true);
-  for (size_t i=0; i<this->pdfs.size(); i++) {
-    pdfz::Eval* p = this->pdfs[i];
-    p->SetEvalPoints(data);
-    p->SetPDFValueBuffer(&lut, i * nevents, 1);
-    p->SetNormalizationBuffer(&normalizations, i);
-    p->SetParameterBuffer(&current_vector, this->nsignals);
-    p->EvalAsync();
-    p->EvalFinished();
-    p->SetParameterBuffer(&proposed_vector, this->nsignals);
+  for (unsigned k=0; k<nluts; k++) {
+    for (size_t i=0; i<this->pdfs.size(); i++) {
+      pdfz::Eval* p = this->pdfs[i];
+      p->SetEvalPoints(data);
+      p->SetPDFValueBuffer(&lut, chains[k]->lut_offset + i * nevents, 1);
+      p->SetNormalizationBuffer(chains[k]->normalizations, i);
+      p->SetParameterBuffer(chains[k]->current_vector, this->nsignals);
+      p->EvalAsync();
+      p->EvalFinished();
+      chains[k]->lut_columns[i].set(chains[k]->current_vector->readOnlyHostPtr(),
+                                    this->pdf_parameters[i]);
+    }
   }
 
   // calculate nll with initial parameters
-  nll(lut.readOnlyPtr(), dataweights.readOnlyPtr(), nevents,
-      current_vector.readOnlyPtr(), current_nll.writeOnlyPtr(),
-      event_partial_sums.ptr(), event_total_sum.ptr());
-
-  HEMI_KERNEL_LAUNCH(pick_new_vector, 1, 64, 0, 0,
-                     this->nparameters, this->rngs->ptr(),
-                     jump_width.readOnlyPtr(),
-                     current_vector.readOnlyPtr(),
-                     proposed_vector.writeOnlyPtr());
+  for (unsigned k=0; k<nchains; k++) {
+    Chain* c = chains[k];
+    nll(lut.readOnlyPtr() + c->lut_offset, dataweights.readOnlyPtr(), nevents,
+        c->current_vector->readOnlyPtr(), c->current_nll->writeOnlyPtr(),
+        c->event_partial_sums->ptr(), c->event_total_sum->ptr());
+
+    HEMI_KERNEL_LAUNCH(pick_new_vector, 1, 64, 0, 0,
+                       this->nparameters, c->rngs->ptr(),
+                       c->jump_width->readOnlyPtr(), NULL, c->jump_z->ptr(),
+                       c->current_vector->readOnlyPtr(),
+                       c->proposed_vector->writeOnlyPtr());
+  }
 
   // perform random walk
   TStopwatch timer;
   timer.Start();
+  unsigned nswap_rounds = 0;
   for (unsigned i=0; i<nsteps; i++) {
-    // if systematics are varying, re-evaluate the pdfs
+    // if systematics are varying, re-evaluate the pdfs at each chain's
+    // proposed vector. Only pdfs depending on a parameter that differs from
+    // the values their lut column was computed at are evaluated; a column
+    // matching the chain's current state is restored from the cache.
     if (this->nsystematics > 0) {
-      for (size_t i=0; i<this->pdfs.size(); i++) {
-        pdfs[i]->EvalAsync();
+      std::vector<bool> launched(this->pdfs.size(), false);
+      for (unsigned k=0; k<nchains; k++) {
+        Chain* c = chains[k];
+        const double* v = c->proposed_vector->readOnlyHostPtr();
+        for (size_t j=0; j<this->pdfs.size(); j++) {
+          const std::vector<size_t>& pars = this->pdf_parameters[j];
+          size_t column = c->lut_offset + j * nevents;
+          if (c->lut_columns[j].matches(v, pars)) {
+            continue;
+          }
+          if (c->cache_columns[j].matches(v, pars)) {
+            copy_lut_column(lut, column, lut_cache, column, nevents);
+            c->lut_columns[j] = c->cache_columns[j];
+            npdf_reused++;
+            continue;
+          }
+          if (launched[j]) {
+            pdfs[j]->EvalFinished();
+          }
+          pdfs[j]->SetPDFValueBuffer(&lut, column, 1);
+          pdfs[j]->SetNormalizationBuffer(c->normalizations, j);
+          pdfs[j]->SetParameterBuffer(c->proposed_vector, this->nsignals);
+          pdfs[j]->EvalAsync();
+          c->lut_columns[j].set(v, pars);
+          launched[j] = true;
+          npdf_evals++;
+        }
       }
-      for (size_t i=0; i<this->pdfs.size(); i++) {
-        pdfs[i]->EvalFinished();
+      for (size_t j=0; j<this->pdfs.size(); j++) {
+        if (launched[j]) {
+          pdfs[j]->EvalFinished();
+        }
       }
     }
 
     // re-tune jump distribution based on burn-in phase
     if (i == burnin_steps || i == 2 * burnin_steps) {
-      std::cout << "MCMC: Burn-in phase completed after " << burnin_steps
-                << " steps" << std::endl;
+      std::ostringstream message;
+      message << "Burn-in phase completed after " << burnin_steps << " steps";
+      log(message.str());
 
-      // rescale jumps in each dimension based on RMS during burn-in
-      for (size_t j=0; j<this->nparameters; j++) {
+      // rescale jumps in each dimension based on RMS of the cold chain
+      // during burn-in; the adaptive proposal tunes itself instead
+      for (size_t j=0; j<this->nparameters && !adaptive; j++) {
         std::string name = this->parameter_names[j];
-        nt->Draw((name + ">>hsproj").c_str());
-        TH1F* hsproj = (TH1F*) gDirectory->Get("hsproj");
-
-        double fit_width = hsproj->GetRMS();
+        double fit_width = column_rms(samples->get_column(j),
+                                      samples->get_entries());
 
-        std::cout << "MCMC: Rescaling jump sigma: " << name << ": "
-                  << jump_width.readOnlyHostPtr()[j] << " -> ";
+        std::ostringstream message;
+        message << "Rescaling jump sigma: " << name << ": "
+                << chains[0]->jump_width->readOnlyHostPtr()[j] << " -> ";
 
-        jump_width.writeOnlyHostPtr()[j] = scale_factor * fit_width;
+        for (unsigned k=0; k<nchains; k++) {
+          chains[k]->jump_width->writeOnlyHostPtr()[j] = \
+            scale_factor * fit_width * sqrt(chains[k]->temperature);
+        }
 
-        std::cout << jump_width.readOnlyHostPtr()[j] << std::endl;
-
-        hsproj->Delete();
+        message << chains[0]->jump_width->readOnlyHostPtr()[j];
+        log(message.str());
       }
       // save all steps when in debug mode
       if (!debug_mode) {
-        nt->Reset();
+        samples->clear();
       }
     }
 
-    // partial sums of event term
-    HEMI_KERNEL_LAUNCH(nll_event_chunks, this->nnllblocks,
-                       this->nllblocksize, 0, 0,
-                       lut.readOnlyPtr(), dataweights.readOnlyPtr(),
-                       proposed_vector.readOnlyPtr(),
-                       nevents, this->nsignals,
-                       event_partial_sums.ptr());
-
-    // accept/reject the jump, add current position to the buffer
-    HEMI_KERNEL_LAUNCH(finish_nll_jump_pick_combo, 1, this->nreducethreads,
-                       this->nreducethreads * sizeof(double), 0,
-                       this->nnllthreads,
-                       event_partial_sums.ptr(),
-                       this->nsignals, 
-                       this->parameter_means->readOnlyPtr(),
-                       this->parameter_sigma->readOnlyPtr(),
-                       this->rngs->ptr(),
-                       current_nll.ptr(),
-                       proposed_nll.ptr(),
-                       current_vector.ptr(),
-                       proposed_vector.ptr(),
-                       accept_counter.ptr(),
-                       jump_counter.ptr(),
-                       jump_buffer.writeOnlyPtr(),
-                       this->nparameters,
-                       jump_width.readOnlyPtr(),
-                       debug_mode);
-
-    // flush the jump buffer periodically
-    if (i % sync_interval == 0 || i == nsteps - 1 || i == burnin_steps - 1) {
-      int njumps = jump_counter.readOnlyHostPtr()[0];
-      int naccepted = accept_counter.readOnlyHostPtr()[0];
-      std::cout << "MCMC: Step " << i << "/" << nsteps
-                << " (" << njumps << " in buffer, "
-                << naccepted << " accepted)" << std::endl;
-      for (int j=0; j<njumps; j++) {
-         // first nsignals elements are normalizations
-         for (unsigned k=0; k<this->nparameters; k++) {
-           int idx = j * (this->nparameters + 1) + k;
-           jump_vector[k] = jump_buffer.readOnlyHostPtr()[idx];
-         }
-         // last element is the likelihood
-         jump_vector[this->nparameters] = \
-           jump_buffer.readOnlyHostPtr()[j * (this->nparameters + 1) +
-                                         this->nparameters];
-
-         nt->Fill(jump_vector);
+    // step every chain; chains are independent between swaps, so they run
+    // concurrently on CPU threads or on their own CUDA streams
+    const float* lut_ptr = lut.readOnlyPtr();
+    const int* dataweights_ptr = dataweights.readOnlyPtr();
+    const double* means_ptr = this->parameter_means->readOnlyPtr();
+    const double* sigma_ptr = this->parameter_sigma->readOnlyPtr();
+
+#if defined(_OPENMP) && !defined(__CUDACC__)
+    #pragma omp parallel for schedule(static, 1) if (nchains > 1)
+#endif
+    for (int k=0; k<(int)nchains; k++) {
+      Chain* c = chains[k];
+
+      // partial sums of event term
+      HEMI_KERNEL_LAUNCH(nll_event_chunks, this->nnllblocks,
+                         this->nllblocksize, 0, c->stream,
+                         lut_ptr + c->lut_offset, dataweights_ptr,
+                         c->proposed_vector->readOnlyPtr(),
+                         nevents, this->nsignals,
+                         c->event_partial_sums->ptr());
+
+      // accept/reject the jump, add current position to the buffer
+      HEMI_KERNEL_LAUNCH(finish_nll_jump_pick_combo, 1, this->nreducethreads,
+                         this->nreducethreads * sizeof(double), c->stream,
+                         this->nnllthreads,
+                         c->event_partial_sums->ptr(),
+                         this->nsignals, 
+                         means_ptr,
+                         sigma_ptr,
+                         c->rngs->ptr(),
+                         c->current_nll->ptr(),
+                         c->proposed_nll->ptr(),
+                         c->current_vector->ptr(),
+                         c->proposed_vector->ptr(),
+                         c->accept_counter->ptr(),
+                         c->jump_counter->ptr(),
+                         c->jump_buffer->writeOnlyPtr(),
+                         this->nparameters,
+                         c->jump_width->readOnlyPtr(),
+                         c->adapted ? c->cholesky->readOnlyPtr() : NULL,
+                         c->jump_z->ptr(),
+                         debug_mode,
+                         c->temperature);
+    }
+
+    // if the step was accepted, keep the lut columns of the new current
+    // state in the cache
+    if (this->nsystematics > 0) {
+      for (unsigned k=0; k<nchains; k++) {
+        Chain* c = chains[k];
+        const double* v = c->current_vector->readOnlyHostPtr();
+        for (size_t j=0; j<this->pdfs.size(); j++) {
+          const std::vector<size_t>& pars = this->pdf_parameters[j];
+          if (!c->cache_columns[j].matches(v, pars) &&
+              c->lut_columns[j].matches(v, pars)) {
+            size_t column = c->lut_offset + j * nevents;
+            copy_lut_column(lut_cache, column, lut, column, nevents);
+            c->cache_columns[j] = c->lut_columns[j];
+          }
+        }
       }
+    }
 
-      // reset counters
-      jump_counter.writeOnlyHostPtr()[0] = 0;
-      accept_counter.writeOnlyHostPtr()[0] = 0;
+    // flush the jump buffer periodically, and more often while an adaptive
+    // proposal is tuning during burn-in
+    if (i % sync_interval == 0 || i == nsteps - 1 || i == burnin_steps - 1 ||
+        (adaptive && i < burnin_steps && i % adapt_interval == 0)) {
+      for (unsigned k=0; k<nchains; k++) {
+        Chain* c = chains[k];
+        int njumps = c->jump_counter->readOnlyHostPtr()[0];
+        int naccepted = c->accept_counter->readOnlyHostPtr()[0];
+        c->steps += njumps;
+        c->accepted += naccepted;
+
+        if (adaptive) {
+          adapt_proposal(c, njumps, this->parameter_fixed);
+        }
+
+        // only the cold chain samples the likelihood
+        if (k == 0) {
+          std::ostringstream message;
+          message << "Step " << i << "/" << nsteps
+                  << " (" << njumps << " in buffer, "
+                  << naccepted << " accepted)";
+          log(message.str());
+          // rows are the parameters followed by the likelihood, as in the
+          // sample store
+          samples->append(c->jump_buffer->readOnlyHostPtr(), njumps);
+        }
+
+        // reset counters
+        c->jump_counter->writeOnlyHostPtr()[0] = 0;
+        c->accept_counter->writeOnlyHostPtr()[0] = 0;
+      }
+    }
+
+    // propose state swaps between neighboring chains, alternating between
+    // even and odd pairs
+    if (nchains > 1 && swap_interval > 0 && (i + 1) % swap_interval == 0) {
+      for (unsigned k=nswap_rounds%2; k+1<nchains; k+=2) {
+        Chain* cold = chains[k];
+        Chain* hot = chains[k + 1];
+        double nll_cold = cold->current_nll->readOnlyHostPtr()[0];
+        double nll_hot = hot->current_nll->readOnlyHostPtr()[0];
+
+        double log_r = (1.0 / cold->temperature - 1.0 / hot->temperature) *
+                       (nll_cold - nll_hot);
+
+        cold->swaps_proposed++;
+        if (log_r >= 0 || rng_uniform(&swap_rng) < exp(log_r)) {
+          cold->swaps_accepted++;
+
+          std::vector<double> v(this->nparameters);
+          for (size_t l=0; l<this->nparameters; l++) {
+            v[l] = cold->current_vector->readOnlyHostPtr()[l];
+          }
+          for (size_t l=0; l<this->nparameters; l++) {
+            cold->current_vector->writeOnlyHostPtr()[l] = \
+              hot->current_vector->readOnlyHostPtr()[l];
+          }
+          for (size_t l=0; l<this->nparameters; l++) {
+            hot->current_vector->writeOnlyHostPtr()[l] = v[l];
+          }
+          cold->current_nll->writeOnlyHostPtr()[0] = nll_hot;
+          hot->current_nll->writeOnlyHostPtr()[0] = nll_cold;
+
+          // proposals were drawn around the old states
+          for (unsigned l=k; l<k+2; l++) {
+            HEMI_KERNEL_LAUNCH(pick_new_vector, 1, 64, 0, chains[l]->stream,
+                               this->nparameters, chains[l]->rngs->ptr(),
+                               chains[l]->jump_width->readOnlyPtr(),
+                               (chains[l]->adapted ?
+                                chains[l]->cholesky->readOnlyPtr() : NULL),
+                               chains[l]->jump_z->ptr(),
+                               chains[l]->current_vector->readOnlyPtr(),
+                               chains[l]->proposed_vector->writeOnlyPtr());
+          }
+        }
+      }
+      nswap_rounds++;
     }
   }
 
-  std::cout << "MCMC: Elapsed time: " << timer.RealTime() << std::endl;
+  std::ostringstream elapsed;
+  elapsed << "Elapsed time: " << timer.RealTime();
+  log(elapsed.str());
+  if (this->nsystematics > 0) {
+    std::ostringstream message;
+    message << "PDF evaluations: " << npdf_evals << " ("
+            << npdf_reused << " restored from cache, "
+            << nsteps * nchains * this->pdfs.size() - npdf_evals - npdf_reused
+            << " unchanged)";
+    log(message.str());
+  }
 
+  this->chain_stats.resize(nchains);
+  for (unsigned k=0; k<nchains; k++) {
+    Chain* c = chains[k];
+    ChainStats& stats = this->chain_stats[k];
+    stats.temperature = c->temperature;
+    stats.steps = c->steps;
+    stats.accepted = c->accepted;
+    stats.swaps_proposed = c->swaps_proposed;
+    stats.swaps_accepted = c->swaps_accepted;
+
+    if (nchains > 1) {
+      std::ostringstream message;
+      message << "Chain " << k << " (T = " << c->temperature << "): "
+              << c->accepted << "/" << c->steps << " accepted";
+      if (k + 1 < nchains) {
+        message << ", " << c->swaps_accepted << "/" << c->swaps_proposed
+                << " swaps accepted";
+      }
+      log(message.str());
+    }
 
-  LikelihoodSpace* lspace = new LikelihoodSpace(nt);
+    delete c;
+  }
 
-  delete[] jump_vector;
+  LikelihoodSpace* lspace = new LikelihoodSpace(samples);
 
   return lspace;
 }
@@ -315,3 +721,87 @@ void MCMC::nll(const float* lut, const int* dataweights, size_t nevents, const d
                      event_total_sum, nll);
 }
 
+
+
+std::vector<double> MCMC::batch_nll(std::vector<float>& data,
+                                    std::vector<int>& weights,
+                                    const std::vector<double>& vectors) {
+  assert(vectors.size() % this->nparameters == 0);
+  unsigned nvectors = vectors.size() / this->nparameters;
+  std::vector<double> result(nvectors);
+  if (nvectors == 0) {
+    return result;
+  }
+
+  size_t nevents = data.size() / this->nobservables;
+
+  hemi::Array<int> dataweights(weights.size(), true);
+  dataweights.copyFromHost(&weights.front(), weights.size());
+
+  hemi::Array<double> pars(vectors.size(), true);
+  pars.copyFromHost(&vectors.front(), vectors.size());
+
+  // without systematics the PDFs do not depend on the parameters, so all
+  // vectors share a single lookup table
+  size_t nluts = (this->nsystematics > 0 ? nvectors : 1);
+  size_t lut_stride = (nluts > 1 ? nevents * this->nsignals : 0);
+  hemi::Array<float> lut(nevents * this->nsignals * nluts, true);
+
+  hemi::Array<unsigned> normalizations(this->nsignals, true);
+  normalizations.writeOnlyHostPtr();
+  hemi::Array<double> v(this->nparameters, true);
+
+  for (size_t i=0; i<this->pdfs.size(); i++) {
+    this->pdfs[i]->SetEvalPoints(data);
+  }
+
+  for (size_t k=0; k<nluts; k++) {
+    for (size_t j=0; j<this->nparameters; j++) {
+      v.writeOnlyHostPtr()[j] = vectors[k * this->nparameters + j];
+    }
+    for (size_t i=0; i<this->pdfs.size(); i++) {
+      pdfz::Eval* p = this->pdfs[i];
+      p->SetPDFValueBuffer(&lut, k * lut_stride + i * nevents, 1);
+      p->SetNormalizationBuffer(&normalizations, i);
+      p->SetParameterBuffer(&v, this->nsignals);
+      p->EvalAsync();
+      p->EvalFinished();
+    }
+  }
+
+  hemi::Array<double> event_partial_sums(this->nnllthreads * nvectors, true);
+  event_partial_sums.writeOnlyHostPtr();
+  hemi::Array<double> nlls(nvectors, true);
+
+  nll_batch(lut.readOnlyPtr(), lut_stride, dataweights.readOnlyPtr(), nevents,
+            nvectors, pars.readOnlyPtr(), nlls.writeOnlyPtr(),
+            event_partial_sums.ptr());
+
+  for (unsigned k=0; k<nvectors; k++) {
+    result[k] = nlls.readOnlyHostPtr()[k];
+  }
+
+  return result;
+}
+
+
+void MCMC::nll_batch(const float* lut, size_t lut_stride,
+                     const int* dataweights, size_t nevents,
+                     unsigned nvectors, const double* v, double* nll,
+                     double* event_partial_sums) {
+  // partial sums of event term, for all vectors
+  HEMI_KERNEL_LAUNCH(nll_event_chunks_batch,
+                     this->nnllblocks, this->nllblocksize, 0, 0,
+                     lut, lut_stride, dataweights, v, this->nparameters,
+                     nvectors, nevents, this->nsignals, event_partial_sums);
+
+  // totals, constraints + event term
+  int bs = 64;
+  int nb = nvectors / bs + 1;
+  HEMI_KERNEL_LAUNCH(nll_total_batch, nb, bs, 0, 0,
+                     nvectors, this->nnllthreads, event_partial_sums,
+                     this->nparameters, v, this->nsignals,
+                     this->parameter_means->readOnlyPtr(),
+                     this->parameter_sigma->readOnlyPtr(),
+                     nll);
+}
@@ -17,10 +17,6 @@
 #include <sxmc/nll_kernels.h>
 #include <sxmc/pdfz.h>
 
-#ifdef __CUDACC__
-#include <curand_kernel.h>
-#endif
-
 #ifndef __HEMI_ARRAY_H__
 #define __HEMI_ARRAY_H__
 #include <hemi/array.h>
@@ -29,6 +25,18 @@
 class TNtuple;
 class LikelihoodSpace;
 
+/**
+ * \struct ChainStats
+ * \brief Acceptance and swap statistics for one chain of a tempered walk
+ */
+struct ChainStats {
+  double temperature;  //!< chain temperature, 1 for the cold chain
+  unsigned long steps;  //!< number of Metropolis steps taken
+  unsigned long accepted;  //!< number of accepted Metropolis steps
+  unsigned long swaps_proposed;  //!< swaps proposed with the next-hotter chain
+  unsigned long swaps_accepted;  //!< swaps accepted with the next-hotter chain
+};
+
 /**
  * \class MCMC
  * \brief Markov Chain Monte Carlo simulator
@@ -44,10 +52,14 @@ class MCMC {
      * \param signals List of Signals defining the PDFs and expectations
      * \param systematics List of systematic parameter definitions
      * \param observables List of observables in the data
+     * \param seed Random seed
+     * \param experiment Index of the fake experiment; together with the seed,
+     *                   this selects the random number streams of the walk
      */
     MCMC(const std::vector<Signal>& signals,
          const std::vector<Systematic>& systematics,
-         const std::vector<Observable>& observables);
+         const std::vector<Observable>& observables,
+         unsigned long long seed=0, unsigned experiment=0);
 
     /**
      * Destructor
@@ -59,19 +71,74 @@ class MCMC {
     /**
      * Perform walk.
      *
+     * With nchains > 1, runs a parallel-tempering ensemble: chain k samples
+     * L^(1/T_k), with temperatures spaced geometrically from 1 (the cold
+     * chain) to max_temperature. Every swap_interval steps, neighboring
+     * chains propose to exchange states. Chains run concurrently, on CPU
+     * threads or on separate CUDA streams. Only the cold chain is saved.
+     *
+     * Each chain draws from its own random number streams, so the walk is
+     * reproducible for a given seed and experiment, independent of the
+     * number of threads.
+     *
      * \param nsteps Number of random-walk steps to take
      * \param burnin_fraction Fraction of initial steps to throw out
      * \param debug_mode If true, accept and save all steps
      * \param sync_interval How often to copy accepted from GPU to storage
-     * \returns LikelihoodSpace built from samples
+     * \param nchains Number of tempered chains (1 for a plain Metropolis walk)
+     * \param max_temperature Temperature of the hottest chain
+     * \param swap_interval Number of steps between state swap proposals
+     * \param adaptive Use an adaptive Metropolis proposal: jumps are drawn
+     *                 from a multivariate normal with the running covariance
+     *                 of the chain, rather than re-tuning independent widths
+     *                 after burn-in
+     * \returns LikelihoodSpace built from samples of the cold chain
      */
     LikelihoodSpace* operator()(std::vector<float>& data, std::vector<int>& weights,
                                 unsigned nsteps,
                                 float burnin_fraction,
                                 const bool debug_mode=false,
-                                unsigned sync_interval=10000);
+                                unsigned sync_interval=10000,
+                                unsigned nchains=1,
+                                float max_temperature=10.0,
+                                unsigned swap_interval=10,
+                                bool adaptive=false);
+
+    /**
+     * Evaluate the NLL at many parameter vectors at once.
+     *
+     * Without systematics, all vectors share one PDF lookup table and the
+     * event term for the whole batch is computed in a few passes over it,
+     * which is much cheaper than one evaluation per vector. With systematics,
+     * the PDFs are evaluated separately for each vector.
+     *
+     * \param data Event observables, as for operator()
+     * \param weights Event weights, as for operator()
+     * \param vectors Parameter vectors, concatenated (nvectors x nparameters)
+     * \returns The NLL at each parameter vector
+     */
+    std::vector<double> batch_nll(std::vector<float>& data,
+                                  std::vector<int>& weights,
+                                  const std::vector<double>& vectors);
+
+    /**
+     * Get statistics for each chain of the last walk, cold chain first.
+     */
+    const std::vector<ChainStats>& get_chain_stats() const {
+      return chain_stats;
+    }
 
   protected:
+    /**
+     * Print a line of progress output, labeled with the experiment index.
+     *
+     * The line is written in one call, so lines from experiments running
+     * concurrently do not mix.
+     *
+     * \param message The message, without a trailing newline
+     */
+    void log(const std::string& message) const;
+
     /**
      * Evaluate the NLL function
      *
@@ -97,6 +164,28 @@ class MCMC {
              double* event_partial_sums,
              double* event_total_sum);
 
+    /**
+     * Evaluate the NLL function at several parameter vectors
+     *
+     * Batched version of nll(), using the same three steps with the last two
+     * combined.
+     *
+     * \param lut Pj(xi) lookup table(s)
+     * \param lut_stride Offset between the tables for consecutive vectors,
+     *                   zero if all vectors share one table
+     * \param dataweights Weight of each event
+     * \param nevents Number of events
+     * \param nvectors Number of parameter vectors
+     * \param v Parameter vectors, concatenated
+     * \param nll Container for output NLL values, one per vector
+     * \param event_partial_sums Pre-allocated buffer for event term
+     *                           calculation, nnllthreads per vector
+     */
+    void nll_batch(const float* lut, size_t lut_stride,
+                   const int* dataweights, size_t nevents, unsigned nvectors,
+                   const double* v, double* nll,
+                   double* event_partial_sums);
+
   private:
     size_t nsignals;  //!< number of signal parameters
     size_t nsystematics;  //!< number of systematic parameters
@@ -109,12 +198,16 @@ class MCMC {
                              //!< reduction kernel
     unsigned blocksize;  //!< size of blocks for per-signal kernels
     unsigned nblocks;  //!< number of blocks for per-signal kernels
-    std::string varlist;  //!< string identifier list for ntuple indexing
     hemi::Array<double>* parameter_means;  //!< parameter central values
     hemi::Array<double>* parameter_sigma;  //!< parameter Gaussian uncertainty
-    hemi::Array<RNGState>* rngs;  //!< CURAND RNGs, ignored in CPU mode
+    unsigned long long seed;  //!< random seed
+    unsigned experiment;  //!< experiment index, selects the random streams
     std::vector<std::string> parameter_names;  //!< string name of each param
     std::vector<pdfz::Eval*> pdfs;  //!< references to signal pdfs
+    std::vector<std::vector<size_t> > pdf_parameters;  //!< parameters each
+                                                       //!< pdf depends on
+    std::vector<bool> parameter_fixed;  //!< parameters held at their means
+    std::vector<ChainStats> chain_stats;  //!< statistics from the last walk
 };
 
 #endif  // __MCMC_H__
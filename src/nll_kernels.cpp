@@ -1,14 +1,12 @@
 #include <iostream>
 #include <cmath>
 #include <hemi/hemi.h>
-#include <TRandom.h>
 
 #include <sxmc/nll_kernels.h>
 
-#ifdef __CUDACC__
-#include <curand_kernel.h>
-#else
+#ifndef __CUDACC__
 #include <TMath.h>
+#include <sxmc/simd_kernels.h>
 #endif
 
 #ifndef __HEMI_ARRAY_H__
@@ -16,34 +14,40 @@
 #include <hemi/array.h>
 #endif
 
-#ifdef __CUDACC__
-__global__ void init_device_rngs(int nthreads, unsigned long long seed,
-                                 curandStateXORWOW* state) {
-  int idx = hemiGetElementOffset();
-  if (idx >= nthreads) {
-    return;
-  }
-  curand_init(seed, idx, 0, &state[idx]);
-}
-#endif
-
 
 HEMI_DEV_CALLABLE_INLINE
 void pick_new_vector_device(int nthreads, RNGState* rng,
                             const float* sigma,
+                            const double* cholesky, double* z,
                             const double* current_vector,
                             double* proposed_vector) {
   int offset = hemiGetElementOffset();
   int stride = hemiGetElementStride();
 
+  // independent jumps in each dimension
+  if (!cholesky) {
+    for (int i=offset; i<(int)nthreads; i+=stride) {
+      double u = rng_normal(&rng[i]);
+      proposed_vector[i] = current_vector[i] + sigma[i] * u;
+    }
+    return;
+  }
+
+  // correlated jumps, proposed = current + L * z with z ~ N(0, 1)
   for (int i=offset; i<(int)nthreads; i+=stride) {
+    z[i] = rng_normal(&rng[i]);
+  }
+
 #ifdef HEMI_DEV_CODE
-    double u = curand_normal(&rng[i]);
-    proposed_vector[i] = current_vector[i] + sigma[i] * u;
-#else
-    double u = gRandom->Gaus(current_vector[i], sigma[i]);
-    proposed_vector[i] = u;
+  __syncthreads();
 #endif
+
+  for (int i=offset; i<(int)nthreads; i+=stride) {
+    double dx = 0;
+    for (int j=0; j<=i; j++) {
+      dx += cholesky[i * nthreads + j] * z[j];
+    }
+    proposed_vector[i] = current_vector[i] + dx;
   }
 }
 
@@ -53,17 +57,14 @@ void jump_decider_device(RNGState* rng, double* nll_current,
                          const double* nll_proposed, double* v_current,
                          const double* v_proposed, unsigned nparameters,
                          int* accepted, int* counter, float* jump_buffer,
-                         const bool debug_mode=false) {
-#ifdef HEMI_DEV_CODE
-  double u = curand_uniform(&rng[0]);
-#else
-  double u = gRandom->Uniform();
-#endif
+                         const bool debug_mode=false,
+                         const double temperature=1.0) {
+  double u = rng_uniform(&rng[0]);
 
-  // metropolis algorithm
+  // metropolis algorithm, on the tempered distribution L^(1/T)
   double np = nll_proposed[0];
   double nc = nll_current[0];
-  if (debug_mode || (np < nc || u <= exp(nc - np))) {
+  if (debug_mode || (np < nc || u <= exp((nc - np) / temperature))) {
     nll_current[0] = np;
     for (unsigned i=0; i<nparameters; i++) {
       v_current[i] = v_proposed[i];
@@ -89,6 +90,18 @@ HEMI_KERNEL(nll_event_chunks)(const float* __restrict__ lut,
   int offset = hemiGetElementOffset();
   int stride = hemiGetElementStride();
 
+#ifndef __CUDACC__
+  // on the host the whole event loop runs in one call, so hand it to the
+  // vectorized implementation
+  if (offset == 0 && stride == 1) {
+    double sum = simd::nll_event_sum(lut, dataweights, pars, ne, ns);
+    if (!isnan(sum)) {
+      sums[offset] = sum;
+    }
+    return;
+  }
+#endif
+
   double sum = 0;
   for (int i=offset; i<(int)ne; i+=stride) {
     double s = 0;
@@ -104,6 +117,49 @@ HEMI_KERNEL(nll_event_chunks)(const float* __restrict__ lut,
 }
 
 
+HEMI_KERNEL(nll_event_chunks_batch)(const float* __restrict__ lut,
+                                    const size_t lut_stride,
+                                    const int* __restrict__ dataweights,
+                                    const double* __restrict__ pars,
+                                    const size_t par_stride,
+                                    const unsigned nvectors,
+                                    const size_t ne, const size_t ns,
+                                    double* sums) {
+  int offset = hemiGetElementOffset();
+  int stride = hemiGetElementStride();
+
+  for (unsigned k0=0; k0<nvectors; k0+=NLL_BATCH_TILE) {
+    unsigned nk = (nvectors - k0 < NLL_BATCH_TILE ?
+                   nvectors - k0 : NLL_BATCH_TILE);
+
+    double sum[NLL_BATCH_TILE];
+    for (unsigned k=0; k<nk; k++) {
+      sum[k] = 0;
+    }
+
+    for (int i=offset; i<(int)ne; i+=stride) {
+      double s[NLL_BATCH_TILE];
+      for (unsigned k=0; k<nk; k++) {
+        s[k] = 0;
+      }
+      for (size_t j=0; j<ns; j++) {
+        for (unsigned k=0; k<nk; k++) {
+          float v = lut[(k0 + k) * lut_stride + j * ne + i];
+          s[k] += pars[(k0 + k) * par_stride + j] * (!isnan(v) ? v : 0);
+        }
+      }
+      for (unsigned k=0; k<nk; k++) {
+        sum[k] += log(s[k]) * dataweights[i];
+      }
+    }
+
+    for (unsigned k=0; k<nk; k++) {
+      sums[(k0 + k) * stride + offset] = sum[k];
+    }
+  }
+}
+
+
 HEMI_DEV_CALLABLE_INLINE
 void nll_event_reduce_device(const size_t nthreads, const double* sums,
                              double* total_sum) {
@@ -174,9 +230,10 @@ void nll_total_device(const size_t nparameters, const size_t nsignals,
 
 HEMI_KERNEL(pick_new_vector)(int nthreads, RNGState* rng,
                              const float* sigma,
+                             const double* cholesky, double* z,
                              const double* current_vector,
                              double* proposed_vector) {
-  pick_new_vector_device(nthreads, rng, sigma, current_vector,
+  pick_new_vector_device(nthreads, rng, sigma, cholesky, z, current_vector,
                          proposed_vector);
 }
 
@@ -184,9 +241,11 @@ HEMI_KERNEL(pick_new_vector)(int nthreads, RNGState* rng,
 HEMI_KERNEL(jump_decider)(RNGState* rng, double* nll_current,
                           const double* nll_proposed, double* v_current,
                           const double* v_proposed, unsigned nparameters,
-                          int* accepted, int* counter, float* jump_buffer) {
+                          int* accepted, int* counter, float* jump_buffer,
+                          const double temperature) {
   jump_decider_device(rng, nll_current, nll_proposed, v_current, v_proposed,
-                      nparameters, accepted, counter, jump_buffer);
+                      nparameters, accepted, counter, jump_buffer, false,
+                      temperature);
 }
 
 
@@ -205,6 +264,26 @@ HEMI_KERNEL(nll_total)(const size_t npars, const double* pars,
 }
 
 
+HEMI_KERNEL(nll_total_batch)(const unsigned nvectors,
+                             const size_t npartial_sums, const double* sums,
+                             const size_t nparameters, const double* pars,
+                             const size_t nsignals,
+                             const double* means, const double* sigmas,
+                             double* nll) {
+  int offset = hemiGetElementOffset();
+  int stride = hemiGetElementStride();
+
+  for (int k=offset; k<(int)nvectors; k+=stride) {
+    double total_sum = 0;
+    for (size_t i=0; i<npartial_sums; i++) {
+      total_sum += sums[k * npartial_sums + i];
+    }
+    nll_total_device(nparameters, nsignals, pars + k * nparameters, means,
+                     sigmas, &total_sum, nll + k);
+  }
+}
+
+
 HEMI_KERNEL(finish_nll_jump_pick_combo)(const size_t npartial_sums,
                                         const double* sums, const size_t ns,
                                         const double* means,
@@ -216,7 +295,9 @@ HEMI_KERNEL(finish_nll_jump_pick_combo)(const size_t npartial_sums,
                                         int* accepted, int* counter,
                                         float* jump_buffer, int nparameters,
                                         const float* sigma,
-                                        const bool debug_mode) {
+                                        const double* cholesky, double* z,
+                                        const bool debug_mode,
+                                        const double temperature) {
   double total_sum;
 
   nll_event_reduce_device(npartial_sums, sums, &total_sum);
@@ -231,13 +312,14 @@ HEMI_KERNEL(finish_nll_jump_pick_combo)(const size_t npartial_sums,
 
     jump_decider_device(rng, nll_current, nll_proposed, v_current, v_proposed,
                         nparameters, accepted, counter, jump_buffer,
-                        debug_mode);
+                        debug_mode, temperature);
   }
 
 #ifdef HEMI_DEV_CODE
   __syncthreads();
 #endif
 
-  pick_new_vector_device(nparameters, rng, sigma, v_current, v_proposed);
+  pick_new_vector_device(nparameters, rng, sigma, cholesky, z, v_current,
+                         v_proposed);
 }
 
@@ -9,55 +9,36 @@
 #include <cuda.h>
 #include <hemi/hemi.h>
 
-#ifdef __CUDACC__
-#include <curand_kernel.h>
-#endif
+#include <sxmc/rng.h>
 
 #ifndef __HEMI_ARRAY_H__
 #define __HEMI_ARRAY_H__
 #include <hemi/array.h>
 #endif
 
-/**
- * \typedef RNGState
- * \brief Defines RNG for CURAND, ignored in CPU mode
- */
-#ifdef __CUDACC__
-typedef curandStateXORWOW RNGState;
-#else
-typedef int RNGState;
-#endif
-
 class TNtuple;
 
-#ifdef __CUDACC__
-/**
- * Initialize device-side RNGs.
- *
- * Generators all have the same seed but a different offset in the sequence.
- *
- * \param nthreads Number of threads (same as the number of states)
- * \param seed Random seed shared by all generators
- * \param state Array of CUDA RNG states
- */
-__global__ void init_device_rngs(int nthreads, unsigned long long seed,
-                                 curandState* state);
-#endif
-
-
 /**
  * Pick a new position distributed around the given one.
  *
- * Uses CURAND XORWOW generator on GPU, or ROOT's gRandom on the CPU.
+ * Dimension i draws from its own counter-based generator rng[i], on the GPU
+ * or the CPU alike. Jumps are independent in each dimension with widths
+ * sigma, or, if a Cholesky factor L of the proposal covariance is given,
+ * multivariate normal with covariance L * L^T. All threads must be in one
+ * block.
  *
  * \param nthreads Number of threads == length of vectors
- * \param rng CUDA RNG states, ignored on CPU
+ * \param rng Generator for each dimension
  * \param sigma Standard deviations to sample for each dimension
+ * \param cholesky Lower-triangular proposal covariance factor (nthreads x
+ *                 nthreads, row major), or NULL to use sigma
+ * \param z Scratch space for nthreads standard normal deviates
  * \param current_vector Vector of current parameters
  * \param proposed_vector Output vector of proposed parameters
  */
 HEMI_KERNEL(pick_new_vector)(int nthreads, RNGState* rng,
                              const float* sigma,
+                             const double* cholesky, double* z,
                              const double* current_vector,
                              double* proposed_vector);
 
@@ -72,7 +53,7 @@ HEMI_KERNEL(pick_new_vector)(int nthreads, RNGState* rng,
  * The step buffer is an (Nsignals + 1 x Nsteps) matrix, where the last column
  * contains the likelihood value.
  *
- * \param rng Random-number generator states, used in GPU mode only
+ * \param rng Generators; the first is used for the acceptance test
  * \param nll_current The NLL of the current parameters
  * \param nll_proposed the NLL of the proposed parameters
  * \param v_current The current parameters
@@ -81,11 +62,13 @@ HEMI_KERNEL(pick_new_vector)(int nthreads, RNGState* rng,
  * \param accepted Number of accepted steps
  * \param counter The number of steps in the buffer
  * \param jump_buffer The step buffer
+ * \param temperature Chain temperature; the NLL difference is divided by it
  */
 HEMI_KERNEL(jump_decider)(RNGState* rng, double* nll_current,
                           const double* nll_proposed, double* v_current,
                           const double* v_proposed, unsigned nparameters,
-                          int* accepted, int* counter, float* jump_buffer);
+                          int* accepted, int* counter, float* jump_buffer,
+                          const double temperature=1.0);
 
 
 /**
@@ -104,6 +87,69 @@ HEMI_KERNEL(nll_event_chunks)(const float* lut, const int* dataweights, const do
                               double* sums);
 
 
+/**
+ * Number of parameter vectors handled per pass over the lookup table in the
+ * batched NLL kernels. Bounds the per-thread accumulator arrays.
+ */
+#define NLL_BATCH_TILE 8
+
+
+/**
+ * Batched NLL Part 1
+ *
+ * Calculate the -sum(log(sum(Nj * Pj(xi)))) contribution to the NLL for
+ * nvectors parameter vectors at once. Each pass over the lookup table serves
+ * NLL_BATCH_TILE vectors, so the table is streamed from memory
+ * nvectors / NLL_BATCH_TILE times rather than nvectors times.
+ *
+ * Partial sums for vector k are written to sums[k * nthreads + thread], where
+ * nthreads is the total number of threads in the launch.
+ *
+ * \param lut Pj(xi) lookup table(s)
+ * \param lut_stride Offset between the tables for consecutive vectors, zero
+ *                   if all vectors share one table
+ * \param dataweights Weight of each event
+ * \param pars Parameter vectors, stored consecutively
+ * \param par_stride Offset between consecutive parameter vectors
+ * \param nvectors Number of parameter vectors
+ * \param ne Number of events in the data
+ * \param ns Number of signals
+ * \param sums Output sums for subsets of events, for each vector
+ */
+HEMI_KERNEL(nll_event_chunks_batch)(const float* lut, const size_t lut_stride,
+                                    const int* dataweights,
+                                    const double* pars,
+                                    const size_t par_stride,
+                                    const unsigned nvectors,
+                                    const size_t ne, const size_t ns,
+                                    double* sums);
+
+
+/**
+ * Batched NLL Parts 2 and 3
+ *
+ * Total up the partial sums from the batched Part 1 and add normalization
+ * and constraint terms, for each parameter vector.
+ *
+ * \param nvectors Number of parameter vectors
+ * \param npartial_sums Number of partial sums per vector
+ * \param sums The partial sums
+ * \param nparameters The number of parameters (and the vector stride)
+ * \param pars Parameter vectors, stored consecutively
+ * \param nsignals Number of signal parameters
+ * \param means Expected rates and means of systematics
+ * \param sigmas Gaussian constraint sigma, same units as means
+ * \param nll Output: the total NLL for each vector
+ */
+HEMI_KERNEL(nll_total_batch)(const unsigned nvectors,
+                             const size_t npartial_sums, const double* sums,
+                             const size_t nparameters, const double* pars,
+                             const size_t nsignals,
+                             const double* means,
+                             const double* sigmas,
+                             double* nll);
+
+
 /**
  * NLL Part 2
  *
@@ -160,7 +206,10 @@ HEMI_KERNEL(nll_total)(const size_t nparameters, const double* pars,
  * \param jump_buffer The buffer of steps (vectors and likelihoods)
  * \param nparameters The number of parameters (dimensions in the L space)
  * \param sigma The jump distribution widths in each dimension
+ * \param cholesky Proposal covariance factor, or NULL to use sigma
+ * \param z Scratch space for the correlated proposal, nparameters long
  * \param debug_mode Enable debugging mode, where every step is accepted
+ * \param temperature Chain temperature, 1 for the target distribution
  */
 HEMI_KERNEL(finish_nll_jump_pick_combo)(const size_t npartial_sums,
                                         const double* sums, const size_t ns,
@@ -173,7 +222,10 @@ HEMI_KERNEL(finish_nll_jump_pick_combo)(const size_t npartial_sums,
                                         int* accepted, int* counter,
                                         float* jump_buffer, int nparameters,
                                         const float* sigma,
-                                        const bool debug_mode=false);
+                                        const double* cholesky=NULL,
+                                        double* z=NULL,
+                                        const bool debug_mode=false,
+                                        const double temperature=1.0);
 
 #endif  // __NLL_H__
 
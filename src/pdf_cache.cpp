@@ -0,0 +1,237 @@
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <sxmc/pdf_cache.h>
+
+// Fixed-size start of a cache file, followed by the key text (padded to a
+// multiple of 8 bytes), the samples and the weights
+struct PDFCacheHeader {
+  char magic[8];
+  unsigned long long key_length;
+  unsigned long long nfields;
+  unsigned long long nsamples;
+  unsigned long long column_major;
+  double nevents_physical;
+  double nevents;
+  double nexpected;
+  double efficiency;
+};
+
+static const char PDF_CACHE_MAGIC[8] = { 'S', 'X', 'M', 'C', 'P', 'D', 'F', '2' };
+
+
+static size_t padded_key_length(size_t length) {
+  return (length + 7) / 8 * 8;
+}
+
+
+void PDFCacheKey::add(const std::string& s) {
+  this->text += s;
+  this->text += "\n";
+}
+
+
+void PDFCacheKey::add(double v) {
+  std::ostringstream ss;
+  ss << std::setprecision(17) << v;
+  this->add(ss.str());
+}
+
+
+void PDFCacheKey::add_file(const std::string& filename) {
+  struct stat st;
+  std::ostringstream ss;
+  ss << filename;
+  if (stat(filename.c_str(), &st) == 0) {
+    ss << " " << st.st_size << " " << st.st_mtime;
+  }
+  this->add(ss.str());
+}
+
+
+std::string PDFCacheKey::hash() const {
+  unsigned long long h = 14695981039346656037ull;
+  for (size_t i=0; i<this->text.size(); i++) {
+    h ^= (unsigned char) this->text[i];
+    h *= 1099511628211ull;
+  }
+
+  std::ostringstream ss;
+  ss << std::hex << std::setw(16) << std::setfill('0') << h;
+  return ss.str();
+}
+
+
+PDFCache::PDFCache(const std::string& _directory) : directory(_directory) {}
+
+
+std::string PDFCache::filename(const PDFCacheKey& key) const {
+  return this->directory + "/" + key.hash() + ".pdf";
+}
+
+
+const void* PDFCache::map_file(const PDFCacheKey& key, size_t& size,
+                               PDFCacheEntry& entry, const float*& samples,
+                               const int*& weights, size_t& nsamples) const {
+  if (!this->enabled()) {
+    return NULL;
+  }
+
+  std::string name = this->filename(key);
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(PDFCacheHeader)) {
+    close(fd);
+    return NULL;
+  }
+  size = st.st_size;
+
+  void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  const char* base = static_cast<const char*>(map);
+  const PDFCacheHeader* header = reinterpret_cast<const PDFCacheHeader*>(base);
+  size_t key_offset = sizeof(PDFCacheHeader);
+  size_t samples_offset = key_offset + padded_key_length(header->key_length);
+  size_t weights_offset = \
+    samples_offset + header->nsamples * header->nfields * sizeof(float);
+  size_t end = weights_offset + header->nsamples * sizeof(int);
+
+  bool valid = \
+    memcmp(header->magic, PDF_CACHE_MAGIC, sizeof(PDF_CACHE_MAGIC)) == 0 &&
+    header->key_length == key.str().size() &&
+    samples_offset <= size && end == size &&
+    key.str().compare(0, std::string::npos, base + key_offset,
+                      header->key_length) == 0;
+
+  if (!valid) {
+    munmap(map, size);
+    return NULL;
+  }
+
+  entry.nfields = header->nfields;
+  entry.column_major = header->column_major != 0;
+  entry.nevents_physical = header->nevents_physical;
+  entry.nevents = header->nevents;
+  entry.nexpected = header->nexpected;
+  entry.efficiency = header->efficiency;
+  samples = reinterpret_cast<const float*>(base + samples_offset);
+  weights = reinterpret_cast<const int*>(base + weights_offset);
+  nsamples = header->nsamples;
+  return map;
+}
+
+
+bool PDFCache::load(const PDFCacheKey& key, PDFCacheEntry& entry) const {
+  size_t size, nsamples;
+  const float* samples;
+  const int* weights;
+  const void* map = map_file(key, size, entry, samples, weights, nsamples);
+  if (!map) {
+    return false;
+  }
+
+  entry.samples.assign(samples, samples + nsamples * entry.nfields);
+  entry.weights.assign(weights, weights + nsamples);
+
+  munmap(const_cast<void*>(map), size);
+  return true;
+}
+
+
+bool PDFCache::map(const PDFCacheKey& key, PDFCacheEntry& entry,
+                   const float*& samples, const int*& weights,
+                   size_t& nsamples) const {
+  // The mapping is never released, since the PDF built on it lives until
+  // the process exits
+  size_t size;
+  if (!map_file(key, size, entry, samples, weights, nsamples)) {
+    return false;
+  }
+
+  entry.samples.clear();
+  entry.weights.clear();
+  return true;
+}
+
+
+bool PDFCache::store(const PDFCacheKey& key, const PDFCacheEntry& entry) const {
+  if (!this->enabled()) {
+    return false;
+  }
+
+  mkdir(this->directory.c_str(), 0755);
+
+  std::string name = this->filename(key);
+  // A unique temporary name, since threads of one process may store the
+  // same entry at once
+  std::string tmpname = name + ".tmp.XXXXXX";
+  int fd = mkstemp(&tmpname[0]);
+  FILE* f = NULL;
+  if (fd >= 0) {
+    fchmod(fd, 0644);
+    f = fdopen(fd, "wb");
+    if (!f) {
+      close(fd);
+      remove(tmpname.c_str());
+    }
+  }
+  if (!f) {
+    std::cerr << "PDFCache: Cannot write " << tmpname << std::endl;
+    return false;
+  }
+
+  PDFCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PDF_CACHE_MAGIC, sizeof(PDF_CACHE_MAGIC));
+  header.key_length = key.str().size();
+  header.nfields = entry.nfields;
+  header.nsamples = entry.weights.size();
+  header.column_major = entry.column_major;
+  header.nevents_physical = entry.nevents_physical;
+  header.nevents = entry.nevents;
+  header.nexpected = entry.nexpected;
+  header.efficiency = entry.efficiency;
+
+  std::string padded_key(key.str());
+  padded_key.resize(padded_key_length(key.str().size()), '\0');
+
+  bool ok = \
+    entry.samples.size() == entry.weights.size() * entry.nfields &&
+    fwrite(&header, sizeof(header), 1, f) == 1 &&
+    fwrite(padded_key.data(), 1, padded_key.size(), f) == padded_key.size() &&
+    (entry.samples.empty() ||
+     fwrite(&entry.samples[0], sizeof(float), entry.samples.size(), f) ==
+       entry.samples.size()) &&
+    (entry.weights.empty() ||
+     fwrite(&entry.weights[0], sizeof(int), entry.weights.size(), f) ==
+       entry.weights.size());
+  ok = (fclose(f) == 0) && ok;
+
+  if (!ok || rename(tmpname.c_str(), name.c_str()) != 0) {
+    std::cerr << "PDFCache: Cannot write " << name << std::endl;
+    remove(tmpname.c_str());
+    return false;
+  }
+
+  return true;
+}
+
@@ -0,0 +1,139 @@
+/**
+ * \file pdf_cache.h
+ *
+ * On-disk cache of the samples that signal PDFs are built from.
+ */
+
+#ifndef __PDF_CACHE_H__
+#define __PDF_CACHE_H__
+
+#include <string>
+#include <vector>
+
+/**
+ * \class PDFCacheKey
+ * \brief Description of everything that determines a cached PDF
+ *
+ * Values are appended as text, and the cache file is named by a hash of
+ * the text. The full text is also stored in the file and compared when
+ * loading, so a hash collision is only a miss.
+ */
+class PDFCacheKey {
+  public:
+    /** Append a string */
+    void add(const std::string& s);
+
+    /** Append a number, exactly */
+    void add(double v);
+
+    /**
+     * Append the identity of an input file: its path, size and
+     * modification time. The contents are not hashed, since reading them
+     * costs as much as building the PDF.
+     */
+    void add_file(const std::string& filename);
+
+    /** Get the text of the key */
+    const std::string& str() const { return this->text; }
+
+    /** Get the 64-bit FNV-1a hash of the text, in hex */
+    std::string hash() const;
+
+  protected:
+    std::string text;  //!< key text, one value per line
+};
+
+
+/**
+ * \struct PDFCacheEntry
+ * \brief The samples of a PDF and the numbers derived along with them
+ */
+struct PDFCacheEntry {
+  size_t nfields;  //!< number of fields per sample
+  bool column_major;  //!< samples are by field, as in pdfz::EvalHist
+  std::vector<float> samples;  //!< samples, row-major unless column_major
+  std::vector<int> weights;  //!< weight of each sample
+  double nevents_physical;  //!< events read before cuts
+  double nevents;  //!< events in the PDF at the mean systematics
+  double nexpected;  //!< expected events, where that depends on inputs
+  double efficiency;  //!< efficiency, where that depends on inputs
+};
+
+
+/**
+ * \class PDFCache
+ * \brief Directory of cached PDF samples
+ *
+ * Each entry is one binary file: a fixed header, the key text, the
+ * samples and then the weights, in native byte order, so it can be
+ * mapped into memory and used directly. Processes that map the same
+ * entry share one copy of it in memory. Files are written under a
+ * temporary name and renamed, so concurrent jobs sharing a cache never
+ * see a partial entry.
+ */
+class PDFCache {
+  public:
+    /**
+     * Constructor
+     *
+     * \param _directory Directory to keep entries in, or "" to disable
+     */
+    PDFCache(const std::string& _directory);
+
+    /** True if the cache has a directory */
+    bool enabled() const { return !this->directory.empty(); }
+
+    /**
+     * Load an entry.
+     *
+     * \param key The key
+     * \param entry Filled in from the cache, if found
+     * \return True if the entry was found and valid
+     */
+    bool load(const PDFCacheKey& key, PDFCacheEntry& entry) const;
+
+    /**
+     * Map an entry into memory read-only, without copying the samples.
+     *
+     * The mapping lasts until the process exits, and its pages are
+     * shared with every other process mapping the same entry.
+     *
+     * \param key The key
+     * \param entry Filled in from the cache, except samples and weights
+     * \param samples Set to the mapped samples
+     * \param weights Set to the mapped weights
+     * \param nsamples Set to the number of samples
+     * \return True if the entry was found and valid
+     */
+    bool map(const PDFCacheKey& key, PDFCacheEntry& entry,
+             const float*& samples, const int*& weights,
+             size_t& nsamples) const;
+
+    /**
+     * Store an entry, replacing any with the same key.
+     *
+     * \param key The key
+     * \param entry The entry
+     * \return True if the entry was written
+     */
+    bool store(const PDFCacheKey& key, const PDFCacheEntry& entry) const;
+
+  protected:
+    /** Get the file name for a key */
+    std::string filename(const PDFCacheKey& key) const;
+
+    /**
+     * Map and check the file for a key, filling in all but the samples
+     * and weights of the entry, and pointing to those in the mapping.
+     *
+     * \return The mapping, of the given size, or NULL if not valid
+     */
+    const void* map_file(const PDFCacheKey& key, size_t& size,
+                         PDFCacheEntry& entry, const float*& samples,
+                         const int*& weights, size_t& nsamples) const;
+
+    std::string directory;  //!< cache directory, or "" if disabled
+};
+
+#endif  // __PDF_CACHE_H__
+
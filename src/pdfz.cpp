@@ -1,4 +1,6 @@
 #include <iostream>
+#include <sstream>
+#include <algorithm>
 #include <math.h>
 #include <cuda.h>
 #include <math_constants.h> // CUDA header
@@ -11,9 +13,40 @@
 #include <sxmc/generator.h>
 #include <sxmc/pdfz.h>
 #include <sxmc/cuda_compat.h>
+#include <sxmc/rng.h>
+#include <sxmc/tuning_cache.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifndef __CUDACC__
+#include <sxmc/simd_kernels.h>
+#endif
 
 namespace pdfz {
-    const int MAX_NFIELDS = 10;
+    // Most observables of a PDF, for per-observable arrays in kernels
+    const int MAX_NOBS = 10;
+
+    // Shared memory available to the private histograms of one block
+    const int SHARED_HIST_BYTES = 32768;
+
+    // Number of private copies of a histogram (plus one shared norm) that
+    // each block keeps in shared memory: one per warp if they fit, so that
+    // peaked spectra only contend within a warp, else one per block, or 0
+    // if even a single copy does not fit and bins must go straight to the
+    // global histogram.
+    int private_hist_copies(int total_nbins, int nthreads_per_block)
+    {
+        const int max_nbins = SHARED_HIST_BYTES / sizeof(unsigned int) - 1;
+        const int nwarps = (nthreads_per_block + 31) / 32;
+
+        if (total_nbins * nwarps <= max_nbins)
+            return nwarps;
+        if (total_nbins <= max_nbins)
+            return 1;
+        return 0;
+    }
 
     // Changes the size of an array while preserving its contents.
     // Shrinking the array only preserves the initial entries, while truncating
@@ -107,11 +140,6 @@ namespace pdfz {
 
     void Eval::AddSystematic(const Systematic &syst)
     {
-        if (this->syst)
-            resize_array(*(this->syst), this->syst->size() + 1);
-        else
-            this->syst = new hemi::Array<SystematicDescriptor>(1, true);
-
         SystematicDescriptor desc;
         desc.type = syst.type;
         if (syst.type == Systematic::SHIFT) {
@@ -133,28 +161,104 @@ namespace pdfz {
             throw Error("Unknown systematic type");
         }
 
+        // The kernels compute each observable on its own from the stored
+        // fields, which needs the true fields to stay untransformed
+        const int nsyst = this->syst ? this->syst->size() : 0;
+        for (int isyst=0; isyst <= nsyst; isyst++) {
+            const SystematicDescriptor &other = (isyst < nsyst) ? this->syst->readOnlyHostPtr()[isyst] : desc;
+            if ((desc.type == Systematic::RESOLUTION_SCALE && other.obs == desc.extra_field) ||
+                (other.type == Systematic::RESOLUTION_SCALE && other.extra_field == desc.obs))
+                throw Error("The true field of a resolution systematic cannot itself have a systematic.");
+        }
+
+        if (this->syst)
+            resize_array(*(this->syst), this->syst->size() + 1);
+        else
+            this->syst = new hemi::Array<SystematicDescriptor>(1, true);
+
         this->syst->writeOnlyHostPtr()[this->syst->size() - 1] = desc;
     }
 
 
+    std::vector<int> Eval::GetSystematicParameters()
+    {
+        std::vector<int> pars;
+        if (!this->syst)
+            return pars;
+
+        for (int i=0; i < (int) this->syst->size(); i++) {
+            int par = this->syst->readOnlyHostPtr()[i].par;
+            if (std::find(pars.begin(), pars.end(), par) == pars.end())
+                pars.push_back(par);
+        }
+
+        return pars;
+    }
+
+
     ///////////////////// EvalHist ///////////////////////
 
     EvalHist::EvalHist(const std::vector<float> &_samples, const std::vector<int> &_weights, int nfields, int nobservables,
                        const std::vector<double> &lower, const std::vector<double> &upper,
                        const std::vector<int> &_nbins, bool optimize) :
         Eval(_samples, nfields, nobservables, lower, upper),
-        samples(_samples.size(), false), weights(_weights.size(), true), read_bins(0), 
-        nbins(_nbins.size(), true), bin_stride(_nbins.size(), true), bins(0), needs_optimization(optimize)
+        samples(_samples.size(), false), weights(_weights.size(), true), shared_samples(0), shared_weights(0),
+        read_bins(0), nbins(_nbins.size(), true), bin_stride(_nbins.size(), true), bins(0), fused_accum(0),
+        sorted_obs(-1), sorted_nsyst(-1), sorted_row_start(1, true), sorted_cum_weights(1, true),
+        single_precision(false), needs_optimization(optimize)
+    {
+        // Store the samples column by column, so that each pass reads only
+        // the fields it needs, and neighboring threads read neighboring
+        // values
+        const size_t nsamples = _samples.size() / nfields;
+        std::vector<float> columns(_samples.size());
+        for (size_t isample=0; isample < nsamples; isample++) {
+            for (int ifield=0; ifield < nfields; ifield++)
+                columns[ifield * nsamples + isample] = _samples[isample * nfields + ifield];
+        }
+        this->samples.copyFromHost(&columns.front(), columns.size());
+        this->weights.copyFromHost(&_weights.front(), _weights.size());
+
+        Init(nsamples, lower, upper, _nbins);
+    }
+
+    EvalHist::EvalHist(const float *_samples, const int *_weights, int nsamples, int nfields, int nobservables,
+                       const std::vector<double> &lower, const std::vector<double> &upper,
+                       const std::vector<int> &_nbins, bool optimize) :
+        Eval(std::vector<float>(), nfields, nobservables, lower, upper),
+    #ifdef __CUDACC__
+        samples((size_t) nsamples * nfields, false), weights(nsamples, true),
+    #else
+        samples(1, false), weights(1, true),
+    #endif
+        shared_samples(0), shared_weights(0),
+        read_bins(0), nbins(_nbins.size(), true), bin_stride(_nbins.size(), true), bins(0), fused_accum(0),
+        sorted_obs(-1), sorted_nsyst(-1), sorted_row_start(1, true), sorted_cum_weights(1, true),
+        single_precision(false), needs_optimization(optimize)
+    {
+        #ifdef __CUDACC__
+        // The kernels read the samples from device memory, which is per process
+        this->samples.copyFromHost(_samples, (size_t) nsamples * nfields);
+        this->weights.copyFromHost(_weights, nsamples);
+        #else
+        this->shared_samples = _samples;
+        this->shared_weights = _weights;
+        #endif
+
+        Init(nsamples, lower, upper, _nbins);
+    }
+
+    void EvalHist::Init(int _nsamples, const std::vector<double> &lower, const std::vector<double> &upper,
+                        const std::vector<int> &_nbins)
     {
         if ( (int) _nbins.size() != nobservables)
             throw Error("Size of nbins array must be same as number of observables.");
 
-        if (nfields > MAX_NFIELDS)
-            throw Error("Exceeded maximum number of fields per sample.  Edit MAX_NFIELDS in pdfz.cpp to fix this!");
+        if (nobservables > MAX_NOBS)
+            throw Error("Exceeded maximum number of observables.  Edit MAX_NOBS in pdfz.cpp to fix this!");
 
-        this->samples.copyFromHost(&_samples.front(), _samples.size());
+        this->nsamples = _nsamples;
         this->nbins.copyFromHost(&_nbins.front(), _nbins.size());
-        this->weights.copyFromHost(&_weights.front(), _weights.size());
 
         // Compute bin volume
         this->bin_volume = 1.0f;
@@ -177,23 +281,94 @@ namespace pdfz {
 
         this->bins = new hemi::Array<unsigned int>(this->total_nbins, true);
 
+        #ifdef __CUDACC__
+        // Bins, norm and block count of bin_eval_fused, which must start zeroed
+        const std::vector<unsigned int> zeros(this->total_nbins + 2, 0);
+        this->fused_accum = new hemi::Array<unsigned int>(zeros.size(), false);
+        this->fused_accum->copyFromHost(&zeros.front(), zeros.size());
+        #endif
 
+
+        const size_t nvalues = (size_t) _nsamples * this->nfields;
         this->bin_nthreads_per_block = 256;
-        if (_samples.size() > 100000)
+        if (nvalues > 100000)
             this->bin_nblocks = 64;
-        else if (_samples.size() > 10000)
+        else if (nvalues > 10000)
             this->bin_nblocks = 16;
         else
             this->bin_nblocks = 4;
 
         this->eval_nthreads_per_block = 256;
         this->eval_nblocks = 64;
+
+        // CPU-only: one worker per ~50k samples, so that small PDFs don't pay
+        // thread startup and histogram merge costs
+        this->host_nthreads = 1;
+        #ifdef _OPENMP
+        this->host_nthreads = std::max(1, std::min(omp_get_max_threads(), _nsamples / 50000));
+        #endif
     }
 
     EvalHist::~EvalHist()
     {
         delete this->read_bins;
         delete this->bins;
+        delete this->fused_accum;
+    }
+
+    Eval *EvalHist::Clone() const
+    {
+        const float *samples = this->HostSamplesPtr();
+        const int *weights = this->HostWeightsPtr();
+        const double *lower = this->lower.readOnlyHostPtr();
+        const double *upper = this->upper.readOnlyHostPtr();
+        const int *nbins = this->nbins.readOnlyHostPtr();
+        const std::vector<double> lower_vec(lower, lower + this->nobservables);
+        const std::vector<double> upper_vec(upper, upper + this->nobservables);
+        const std::vector<int> nbins_vec(nbins, nbins + this->nobservables);
+        const size_t nsamples = this->nsamples;
+
+        EvalHist *clone;
+        if (this->shared_samples) {
+            // Clones share the samples too
+            clone = new EvalHist(samples, weights, nsamples, this->nfields, this->nobservables,
+                                 lower_vec, upper_vec, nbins_vec, this->needs_optimization);
+        }
+        else {
+            // The constructor takes the samples row by row
+            std::vector<float> rows(nsamples * this->nfields);
+            for (size_t isample=0; isample < nsamples; isample++) {
+                for (int ifield=0; ifield < this->nfields; ifield++)
+                    rows[isample * this->nfields + ifield] = samples[ifield * nsamples + isample];
+            }
+
+            clone = new EvalHist(rows, std::vector<int>(weights, weights + nsamples),
+                                 this->nfields, this->nobservables,
+                                 lower_vec, upper_vec, nbins_vec, this->needs_optimization);
+        }
+
+        if (this->syst) {
+            clone->syst = new hemi::Array<SystematicDescriptor>(this->syst->size(), true);
+            clone->syst->copyFromHost(this->syst->readOnlyHostPtr(), this->syst->size());
+        }
+
+        clone->single_precision = this->single_precision;
+
+        // Keep any launch configuration already found by Optimize()
+        clone->bin_nthreads_per_block = this->bin_nthreads_per_block;
+        clone->bin_nblocks = this->bin_nblocks;
+        clone->eval_nthreads_per_block = this->eval_nthreads_per_block;
+        clone->eval_nblocks = this->eval_nblocks;
+
+        return clone;
+    }
+
+    void EvalHist::GetSamples(std::vector<float> &columns, std::vector<int> &_weights) const
+    {
+        const float *samples = this->HostSamplesPtr();
+        const int *weights = this->HostWeightsPtr();
+        columns.assign(samples, samples + (size_t) this->nsamples * this->nfields);
+        _weights.assign(weights, weights + this->nsamples);
     }
 
     void EvalHist::SetEvalPoints(const std::vector<float> &points)
@@ -246,23 +421,219 @@ namespace pdfz {
         }
     }
 
+    // One sample in the sorted layout: row (bin in the other observables)
+    // and value of the shifted observable
+    struct SortKey
+    {
+        int row;
+        float x;
+        int index;
+
+        bool operator<(const SortKey &other) const
+        {
+            return row < other.row || (row == other.row && x < other.x);
+        }
+    };
+
+    void EvalHist::SortSamples()
+    {
+        const int nsyst = this->syst ? this->syst->size() : 0;
+        const int nsamples = this->nsamples;
+        this->sorted_obs = -1;
+        this->sorted_nsyst = nsyst;
+
+        // Every systematic must be a shift or scale of one observable
+        if (nsyst == 0)
+            return;
+
+        const SystematicDescriptor *syst = this->syst->readOnlyHostPtr();
+        const int obs = syst[0].obs;
+        for (int isyst=0; isyst < nsyst; isyst++) {
+            if ((syst[isyst].type != Systematic::SHIFT && syst[isyst].type != Systematic::SCALE) ||
+                syst[isyst].obs != obs || obs >= this->nobservables)
+                return;
+        }
+
+        // Two binary searches per bin must beat one pass over the samples
+        if (2.0 * this->total_nbins * log2(nsamples + 1.0) >= nsamples)
+            return;
+
+        const float *samples = this->HostSamplesPtr();
+        const int *weights = this->HostWeightsPtr();
+        const double *lower = this->lower.readOnlyHostPtr();
+        const double *upper = this->upper.readOnlyHostPtr();
+        const int *nbins = this->nbins.readOnlyHostPtr();
+        const int *bin_stride = this->bin_stride.readOnlyHostPtr();
+
+        // Rows enumerate the bins of the other observables, as
+        // row = (bin / (stride * nbins)) * stride + bin % stride, with
+        // stride and nbins those of the shifted observable.  Samples outside
+        // the domain in another observable, or not a number in the shifted
+        // one, can never be counted and go last.
+        const int nrows = this->total_nbins / nbins[obs];
+        std::vector<SortKey> keys(nsamples);
+        for (int isample=0; isample < nsamples; isample++) {
+            const float x = samples[(size_t) obs * nsamples + isample];
+            int bin_id = 0;
+            bool in_rows = !isnan(x);
+            for (int iobs=0; iobs < this->nobservables && in_rows; iobs++) {
+                if (iobs == obs)
+                    continue;
+                const double element = samples[(size_t) iobs * nsamples + isample];
+                if (element < lower[iobs] || element >= upper[iobs]) {
+                    in_rows = false;
+                    break;
+                }
+                const int ibin = (int)( (element - lower[iobs]) * (nbins[iobs] / (upper[iobs] - lower[iobs])) );
+                bin_id += std::min(ibin, nbins[iobs] - 1) * bin_stride[iobs];
+            }
+
+            keys[isample].row = in_rows ?
+                (bin_id / (bin_stride[obs] * nbins[obs])) * bin_stride[obs] + bin_id % bin_stride[obs] : nrows;
+            keys[isample].x = in_rows ? x : 0;
+            keys[isample].index = isample;
+        }
+
+        // Samples saved in this order, e.g. shared ones, need not move
+        bool in_order = true;
+        for (int isample=1; isample < nsamples && in_order; isample++)
+            in_order = !(keys[isample] < keys[isample - 1]);
+
+        if (!in_order) {
+            // Shared samples are read-only
+            if (this->shared_samples)
+                return;
+            std::sort(keys.begin(), keys.end());
+        }
+
+        std::vector<int> row_start(nrows + 1);
+        std::vector<unsigned int> cum_weights(nsamples + 1);
+
+        int irow = 0;
+        cum_weights[0] = 0;
+        for (int isample=0; isample < nsamples; isample++) {
+            cum_weights[isample + 1] = cum_weights[isample] + weights[keys[isample].index];
+
+            while (irow <= keys[isample].row && irow <= nrows)
+                row_start[irow++] = isample;
+        }
+        while (irow <= nrows)
+            row_start[irow++] = nsamples;
+
+        // The histogram does not depend on the order of the samples, so
+        // reorder them in place, and the plain binning kernels still work
+        if (!in_order) {
+            std::vector<float> sorted_samples((size_t) nsamples * this->nfields);
+            std::vector<int> sorted_weights(nsamples);
+            for (int isample=0; isample < nsamples; isample++) {
+                const int index = keys[isample].index;
+                for (int ifield=0; ifield < this->nfields; ifield++)
+                    sorted_samples[(size_t) ifield * nsamples + isample] = samples[(size_t) ifield * nsamples + index];
+                sorted_weights[isample] = weights[index];
+            }
+
+            this->samples.copyFromHost(&sorted_samples.front(), sorted_samples.size());
+            this->weights.copyFromHost(&sorted_weights.front(), sorted_weights.size());
+        }
+        this->sorted_row_start.copyFromHost(&row_start.front(), row_start.size());
+        this->sorted_cum_weights.copyFromHost(&cum_weights.front(), cum_weights.size());
+        this->sorted_obs = obs;
+    }
+
     ///// EvalHist kernels
+
+    // One systematic transformation of an observable value.  true_value
+    // points to the true field, and is only read by resolution systematics.
+    template <typename T>
     HEMI_DEV_CALLABLE_INLINE
-    void apply_systematic(const SystematicDescriptor *syst, double *fields, const double *parameters, const int param_stride)
+    T apply_systematic(const short type, const T par, const T value, const float *true_value)
     {
-        switch (syst->type) {
+        switch (type) {
             case Systematic::SHIFT:
-            fields[syst->obs] += parameters[syst->par * param_stride];
-            break;
+            return value + par;
             case Systematic::SCALE:
-            fields[syst->obs] *= (1 + parameters[syst->par * param_stride]);
-            break;
+            return value * (1 + par);
             case Systematic::RESOLUTION_SCALE:
-            fields[syst->obs] += parameters[syst->par * param_stride] * (fields[syst->obs] - fields[syst->extra_field]);
-            break;
+            return value + par * (value - (T) *true_value);
         }
+        return value;
     }
 
+    // Value of observable iobs of one sample after the systematics, in
+    // precision T.  Field i of the sample is sample[i * field_stride], so
+    // this reads only the fields it needs from either layout.  Systematics
+    // are applied in order, and never transform the true field of a
+    // resolution systematic (see Eval::AddSystematic), so each observable
+    // can be computed on its own.
+    template <typename T>
+    HEMI_DEV_CALLABLE_INLINE
+    T observable_value(const float *sample, const int field_stride, const int iobs,
+                       const int nsyst, const SystematicDescriptor * __restrict__ syst,
+                       const double * __restrict__ parameters, const int param_stride)
+    {
+        T value = sample[iobs * field_stride];
+
+        for (int isyst=0; isyst < nsyst; isyst++) {
+            if (syst[isyst].obs == iobs)
+                value = apply_systematic<T>(syst[isyst].type, parameters[syst[isyst].par * param_stride], value,
+                                            sample + syst[isyst].extra_field * field_stride);
+        }
+
+        return value;
+    }
+
+    // Systematics read from memory for every sample, for any number of them
+    template <typename T>
+    struct RuntimeSystematics
+    {
+        int nsyst;
+        const SystematicDescriptor *syst;
+        const double *parameters;
+        int param_stride;
+
+        HEMI_DEV_CALLABLE_INLINE
+        T value(const float *sample, const int field_stride, const int iobs) const
+        {
+            return observable_value<T>(sample, field_stride, iobs, nsyst, syst, parameters, param_stride);
+        }
+    };
+
+    // Exactly NSYST systematics, loaded once into registers.  The loop over
+    // them unrolls, and the branch on each type is the same for every
+    // sample.  The arithmetic is that of RuntimeSystematics.
+    template <typename T, int NSYST>
+    struct FixedSystematics
+    {
+        short type[NSYST > 0 ? NSYST : 1];
+        short obs[NSYST > 0 ? NSYST : 1];
+        short extra_field[NSYST > 0 ? NSYST : 1];
+        T par[NSYST > 0 ? NSYST : 1];
+
+        HEMI_DEV_CALLABLE_INLINE
+        FixedSystematics(const SystematicDescriptor * __restrict__ syst,
+                         const double * __restrict__ parameters, const int param_stride)
+        {
+            for (int isyst=0; isyst < NSYST; isyst++) {
+                type[isyst] = syst[isyst].type;
+                obs[isyst] = syst[isyst].obs;
+                extra_field[isyst] = syst[isyst].extra_field;
+                par[isyst] = parameters[syst[isyst].par * param_stride];
+            }
+        }
+
+        HEMI_DEV_CALLABLE_INLINE
+        T value(const float *sample, const int field_stride, const int iobs) const
+        {
+            T value = sample[iobs * field_stride];
+            for (int isyst=0; isyst < NSYST; isyst++) {
+                if (obs[isyst] == iobs)
+                    value = apply_systematic<T>(type[isyst], par[isyst], value,
+                                                sample + extra_field[isyst] * field_stride);
+            }
+            return value;
+        }
+    };
+
     HEMI_KERNEL(zero_hist)(int total_nbins, unsigned int *bins, unsigned int *norm)
     {
         int offset = hemiGetElementOffset();
@@ -275,47 +646,52 @@ namespace pdfz {
             bins[i] = 0;
     }
 
-    HEMI_KERNEL(bin_samples)(int ndata, const float *data, const int *weights,
-                             const int nobs, const int nfields, 
+    // Bin samples first, first + step, ... (up to last) of the column-major
+    // data of nsamples, with the systematics and bin edges in precision T.
+    // NOBS is the number of observables if known at compile time, or 0 to
+    // use nobs; Systematics is one of the structs above.
+    template <typename T, int NOBS, typename Systematics>
+    HEMI_DEV_CALLABLE_INLINE
+    void bin_samples_range_t(int first, int last, int step, const int nsamples,
+                             const float *data, const int *weights, const int nobs_runtime,
                              const int * __restrict__ bin_stride, const int * __restrict__ nbins,
                              const double * __restrict__ lower, const double * __restrict__ upper,
-                             const int nsyst, const SystematicDescriptor * __restrict__ syst,
-                             const double * __restrict__ parameters, const int param_stride,
+                             const Systematics &systematics,
                              unsigned int *bins, unsigned int *norm)
     {
-        int offset = hemiGetElementOffset();
-        int stride = hemiGetElementStride();
-        double field_buffer[MAX_NFIELDS];
-        const int nsamples = ndata / nfields;
-
-        double bin_scale[MAX_NFIELDS];
-        for (int iobs=0; iobs < nobs; iobs++)
+        const int nobs = (NOBS > 0) ? NOBS : nobs_runtime;
+
+        T bin_lower[MAX_NOBS];
+        T bin_upper[MAX_NOBS];
+        T bin_scale[MAX_NOBS];
+        int obs_nbins[MAX_NOBS];
+        int obs_stride[MAX_NOBS];
+        for (int iobs=0; iobs < nobs; iobs++) {
+          bin_lower[iobs] = lower[iobs];
+          bin_upper[iobs] = upper[iobs];
           bin_scale[iobs] = nbins[iobs] / (upper[iobs] - lower[iobs]);
+          obs_nbins[iobs] = nbins[iobs];
+          obs_stride[iobs] = bin_stride[iobs];
+        }
 
         unsigned int thread_norm = 0;
 
-        for (int isample=offset; isample < nsamples; isample += stride) {
+        for (int isample=first; isample < last; isample += step) {
             bool in_pdf_domain = true;
             int bin_id = 0;
 
-            // Copy fields
-            for (int ifield=0; ifield < nfields; ifield++)
-                field_buffer[ifield] = data[isample * nfields + ifield];
-
-            // Apply systematics
-            for (int isyst=0; isyst < nsyst; isyst++)
-                apply_systematic(syst + isyst, field_buffer, parameters, param_stride);
-
             // Compute histogram bin
             for (int iobs=0; iobs < nobs; iobs++) {
-                double element = field_buffer[iobs];
+                const T element = systematics.value(data + isample, nsamples, iobs);
                 // Throw out this event if outside of PDF domain
-                if (element < lower[iobs] || element >= upper[iobs]) {
+                if (element < bin_lower[iobs] || element >= bin_upper[iobs]) {
                     in_pdf_domain = false;
                     break;
                 }
 
-                bin_id += (int)( (element - lower[iobs]) * bin_scale[iobs] ) * bin_stride[iobs];
+                // Rounding can put values just below the upper edge at nbins
+                const int ibin = (int)( (element - bin_lower[iobs]) * bin_scale[iobs] );
+                bin_id += min(ibin, obs_nbins[iobs] - 1) * obs_stride[iobs];
             }
 
             // Add to histogram if sample in PDF domain
@@ -328,6 +704,339 @@ namespace pdfz {
         atomicAdd(norm, thread_norm);
     }
 
+    // bin_samples_range_t specialized for the common numbers of observables
+    // and systematics, with the generic loop for the rest
+    template <typename T>
+    HEMI_DEV_CALLABLE_INLINE
+    void bin_samples_dispatch(int first, int last, int step, const int nsamples,
+                              const float *data, const int *weights, const int nobs,
+                              const int * __restrict__ bin_stride, const int * __restrict__ nbins,
+                              const double * __restrict__ lower, const double * __restrict__ upper,
+                              const int nsyst, const SystematicDescriptor * __restrict__ syst,
+                              const double * __restrict__ parameters, const int param_stride,
+                              unsigned int *bins, unsigned int *norm)
+    {
+        #define BIN_SAMPLES_FIXED(NOBS, NSYST)                                                  \
+        if (nobs == NOBS && nsyst == NSYST) {                                                   \
+            bin_samples_range_t<T, NOBS>(first, last, step, nsamples, data, weights, nobs,      \
+                                         bin_stride, nbins, lower, upper,                       \
+                                         FixedSystematics<T, NSYST>(syst, parameters, param_stride), \
+                                         bins, norm);                                           \
+            return;                                                                             \
+        }
+
+        BIN_SAMPLES_FIXED(1, 0) BIN_SAMPLES_FIXED(1, 1) BIN_SAMPLES_FIXED(1, 2) BIN_SAMPLES_FIXED(1, 3)
+        BIN_SAMPLES_FIXED(2, 0) BIN_SAMPLES_FIXED(2, 1) BIN_SAMPLES_FIXED(2, 2) BIN_SAMPLES_FIXED(2, 3)
+        BIN_SAMPLES_FIXED(3, 0) BIN_SAMPLES_FIXED(3, 1) BIN_SAMPLES_FIXED(3, 2) BIN_SAMPLES_FIXED(3, 3)
+        #undef BIN_SAMPLES_FIXED
+
+        RuntimeSystematics<T> systematics = { nsyst, syst, parameters, param_stride };
+        bin_samples_range_t<T, 0>(first, last, step, nsamples, data, weights, nobs,
+                                  bin_stride, nbins, lower, upper, systematics, bins, norm);
+    }
+
+    // bin_samples_dispatch in single or double precision
+    HEMI_DEV_CALLABLE_INLINE
+    void bin_samples_range(int first, int last, int step, const int nsamples, const bool single_precision,
+                           const float *data, const int *weights, const int nobs,
+                           const int * __restrict__ bin_stride, const int * __restrict__ nbins,
+                           const double * __restrict__ lower, const double * __restrict__ upper,
+                           const int nsyst, const SystematicDescriptor * __restrict__ syst,
+                           const double * __restrict__ parameters, const int param_stride,
+                           unsigned int *bins, unsigned int *norm)
+    {
+        if (single_precision)
+            bin_samples_dispatch<float>(first, last, step, nsamples, data, weights, nobs, bin_stride, nbins,
+                                        lower, upper, nsyst, syst, parameters, param_stride, bins, norm);
+        else
+            bin_samples_dispatch<double>(first, last, step, nsamples, data, weights, nobs, bin_stride, nbins,
+                                         lower, upper, nsyst, syst, parameters, param_stride, bins, norm);
+    }
+
+    HEMI_KERNEL(bin_samples)(int nsamples, bool single_precision,
+                             const float *data, const int *weights, const int nobs,
+                             const int * __restrict__ bin_stride, const int * __restrict__ nbins,
+                             const double * __restrict__ lower, const double * __restrict__ upper,
+                             const int nsyst, const SystematicDescriptor * __restrict__ syst,
+                             const double * __restrict__ parameters, const int param_stride,
+                             unsigned int *bins, unsigned int *norm)
+    {
+        bin_samples_range(hemiGetElementOffset(), nsamples, hemiGetElementStride(),
+                          nsamples, single_precision,
+                          data, weights, nobs, bin_stride, nbins, lower, upper,
+                          nsyst, syst, parameters, param_stride, bins, norm);
+    }
+
+    // Clear ncopies private histograms and a norm in shared memory
+    HEMI_DEV_CALLABLE_INLINE
+    void zero_private_hists(int ncopies, int total_nbins, unsigned int *block_bins)
+    {
+        #ifdef HEMI_DEV_CODE
+        for (int i=threadIdx.x; i <= ncopies * total_nbins; i += blockDim.x)
+            block_bins[i] = 0;
+        __syncthreads();
+        #endif
+    }
+
+    // Sum of bin ibin over ncopies private histograms
+    HEMI_DEV_CALLABLE_INLINE
+    unsigned int sum_private_hists(int ncopies, int total_nbins,
+                                   const unsigned int *block_bins, int ibin)
+    {
+        unsigned int sum = 0;
+        for (int icopy=0; icopy < ncopies; icopy++)
+            sum += block_bins[icopy * total_nbins + ibin];
+        return sum;
+    }
+
+    // bin_samples with privatized histograms: each warp bins into its own
+    // copy in shared memory (or the block shares one, see
+    // private_hist_copies), and the block adds the sum of its copies to the
+    // global histogram once per bin.  For peaked spectra, where most samples
+    // land in a few bins, this replaces contention between every thread in
+    // the grid with contention inside a warp on fast shared atomics.
+    HEMI_KERNEL(bin_samples_private)(int nsamples, bool single_precision,
+                                     const float *data, const int *weights, const int nobs,
+                                     const int * __restrict__ bin_stride, const int * __restrict__ nbins,
+                                     const double * __restrict__ lower, const double * __restrict__ upper,
+                                     const int nsyst, const SystematicDescriptor * __restrict__ syst,
+                                     const double * __restrict__ parameters, const int param_stride,
+                                     int total_nbins, int ncopies,
+                                     unsigned int *bins, unsigned int *norm)
+    {
+        #ifdef HEMI_DEV_CODE
+        extern __shared__ unsigned int block_bins[]; // ncopies * total_nbins, then norm
+        unsigned int *block_norm = block_bins + ncopies * total_nbins;
+        zero_private_hists(ncopies, total_nbins, block_bins);
+
+        unsigned int *copy_bins = block_bins + ((threadIdx.x / warpSize) % ncopies) * total_nbins;
+        bin_samples_range(hemiGetElementOffset(), nsamples, hemiGetElementStride(),
+                          nsamples, single_precision,
+                          data, weights, nobs, bin_stride, nbins, lower, upper,
+                          nsyst, syst, parameters, param_stride, copy_bins, block_norm);
+        __syncthreads();
+
+        for (int ibin=threadIdx.x; ibin < total_nbins; ibin += blockDim.x) {
+            const unsigned int sum = sum_private_hists(ncopies, total_nbins, block_bins, ibin);
+            if (sum > 0)
+                atomicAdd(bins + ibin, sum);
+        }
+        if (threadIdx.x == 0)
+            atomicAdd(norm, *block_norm);
+        #endif
+    }
+
+    // Bin of a sample along observable obs of the sorted layout, after the
+    // systematics, with the same arithmetic as bin_samples_range.  Values
+    // below the domain give -1 and values above give nbins.  Shifts and
+    // scales are monotonic, so this is monotonic along each row.
+    HEMI_DEV_CALLABLE_INLINE
+    int sorted_bin(const float *sample, const int field_stride, int obs,
+                   double lower, double upper, double bin_scale, int nbins,
+                   const int nsyst, const SystematicDescriptor * __restrict__ syst,
+                   const double * __restrict__ parameters, const int param_stride)
+    {
+        const double element = observable_value<double>(sample, field_stride, obs,
+                                                        nsyst, syst, parameters, param_stride);
+        if (element < lower)
+            return -1;
+        if (element >= upper)
+            return nbins;
+        return min((int)( (element - lower) * bin_scale ), nbins - 1);
+    }
+
+    // Total weight of the samples in [first, last) of the sorted layout
+    // whose bin is below ibin.  These are a prefix of the row if the
+    // transform is increasing, and a suffix if it is decreasing.
+    HEMI_DEV_CALLABLE_INLINE
+    unsigned int sorted_weight_below(int ibin, int first, int last, bool decreasing,
+                                     const float *data, const int nsamples, int obs,
+                                     double lower, double upper, double bin_scale, int nbins,
+                                     const int nsyst, const SystematicDescriptor * __restrict__ syst,
+                                     const double * __restrict__ parameters, const int param_stride,
+                                     const unsigned int * __restrict__ cum_weights)
+    {
+        // Find the first sample where (bin >= ibin) or (bin < ibin) starts
+        int lo = first;
+        int hi = last;
+        while (lo < hi) {
+            const int mid = lo + (hi - lo) / 2;
+            const int mid_bin = sorted_bin(data + mid, nsamples, obs, lower, upper, bin_scale, nbins,
+                                           nsyst, syst, parameters, param_stride);
+            if (decreasing ? (mid_bin < ibin) : (mid_bin >= ibin))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+
+        return decreasing ? cum_weights[last] - cum_weights[lo] : cum_weights[lo] - cum_weights[first];
+    }
+
+    // Content of histogram bin bin_id from the sorted layout
+    HEMI_DEV_CALLABLE_INLINE
+    unsigned int sorted_bin_content(int bin_id, const float *data, const int nsamples, int obs,
+                                    const int * __restrict__ bin_stride, const int * __restrict__ nbins,
+                                    const double * __restrict__ lower, const double * __restrict__ upper,
+                                    const int nsyst, const SystematicDescriptor * __restrict__ syst,
+                                    const double * __restrict__ parameters, const int param_stride,
+                                    const int * __restrict__ row_start,
+                                    const unsigned int * __restrict__ cum_weights)
+    {
+        const int stride = bin_stride[obs];
+        const int ibin = (bin_id / stride) % nbins[obs];
+        const int row = (bin_id / (stride * nbins[obs])) * stride + bin_id % stride;
+        const double bin_scale = nbins[obs] / (upper[obs] - lower[obs]);
+
+        double slope = 1.0;
+        for (int isyst=0; isyst < nsyst; isyst++) {
+            if (syst[isyst].type == Systematic::SCALE)
+                slope *= 1 + parameters[syst[isyst].par * param_stride];
+        }
+        const bool decreasing = slope < 0;
+
+        const unsigned int below = sorted_weight_below(ibin, row_start[row], row_start[row + 1], decreasing,
+                                                       data, nsamples, obs, lower[obs], upper[obs], bin_scale, nbins[obs],
+                                                       nsyst, syst, parameters, param_stride, cum_weights);
+        const unsigned int through = sorted_weight_below(ibin + 1, row_start[row], row_start[row + 1], decreasing,
+                                                         data, nsamples, obs, lower[obs], upper[obs], bin_scale, nbins[obs],
+                                                         nsyst, syst, parameters, param_stride, cum_weights);
+        return through - below;
+    }
+
+    // Fill every bin from the sorted layout; norm must be zeroed first
+    HEMI_KERNEL(bin_sorted)(int total_nbins, const float *data, const int nsamples, int obs,
+                            const int * __restrict__ bin_stride, const int * __restrict__ nbins,
+                            const double * __restrict__ lower, const double * __restrict__ upper,
+                            const int nsyst, const SystematicDescriptor * __restrict__ syst,
+                            const double * __restrict__ parameters, const int param_stride,
+                            const int * __restrict__ row_start,
+                            const unsigned int * __restrict__ cum_weights,
+                            unsigned int *bins, unsigned int *norm)
+    {
+        unsigned int thread_norm = 0;
+        for (int ibin=hemiGetElementOffset(); ibin < total_nbins; ibin += hemiGetElementStride()) {
+            bins[ibin] = sorted_bin_content(ibin, data, nsamples, obs, bin_stride, nbins, lower, upper,
+                                            nsyst, syst, parameters, param_stride, row_start, cum_weights);
+            thread_norm += bins[ibin];
+        }
+
+        if (thread_norm > 0)
+            atomicAdd(norm, thread_norm);
+    }
+
+#ifndef __CUDACC__
+    // Host version of bin_sorted followed by eval_pdf, in one parallel region
+    void bin_sorted_eval_host(int nthreads, int total_nbins, const float *data, const int nsamples, int obs,
+                              const int *bin_stride, const int *nbins,
+                              const double *lower, const double *upper,
+                              const int nsyst, const SystematicDescriptor *syst,
+                              const double *parameters, const int param_stride,
+                              const int *row_start, const unsigned int *cum_weights,
+                              unsigned int *bins, unsigned int *norm,
+                              int npoints, const int *read_bins, double bin_volume,
+                              float *output, int output_stride)
+    {
+        unsigned int total_norm = 0;
+
+        #pragma omp parallel num_threads(nthreads)
+        {
+            #ifdef _OPENMP
+            const int ithread = omp_get_thread_num();
+            const int nworkers = omp_get_num_threads();
+            #else
+            const int ithread = 0;
+            const int nworkers = 1;
+            #endif
+
+            // The implied barrier makes bins and total_norm final
+            #pragma omp for schedule(static) reduction(+:total_norm)
+            for (int ibin=0; ibin < total_nbins; ibin++) {
+                bins[ibin] = sorted_bin_content(ibin, data, nsamples, obs, bin_stride, nbins, lower, upper,
+                                                nsyst, syst, parameters, param_stride, row_start, cum_weights);
+                total_norm += bins[ibin];
+            }
+
+            if (npoints > 0) {
+                const int first = (long) npoints * ithread / nworkers;
+                const int last = (long) npoints * (ithread + 1) / nworkers;
+                simd::eval_pdf(last - first, read_bins + first, bins, total_norm * bin_volume,
+                               output + (size_t) first * output_stride, output_stride);
+            }
+        }
+
+        *norm = total_norm;
+    }
+
+    // Multi-core host replacement for the zero_hist, bin_samples and
+    // eval_pdf kernels, fused into one parallel region.
+    //
+    // Each thread bins a contiguous block of samples into its own private
+    // histogram (a slice of thread_bins), so no atomics are needed and the
+    // non-thread-safe atomicAdd in cuda_compat.h stays thread-local.  The
+    // private histograms are then summed into the output, each thread
+    // adding up its own range of bins with SIMD integer adds, and
+    // if npoints > 0, the PDF is read out at each point without leaving
+    // the region.
+    void bin_eval_host(int nthreads, std::vector<unsigned int> &thread_bins,
+                       int nsamples, bool single_precision,
+                       const float *data, const int *weights, const int nobs,
+                       const int *bin_stride, const int *nbins,
+                       const double *lower, const double *upper,
+                       const int nsyst, const SystematicDescriptor *syst,
+                       const double *parameters, const int param_stride,
+                       int total_nbins, unsigned int *bins, unsigned int *norm,
+                       int npoints, const int *read_bins, double bin_volume,
+                       float *output, int output_stride)
+    {
+        thread_bins.resize((size_t) nthreads * total_nbins);
+        unsigned int total_norm = 0;
+
+        #pragma omp parallel num_threads(nthreads)
+        {
+            #ifdef _OPENMP
+            const int ithread = omp_get_thread_num();
+            const int nworkers = omp_get_num_threads();
+            #else
+            const int ithread = 0;
+            const int nworkers = 1;
+            #endif
+
+            unsigned int *private_bins = &thread_bins[(size_t) ithread * total_nbins];
+            std::fill(private_bins, private_bins + total_nbins, 0);
+
+            unsigned int thread_norm = 0;
+            bin_samples_range((long) nsamples * ithread / nworkers,
+                              (long) nsamples * (ithread + 1) / nworkers, 1,
+                              nsamples, single_precision,
+                              data, weights, nobs, bin_stride, nbins, lower, upper,
+                              nsyst, syst, parameters, param_stride,
+                              private_bins, &thread_norm);
+
+            #pragma omp atomic
+            total_norm += thread_norm;
+
+            // Every private histogram must be complete before merging
+            #pragma omp barrier
+
+            simd::sum_histograms(&thread_bins[0], nworkers, total_nbins,
+                                 (long) total_nbins * ithread / nworkers,
+                                 (long) total_nbins * (ithread + 1) / nworkers,
+                                 bins);
+
+            // Every range of the merged histogram must be complete before reading
+            #pragma omp barrier
+            if (npoints > 0) {
+                const int first = (long) npoints * ithread / nworkers;
+                const int last = (long) npoints * (ithread + 1) / nworkers;
+                simd::eval_pdf(last - first, read_bins + first, bins, total_norm * bin_volume,
+                               output + (size_t) first * output_stride, output_stride);
+            }
+        }
+
+        *norm = total_norm;
+    }
+#endif
+
     HEMI_KERNEL(eval_pdf)(int npoints, const int *read_bins,
                           const unsigned int * __restrict__ bins,
                           const unsigned int * __restrict__ norm,
@@ -338,6 +1047,14 @@ namespace pdfz {
         int stride = hemiGetElementStride();
         const double bin_norm = *norm * bin_volume;
 
+        #ifndef __CUDACC__
+        // A host launch covers all points in one call; use the vectorized lookup
+        if (offset == 0 && stride == 1) {
+            simd::eval_pdf(npoints, read_bins, bins, bin_norm, output, output_stride);
+            return;
+        }
+        #endif
+
         for (int ipoint=offset; ipoint < npoints; ipoint += stride) {
             int bin_id = read_bins[ipoint];
 
@@ -350,6 +1067,78 @@ namespace pdfz {
             output[output_stride * ipoint] = pdf_value;
         }
     }
+
+    // Bin and evaluate in a single launch, for histograms small enough that
+    // each block can keep private copies in shared memory.  This replaces
+    // three launches and two passes over the global histogram, which
+    // dominate for small PDFs.  Each block bins its share of the samples as
+    // in bin_samples_private and adds its copies into accum, which holds
+    // the bins, the norm and a count of finished blocks, and is zero between
+    // launches.  The last block to finish copies the histogram out (for
+    // later inspection), evaluates the points and clears accum again.
+    HEMI_KERNEL(bin_eval_fused)(int nsamples, bool single_precision,
+                                const float *data, const int *weights, const int nobs,
+                                const int * __restrict__ bin_stride, const int * __restrict__ nbins,
+                                const double * __restrict__ lower, const double * __restrict__ upper,
+                                const int nsyst, const SystematicDescriptor * __restrict__ syst,
+                                const double * __restrict__ parameters, const int param_stride,
+                                int total_nbins, int ncopies, unsigned int *accum,
+                                unsigned int *bins, unsigned int *norm,
+                                int npoints, const int *read_bins, double bin_volume,
+                                float *output, int output_stride)
+    {
+        #ifdef HEMI_DEV_CODE
+        extern __shared__ unsigned int block_bins[]; // ncopies * total_nbins, then norm
+        __shared__ bool last_block;
+        unsigned int *block_norm = block_bins + ncopies * total_nbins;
+        unsigned int *accum_norm = accum + total_nbins;
+        unsigned int *accum_nblocks = accum + total_nbins + 1;
+        zero_private_hists(ncopies, total_nbins, block_bins);
+
+        unsigned int *copy_bins = block_bins + ((threadIdx.x / warpSize) % ncopies) * total_nbins;
+        bin_samples_range(hemiGetElementOffset(), nsamples, hemiGetElementStride(),
+                          nsamples, single_precision,
+                          data, weights, nobs, bin_stride, nbins, lower, upper,
+                          nsyst, syst, parameters, param_stride, copy_bins, block_norm);
+        __syncthreads();
+
+        for (int ibin=threadIdx.x; ibin < total_nbins; ibin += blockDim.x) {
+            const unsigned int sum = sum_private_hists(ncopies, total_nbins, block_bins, ibin);
+            if (sum > 0)
+                atomicAdd(accum + ibin, sum);
+        }
+        if (threadIdx.x == 0)
+            atomicAdd(accum_norm, *block_norm);
+
+        // Make this block's sums visible before counting it as finished
+        __threadfence();
+        __syncthreads();
+        if (threadIdx.x == 0)
+            last_block = (atomicAdd(accum_nblocks, 1) == gridDim.x - 1);
+        __syncthreads();
+        if (!last_block)
+            return;
+
+        // Read and clear each bin in one step, keeping it in shared memory
+        // for the readout
+        for (int ibin=threadIdx.x; ibin < total_nbins; ibin += blockDim.x) {
+            block_bins[ibin] = atomicExch(accum + ibin, 0);
+            bins[ibin] = block_bins[ibin];
+        }
+        if (threadIdx.x == 0) {
+            *block_norm = atomicExch(accum_norm, 0);
+            *norm = *block_norm;
+            *accum_nblocks = 0;
+        }
+        __syncthreads();
+
+        const double bin_norm = *block_norm * bin_volume;
+        for (int ipoint=threadIdx.x; ipoint < npoints; ipoint += blockDim.x) {
+            const int bin_id = read_bins[ipoint];
+            output[output_stride * ipoint] = (bin_id < 0) ? nanf("") : block_bins[bin_id] / bin_norm;
+        }
+        #endif
+    }
     ///// End EvalHist kernels
 
     void EvalHist::EvalAsync(bool do_eval_pdf)
@@ -365,26 +1154,134 @@ namespace pdfz {
             syst_ptr = this->syst->readOnlyPtr();
         }
 
+        const bool eval_points = (this->read_bins != 0 && do_eval_pdf);
+        const int npoints = eval_points ? this->read_bins->size() : 0;
+        const int nsamples = this->nsamples;
+
+        if (this->sorted_nsyst != nsyst)
+            this->SortSamples();
+
+        if (this->sorted_obs >= 0) {
+            #ifdef __CUDACC__
+            // zero_hist with no bins only clears the norm
+            HEMI_KERNEL_LAUNCH(zero_hist, 1, 1, 0, this->cuda_state->stream,
+                               0, this->bins->writeOnlyPtr(), this->norm_buffer->writeOnlyPtr() + this->norm_offset);
+            HEMI_KERNEL_LAUNCH(bin_sorted, this->eval_nblocks, this->eval_nthreads_per_block, 0, this->cuda_state->stream,
+                               this->total_nbins, this->SamplesPtr(), nsamples, this->sorted_obs,
+                               this->bin_stride.readOnlyPtr(), this->nbins.readOnlyPtr(),
+                               this->lower.readOnlyPtr(), this->upper.readOnlyPtr(),
+                               nsyst, syst_ptr,
+                               this->param_buffer->readOnlyPtr() + this->param_offset, this->param_stride,
+                               this->sorted_row_start.readOnlyPtr(), this->sorted_cum_weights.readOnlyPtr(),
+                               this->bins->writeOnlyPtr(), this->norm_buffer->ptr() + this->norm_offset);
+
+            if (eval_points)
+                HEMI_KERNEL_LAUNCH(eval_pdf, this->eval_nblocks, this->eval_nthreads_per_block, 0, this->cuda_state->stream,
+                                   npoints, this->read_bins->readOnlyPtr(),
+                                   this->bins->readOnlyPtr(), this->norm_buffer->readOnlyPtr() + this->norm_offset,
+                                   this->bin_volume,
+                                   this->pdf_buffer->writeOnlyPtr() + this->pdf_offset, this->pdf_stride);
+            #else
+            bin_sorted_eval_host(this->host_nthreads, this->total_nbins, this->SamplesPtr(),
+                                 nsamples, this->sorted_obs,
+                                 this->bin_stride.readOnlyPtr(), this->nbins.readOnlyPtr(),
+                                 this->lower.readOnlyPtr(), this->upper.readOnlyPtr(),
+                                 nsyst, syst_ptr,
+                                 this->param_buffer->readOnlyPtr() + this->param_offset, this->param_stride,
+                                 this->sorted_row_start.readOnlyPtr(), this->sorted_cum_weights.readOnlyPtr(),
+                                 this->bins->writeOnlyPtr(), this->norm_buffer->ptr() + this->norm_offset,
+                                 npoints, eval_points ? this->read_bins->readOnlyPtr() : 0, this->bin_volume,
+                                 eval_points ? this->pdf_buffer->writeOnlyPtr() + this->pdf_offset : 0,
+                                 this->pdf_stride);
+            #endif
+            return;
+        }
+
+        #ifdef __CUDACC__
+        // The fused kernel bins with the tuned binning configuration
+        const int fused_ncopies = private_hist_copies(this->total_nbins, this->bin_nthreads_per_block);
+        if (fused_ncopies > 0) {
+            HEMI_KERNEL_LAUNCH(bin_eval_fused, this->bin_nblocks, this->bin_nthreads_per_block,
+                               (fused_ncopies * this->total_nbins + 1) * sizeof(unsigned int),
+                               this->cuda_state->stream,
+                               nsamples, this->single_precision,
+                               this->SamplesPtr(), this->WeightsPtr(), this->nobservables,
+                               this->bin_stride.readOnlyPtr(), this->nbins.readOnlyPtr(),
+                               this->lower.readOnlyPtr(), this->upper.readOnlyPtr(),
+                               nsyst, syst_ptr,
+                               this->param_buffer->readOnlyPtr() + this->param_offset, this->param_stride,
+                               this->total_nbins, fused_ncopies, this->fused_accum->ptr(),
+                               this->bins->writeOnlyPtr(), this->norm_buffer->ptr() + this->norm_offset,
+                               npoints, eval_points ? this->read_bins->readOnlyPtr() : 0, this->bin_volume,
+                               eval_points ? this->pdf_buffer->writeOnlyPtr() + this->pdf_offset : 0,
+                               this->pdf_stride);
+            return;
+        }
+
         HEMI_KERNEL_LAUNCH(zero_hist, this->eval_nblocks, this->eval_nthreads_per_block, 0, this->cuda_state->stream,
                            this->total_nbins, this->bins->writeOnlyPtr(), this->norm_buffer->writeOnlyPtr() + this->norm_offset);
-        HEMI_KERNEL_LAUNCH(bin_samples, this->bin_nblocks, this->bin_nthreads_per_block, 0, this->cuda_state->stream,
-                           (int) this->samples.size(), this->samples.readOnlyPtr(), this->weights.readOnlyPtr(), 
-                           this->nobservables, this->nfields,
-                           this->bin_stride.readOnlyPtr(), this->nbins.readOnlyPtr(),
-                           this->lower.readOnlyPtr(), this->upper.readOnlyPtr(),
-                           nsyst, syst_ptr,
-                           this->param_buffer->readOnlyPtr() + this->param_offset, this->param_stride,
-                           this->bins->ptr(), this->norm_buffer->writeOnlyPtr() + this->norm_offset);
+        this->BinSamplesAsync(this->bin_nblocks, this->bin_nthreads_per_block);
 
-        if (this->read_bins == 0 || !do_eval_pdf)
+        if (!eval_points)
             return; // This can happen if someone wants to create a histogram with no eval points.
 
         HEMI_KERNEL_LAUNCH(eval_pdf, this->eval_nblocks, this->eval_nthreads_per_block, 0, this->cuda_state->stream,
-                           (int) this->read_bins->size(), this->read_bins->readOnlyPtr(),
+                           npoints, this->read_bins->readOnlyPtr(),
                            this->bins->readOnlyPtr(), this->norm_buffer->readOnlyPtr() + this->norm_offset,
                            this->bin_volume,
                            this->pdf_buffer->writeOnlyPtr() + this->pdf_offset, this->pdf_stride);
+        #else
+        bin_eval_host(this->host_nthreads, this->host_thread_bins,
+                      nsamples, this->single_precision,
+                      this->SamplesPtr(), this->WeightsPtr(), this->nobservables,
+                      this->bin_stride.readOnlyPtr(), this->nbins.readOnlyPtr(),
+                      this->lower.readOnlyPtr(), this->upper.readOnlyPtr(),
+                      nsyst, syst_ptr,
+                      this->param_buffer->readOnlyPtr() + this->param_offset, this->param_stride,
+                      this->total_nbins, this->bins->writeOnlyPtr(), this->norm_buffer->ptr() + this->norm_offset,
+                      npoints, eval_points ? this->read_bins->readOnlyPtr() : 0, this->bin_volume,
+                      eval_points ? this->pdf_buffer->writeOnlyPtr() + this->pdf_offset : 0,
+                      this->pdf_stride);
+        #endif
+    }
+
+    #ifdef __CUDACC__
+    void EvalHist::BinSamplesAsync(int nblocks, int nthreads_per_block)
+    {
+        int nsyst = 0;
+        const SystematicDescriptor *syst_ptr = 0;
+        if (this->syst) {
+            nsyst = this->syst->size();
+            syst_ptr = this->syst->readOnlyPtr();
+        }
+
+        const int nsamples = this->nsamples;
+        const int ncopies = private_hist_copies(this->total_nbins, nthreads_per_block);
+        if (ncopies > 0) {
+            HEMI_KERNEL_LAUNCH(bin_samples_private, nblocks, nthreads_per_block,
+                               (ncopies * this->total_nbins + 1) * sizeof(unsigned int),
+                               this->cuda_state->stream,
+                               nsamples, this->single_precision,
+                               this->SamplesPtr(), this->WeightsPtr(), this->nobservables,
+                               this->bin_stride.readOnlyPtr(), this->nbins.readOnlyPtr(),
+                               this->lower.readOnlyPtr(), this->upper.readOnlyPtr(),
+                               nsyst, syst_ptr,
+                               this->param_buffer->readOnlyPtr() + this->param_offset, this->param_stride,
+                               this->total_nbins, ncopies,
+                               this->bins->ptr(), this->norm_buffer->ptr() + this->norm_offset);
+            return;
+        }
+
+        HEMI_KERNEL_LAUNCH(bin_samples, nblocks, nthreads_per_block, 0, this->cuda_state->stream,
+                           nsamples, this->single_precision,
+                           this->SamplesPtr(), this->WeightsPtr(), this->nobservables,
+                           this->bin_stride.readOnlyPtr(), this->nbins.readOnlyPtr(),
+                           this->lower.readOnlyPtr(), this->upper.readOnlyPtr(),
+                           nsyst, syst_ptr,
+                           this->param_buffer->readOnlyPtr() + this->param_offset, this->param_stride,
+                           this->bins->ptr(), this->norm_buffer->writeOnlyPtr() + this->norm_offset);
     }
+    #endif
 
     void EvalHist::EvalFinished()
     {
@@ -483,8 +1380,66 @@ namespace pdfz {
     void EvalHist::Optimize()
     {
       if (this->read_bins){
+        #ifdef __CUDACC__
+        // Reuse configurations tuned by earlier runs for this shape, or
+        // predict one from similar shapes, since brute force tuning every
+        // PDF in every job dominates startup
+        int device;
+        cudaDeviceProp prop;
+        checkCuda( cudaGetDevice(&device) );
+        checkCuda( cudaGetDeviceProperties(&prop, device) );
+        std::ostringstream device_name;
+        device_name << prop.name << " sm_" << prop.major << prop.minor;
+
+        TuningKey key;
+        key.device = device_name.str();
+        key.nsamples = this->nsamples;
+        key.nbins = this->total_nbins;
+        key.nsyst = this->syst ? this->syst->size() : 0;
+        key.npoints = this->read_bins->size();
+
+        LaunchConfig config;
+        const char *source = "cached";
+
+        // Evaluators built on several threads share the cache, and tune one
+        // at a time so that their timings do not disturb each other
+        #ifdef _OPENMP
+        #pragma omp critical(tuning_cache)
+        #endif
+        {
+            TuningCache &cache = TuningCache::get_default();
+            if (!cache.find(key, config)) {
+                if (cache.predict(key, config)) {
+                    source = "predicted";
+                }
+                else {
+                    OptimizeBin();
+                    OptimizeEval();
+                    config.bin_nblocks = this->bin_nblocks;
+                    config.bin_nthreads_per_block = this->bin_nthreads_per_block;
+                    config.eval_nblocks = this->eval_nblocks;
+                    config.eval_nthreads_per_block = this->eval_nthreads_per_block;
+                    cache.insert(key, config);
+                    source = "tuned";
+                }
+            }
+        }
+
+        this->bin_nblocks = config.bin_nblocks;
+        this->bin_nthreads_per_block = config.bin_nthreads_per_block;
+        this->eval_nblocks = config.eval_nblocks;
+        this->eval_nthreads_per_block = config.eval_nthreads_per_block;
+
+        std::cerr << "pdfz::EvalHist::Optimize(): " << key.device
+                  << ", # of samples = " << key.nsamples << ", # of bins = " << key.nbins
+                  << ", # of systematics = " << key.nsyst << ", # of points = " << key.npoints
+                  << " Bin Grid/Block = " << this->bin_nblocks << "/" << this->bin_nthreads_per_block
+                  << " Eval Grid/Block = " << this->eval_nblocks << "/" << this->eval_nthreads_per_block
+                  << " (" << source << ")\n";
+        #else
         OptimizeBin();
         OptimizeEval();
+        #endif
         needs_optimization = false;
       }
     }
@@ -498,7 +1453,7 @@ namespace pdfz {
         const int grid_sizes[ngrid_sizes] = { 2, 4, 8, 16, 32, 64 };
         const int nblock_sizes = 5;
         const int block_sizes[nblock_sizes] = { 32, 64, 128, 256, 512};
-        const int nsamples = this->samples.size() / this->nfields;
+        const int nsamples = this->nsamples;
         int nreps = 1;
 
         // Do more repetitions on small kernels to avoid being fooled by timing fluctuations
@@ -516,14 +1471,6 @@ namespace pdfz {
         // for overlapping kernels.
         const double improvement_threshold = 0.9;
 
-        // Handle missing systematics case
-        int nsyst = 0;
-        const SystematicDescriptor *syst_ptr = 0;
-        if (this->syst) {
-            nsyst = this->syst->size();
-            syst_ptr = this->syst->readOnlyPtr();
-        }
-
         // Force allocation of these buffers (since we are not calling the zero bin kernel first)
         this->bins->writeOnlyPtr(); 
         this->norm_buffer->writeOnlyPtr();
@@ -543,16 +1490,8 @@ namespace pdfz {
                     continue;
 
                 timer.Start();
-                for (int irep=0; irep < nreps; irep++) {
-                    HEMI_KERNEL_LAUNCH(bin_samples, grid_size, block_size, 0, this->cuda_state->stream,
-                      (int) this->samples.size(), this->samples.readOnlyPtr(), this->weights.readOnlyPtr(), 
-                      this->nobservables, this->nfields,
-                      this->bin_stride.readOnlyPtr(), this->nbins.readOnlyPtr(),
-                      this->lower.readOnlyPtr(), this->upper.readOnlyPtr(),
-                      nsyst, syst_ptr,
-                      this->param_buffer->readOnlyPtr() + this->param_offset, this->param_stride,
-                      this->bins->ptr(), this->norm_buffer->writeOnlyPtr() + this->norm_offset);
-                }
+                for (int irep=0; irep < nreps; irep++)
+                    this->BinSamplesAsync(grid_size, block_size);
                 checkCuda( cudaStreamSynchronize(this->cuda_state->stream) );
                 timer.Stop();
                 float this_time = timer.RealTime();
@@ -651,161 +1590,317 @@ namespace pdfz {
         #endif
     }
     
-    int EvalHist::RandomSample(std::vector<float> &events, std::vector<int> &eventweights, double nexpected, std::vector<double> &syst_vals, std::vector<float> &uppers, std::vector<float> &lowers, bool poisson, long int maxsamples)
+    // Walker's alias method (in Vose's formulation) for drawing an index with
+    // probability proportional to the given weights in constant time
+    struct AliasTable
     {
-      hemi::Array<double> params_buffer(syst_vals.size(), true);
-      for (size_t i=0;i<syst_vals.size();i++){
-        params_buffer.writeOnlyHostPtr()[i] = syst_vals[i];
-      }
-      params_buffer.writeOnlyHostPtr();
-      hemi::Array<unsigned> norms_buffer(1, true);
-      norms_buffer.writeOnlyHostPtr();
-      this->SetNormalizationBuffer(&norms_buffer);
-      this->SetParameterBuffer(&params_buffer);
-      TH1* hist = this->CreateHistogram();
-      int totalbins = hist->GetNbinsX()*hist->GetNbinsY()*hist->GetNbinsZ();
-
-      std::vector<int> histweights(totalbins);
-
-      long int observed;
-      if (poisson)
-        observed = gRandom->Poisson(nexpected);
-      else
-        observed = nint(nexpected);
-
-      double histint = hist->Integral();
-      double maxperbin = maxsamples/(1.0*totalbins);
-      
-      bool weighted = false;
-      if (observed > maxsamples){
-        // we need to create weighted samples
-        weighted = true;
-        std::cout << "Creating weighted samples wherever bincount > " << maxsamples/totalbins << std::endl;
-        for (int i=0;i<hist->GetNbinsX();i++){
-          for (int j=0;j<hist->GetNbinsY();j++){
-            for (int k=0;k<hist->GetNbinsZ();k++){
-              double height = hist->GetBinContent(i+1,j+1,k+1);
-              if (observed*(height/histint) > maxperbin){
-                int weight = (int) ((observed*(height/histint))/maxperbin) + 1;
-                hist->SetBinContent(i+1,j+1,k+1,height/weight);
-                std::cout << "Weighting bin " << i << ", binheight: " << height << " (" << height/histint << "), Weight: " << weight << " " << std::endl;
-                histweights[k + j*hist->GetNbinsZ() + i*hist->GetNbinsY()*hist->GetNbinsZ()] = weight;
-              }else{
-                histweights[k + j*hist->GetNbinsZ() + i*hist->GetNbinsY()*hist->GetNbinsZ()] = 1.0;
-                //        std::cout << "Not weighting bin " << i << ", binheight: " << height << " (" << height*histint << ")" << std::endl;
-              }
+        AliasTable(const std::vector<double> &weights);
+
+        int Draw(RNGState *rng) const
+        {
+            const int n = this->prob.size();
+            double u = rng_uniform(rng) * n;
+            int i = std::min((int) u, n - 1);
+            return (u - i < this->prob[i]) ? i : this->alias[i];
+        }
+
+        std::vector<double> prob;
+        std::vector<int> alias;
+    };
+
+    AliasTable::AliasTable(const std::vector<double> &weights) :
+        prob(weights.size()), alias(weights.size())
+    {
+        const int n = weights.size();
+        double total = 0;
+        for (int i=0; i < n; i++)
+            total += weights[i];
+
+        std::vector<double> scaled(n);
+        std::vector<int> small, large;
+        for (int i=0; i < n; i++) {
+            scaled[i] = weights[i] * n / total;
+            if (scaled[i] < 1.0)
+                small.push_back(i);
+            else
+                large.push_back(i);
+        }
+
+        while (!small.empty() && !large.empty()) {
+            int s = small.back();
+            int l = large.back();
+            small.pop_back();
+            large.pop_back();
+
+            this->prob[s] = scaled[s];
+            this->alias[s] = l;
+
+            scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+            if (scaled[l] < 1.0)
+                small.push_back(l);
+            else
+                large.push_back(l);
+        }
+
+        // Whatever is left is full, up to rounding
+        for (size_t i=0; i < large.size(); i++) {
+            this->prob[large[i]] = 1.0;
+            this->alias[large[i]] = large[i];
+        }
+        for (size_t i=0; i < small.size(); i++) {
+            this->prob[small[i]] = 1.0;
+            this->alias[small[i]] = small[i];
+        }
+    }
+
+    double EvalHist::SamplingWeights(std::vector<double> &syst_vals, std::vector<float> &uppers, std::vector<float> &lowers,
+                                     std::vector<double> &bin_weight,
+                                     std::vector<std::vector<double> > &edge_lo,
+                                     std::vector<std::vector<double> > &edge_hi)
+    {
+        const int nobs = this->nobservables;
+        const bool bounded = !uppers.empty();
+
+        if (bounded && ((int) uppers.size() != nobs || (int) lowers.size() != nobs))
+            throw Error("Number of sampling bounds must be same as number of observables.");
+
+        // Fill the histogram with the systematics applied
+        hemi::Array<double> params_buffer(syst_vals.size(), true);
+        for (size_t i=0;i<syst_vals.size();i++){
+          params_buffer.writeOnlyHostPtr()[i] = syst_vals[i];
+        }
+        params_buffer.writeOnlyHostPtr();
+        hemi::Array<unsigned> norms_buffer(1, true);
+        norms_buffer.writeOnlyHostPtr();
+        this->SetNormalizationBuffer(&norms_buffer);
+        this->SetParameterBuffer(&params_buffer);
+
+        bool orig_optimization_flag = this->needs_optimization;
+        this->needs_optimization = false; // never optimize when sampling!
+        this->EvalAsync(false);
+        this->EvalFinished();
+        this->needs_optimization = orig_optimization_flag;
+
+        const double *lower = this->lower.readOnlyHostPtr();
+        const double *upper = this->upper.readOnlyHostPtr();
+        const int *nbins = this->nbins.readOnlyHostPtr();
+        const int *bin_stride = this->bin_stride.readOnlyHostPtr();
+        const unsigned int *bins = this->bins->readOnlyHostPtr();
+
+        // Bin edges along each dimension, clipped to the sampling bounds.  A
+        // bin cut by a bound keeps the part of its content inside it, which
+        // gives the same distribution as rejecting draws outside the bounds.
+        edge_lo.resize(nobs);
+        edge_hi.resize(nobs);
+        std::vector<std::vector<double> > inside(nobs);
+        for (int d=0; d < nobs; d++) {
+            const double width = (upper[d] - lower[d]) / nbins[d];
+            edge_lo[d].resize(nbins[d]);
+            edge_hi[d].resize(nbins[d]);
+            inside[d].resize(nbins[d]);
+            for (int i=0; i < nbins[d]; i++) {
+                double lo = lower[d] + i * width;
+                double hi = lo + width;
+                if (bounded) {
+                    lo = std::max(lo, (double) lowers[d]);
+                    hi = std::min(hi, (double) uppers[d]);
+                }
+                edge_lo[d][i] = lo;
+                edge_hi[d][i] = std::max(lo, hi);
+                inside[d][i] = (edge_hi[d][i] - lo) / width;
             }
-          }
         }
-      }
-  
-      int allocatesize = observed;
-      if (weighted)
-        allocatesize = (int) (observed*(1.5*hist->Integral()/histint));
-
-      // Generate event array by sampling ROOT histograms, including only events
-      // that pass cuts
-      events.reserve(events.size() + allocatesize * this->nobservables);
-      eventweights.reserve(eventweights.size() + allocatesize);
-      if (hist->IsA() == TH1D::Class()) {
-        TH1D* ht = dynamic_cast<TH1D*>(hist);
-
-        double obs;
-        unsigned j;
-        for (j=0; j<observed; j++) {
-          if (uppers.size() > 0){
-            do {
-              obs = ht->GetRandom();
-            } while(obs > uppers[0] || obs < lowers[0]);
-          }else{
-            obs = ht->GetRandom();
-          }
-
-          events.push_back(obs);
-
-          if (weighted){
-            int ibin = (hist->GetXaxis()->FindBin(obs)-1);
-            eventweights.push_back(histweights[ibin]);
-            j += histweights[ibin]-1;
-          }else{
-            eventweights.push_back(1);
-          }
-        }
-        if (j > observed)
-          eventweights.back() -= j-observed;
-      }
-      else if (hist->IsA() == TH2D::Class()) {
-        TH2D* ht = dynamic_cast<TH2D*>(hist);
-
-        double obs0;
-        double obs1;
-        unsigned j;
-        for (j=0; j<observed; j++) {
-          if (uppers.size() > 0){
-            do {
-              ht->GetRandom2(obs0, obs1);
-            } while(obs0 > uppers[0] || obs0 < lowers[0] ||
-                obs1 > uppers[1] || obs1 < lowers[1]);
-          }else{
-            ht->GetRandom2(obs0, obs1);
-          }
-
-          events.push_back(obs0);
-          events.push_back(obs1);
-
-          if (weighted){
-            int ibin = (hist->GetYaxis()->FindBin(obs1)-1) + (hist->GetXaxis()->FindBin(obs0)-1)*hist->GetNbinsY();
-            eventweights.push_back(histweights[ibin]);
-            j += histweights[ibin]-1;
-          }else{
-            eventweights.push_back(1);
-          }
-        }
-        if (j > observed)
-          eventweights.back() -= j-observed;
-      }
-      else if (hist->IsA() == TH3D::Class()) {
-        TH3D* ht = dynamic_cast<TH3D*>(hist);
-
-        double obs0;
-        double obs1;
-        double obs2;
-        unsigned j;
-        for (j=0; j<observed; j++) {
-          if (uppers.size() > 0){
-            do {
-              ht->GetRandom3(obs0, obs1, obs2);
-            } while(obs0 > uppers[0] || obs0 < lowers[0] ||
-                obs1 > uppers[1] || obs1 < lowers[1] ||
-                obs2 > uppers[2] || obs2 < lowers[2]);
-          }else{
-            ht->GetRandom3(obs0, obs1, obs2);
-          }
-
-          events.push_back(obs0);
-          events.push_back(obs1);
-          events.push_back(obs2);
-
-          if (weighted){
-            int ibin = (hist->GetZaxis()->FindBin(obs2)-1) + 
-              (hist->GetYaxis()->FindBin(obs1)-1)*hist->GetNbinsZ() +
-              (hist->GetXaxis()->FindBin(obs0)-1)*hist->GetNbinsZ()*hist->GetNbinsY();
-            eventweights.push_back(histweights[ibin]);
-            j += histweights[ibin]-1;
-          }else{
-            eventweights.push_back(1);
-          }
-        }
-        if (j > observed)
-          eventweights.back() -= j-observed;
-      }
-      else {
-        std::cerr << "sample_pdfz: Unknown histogram class: "
-          << hist->ClassName() << std::endl;
-        assert(false);
-      }
-      return observed;
 
+        bin_weight.resize(this->total_nbins);
+        double total_weight = 0;
+        for (int b=0; b < this->total_nbins; b++) {
+            double w = bins[b];
+            for (int d=0; d < nobs && w > 0; d++)
+                w *= inside[d][(b / bin_stride[d]) % nbins[d]];
+            bin_weight[b] = w;
+            total_weight += w;
+        }
+
+        return total_weight;
+    }
+
+    int EvalHist::RandomSample(std::vector<float> &events, std::vector<int> &eventweights, double nexpected, std::vector<double> &syst_vals, std::vector<float> &uppers, std::vector<float> &lowers, bool poisson, long int maxsamples, RNGState *rng)
+    {
+        const int nobs = this->nobservables;
+
+        RNGState default_rng;
+        if (!rng) {
+            rng_init(&default_rng, gRandom->Integer(2147483647) + 1, 0, RNG_FAKE_DATA_CHAIN, 0);
+            rng = &default_rng;
+        }
+
+        std::vector<double> bin_weight;
+        std::vector<std::vector<double> > edge_lo, edge_hi;
+        const double total_weight = SamplingWeights(syst_vals, uppers, lowers, bin_weight, edge_lo, edge_hi);
+        const int *nbins = this->nbins.readOnlyHostPtr();
+        const int *bin_stride = this->bin_stride.readOnlyHostPtr();
+
+        long long observed;
+        if (poisson)
+          observed = rng_poisson(rng, nexpected);
+        else
+          observed = nint(nexpected);
+
+        if (observed == 0)
+            return 0;
+
+        if (total_weight <= 0)
+            throw Error("Cannot sample a PDF with no entries inside the sampling bounds.");
+
+        // Above maxsamples, the most populated bins produce fewer events,
+        // each standing in for several
+        std::vector<int> bin_event_weight(this->total_nbins, 1);
+        std::vector<double> draw_weight(bin_weight);
+        double total_draw_weight = total_weight;
+        bool weighted = false;
+        if (observed > maxsamples) {
+            weighted = true;
+            const double maxperbin = maxsamples / (1.0 * this->total_nbins);
+            std::cout << "Creating weighted samples wherever bincount > " << maxperbin << std::endl;
+
+            total_draw_weight = 0;
+            for (int b=0; b < this->total_nbins; b++) {
+                double expected = observed * (bin_weight[b] / total_weight);
+                if (expected > maxperbin) {
+                    bin_event_weight[b] = (int) (expected / maxperbin) + 1;
+                    draw_weight[b] /= bin_event_weight[b];
+                }
+                total_draw_weight += draw_weight[b];
+            }
+        }
+
+        AliasTable table(draw_weight);
+
+        // Event i takes its random numbers (one uniform to pick the bin, one
+        // per observable for its position in the bin) from a fixed range of
+        // the stream, so events can be generated in parallel, and come out
+        // the same for any number of threads
+        const unsigned blocks_per_event = (2 * (1 + nobs) + 3) / 4;
+        RNGState start = *rng;
+        rng_skip(&start, 0);
+
+        // Pick bins until the event weights add up to the observed count
+        std::vector<int> event_bins;
+        event_bins.reserve(weighted ? (size_t) (observed * total_draw_weight / total_weight) : observed);
+        long long total = 0;
+        long long ndrawn = 0;
+        while (total < observed) {
+            long long n = observed - total;
+            if (weighted)
+                n = std::min(n, (long long) (n * 1.01 * total_draw_weight / total_weight) + 100);
+
+            std::vector<int> batch(n);
+            #ifdef _OPENMP
+            #pragma omp parallel for schedule(static)
+            #endif
+            for (long long i=0; i < n; i++) {
+                RNGState state = start;
+                rng_skip(&state, (ndrawn + i) * blocks_per_event);
+                batch[i] = table.Draw(&state);
+            }
+            ndrawn += n;
+
+            for (long long i=0; i < n && total < observed; i++) {
+                event_bins.push_back(batch[i]);
+                total += bin_event_weight[batch[i]];
+            }
+        }
+
+        // Place each event uniformly within its (clipped) bin
+        const long long nevents = event_bins.size();
+        const size_t events_offset = events.size();
+        const size_t weights_offset = eventweights.size();
+        events.resize(events_offset + nevents * nobs);
+        eventweights.resize(weights_offset + nevents);
+        float *event_obs = &events[events_offset];
+        int *event_weight = &eventweights[weights_offset];
+
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(static)
+        #endif
+        for (long long i=0; i < nevents; i++) {
+            RNGState state = start;
+            rng_skip(&state, i * blocks_per_event);
+            rng_uniform(&state); // the bin choice, made above
+
+            const int b = event_bins[i];
+            for (int d=0; d < nobs; d++) {
+                const int ibin = (b / bin_stride[d]) % nbins[d];
+                const double lo = edge_lo[d][ibin];
+                const double hi = edge_hi[d][ibin];
+                event_obs[i * nobs + d] = lo + (hi - lo) * (1.0 - rng_uniform(&state));
+            }
+            event_weight[i] = bin_event_weight[b];
+        }
+
+        // The last event makes up the remainder
+        if (total > observed)
+            eventweights.back() -= total - observed;
+
+        *rng = start;
+        rng_skip(rng, ndrawn * blocks_per_event);
+
+        return observed;
+    }
+
+    int EvalHist::BinnedSample(std::vector<float> &events, std::vector<int> &eventweights, double nexpected, std::vector<double> &syst_vals, std::vector<float> &uppers, std::vector<float> &lowers, long int maxsamples, RNGState *rng)
+    {
+        const int nobs = this->nobservables;
+
+        RNGState default_rng;
+        if (!rng) {
+            rng_init(&default_rng, gRandom->Integer(2147483647) + 1, 0, RNG_FAKE_DATA_CHAIN, 0);
+            rng = &default_rng;
+        }
+
+        std::vector<double> bin_weight;
+        std::vector<std::vector<double> > edge_lo, edge_hi;
+        const double total_weight = SamplingWeights(syst_vals, uppers, lowers, bin_weight, edge_lo, edge_hi);
+        const int *nbins = this->nbins.readOnlyHostPtr();
+        const int *bin_stride = this->bin_stride.readOnlyHostPtr();
+
+        if (nexpected <= 0)
+            return 0;
+
+        if (total_weight <= 0)
+            throw Error("Cannot sample a PDF with no entries inside the sampling bounds.");
+
+        const long long maxperbin = std::max(1L, maxsamples / this->total_nbins);
+
+        // A sum of independent Poisson counts per bin is itself Poisson with
+        // mean nexpected, so this fluctuates the total as RandomSample does
+        long long observed = 0;
+        for (int b=0; b < this->total_nbins; b++) {
+            if (bin_weight[b] <= 0)
+                continue;
+
+            const long long count = rng_poisson(rng, nexpected * (bin_weight[b] / total_weight));
+            if (count == 0)
+                continue;
+            observed += count;
+
+            // Split the count as evenly as possible among the pseudo-events
+            const long long nevents = std::min(count, maxperbin);
+            const int weight = count / nevents;
+            const long long remainder = count % nevents;
+
+            for (long long i=0; i < nevents; i++) {
+                for (int d=0; d < nobs; d++) {
+                    const int ibin = (b / bin_stride[d]) % nbins[d];
+                    const double lo = edge_lo[d][ibin];
+                    const double hi = edge_hi[d][ibin];
+                    events.push_back(lo + (hi - lo) * (1.0 - rng_uniform(rng)));
+                }
+                eventweights.push_back(weight + (i < remainder ? 1 : 0));
+            }
+        }
+
+        return observed;
     }
 
     TH1* EvalHist::DefaultHistogram()
@@ -831,4 +1926,420 @@ namespace pdfz {
 
     ///////////////////// EvalKernel ///////////////////////
 
+    // Ratio of the Epanechnikov kernel half-width to the Gaussian kernel
+    // sigma giving the same smoothing
+    const double EPANECHNIKOV_SCALE = 2.214;
+
+    EvalKernel::EvalKernel(const std::vector<float> &_samples, int nfields, int nobservables,
+                           const std::vector<double> &lower, const std::vector<double> &upper,
+                           const std::vector<double> &_bandwidth_scale) :
+        Eval(_samples, nfields, nobservables, lower, upper),
+        samples(_samples.size(), false), bandwidth_scale(_bandwidth_scale),
+        bandwidth(nobservables, true), ncells(nobservables, true), cell_stride(nobservables, true),
+        positions(_samples.size() / nfields * nobservables, false),
+        kernel_norms(_samples.size() / nfields, false),
+        sample_cells(_samples.size() / nfields, false), cell_start(1, false),
+        sorted_positions(_samples.size() / nfields * nobservables, false),
+        sorted_norms(_samples.size() / nfields, false),
+        eval_points(0), eval_cells(0)
+    {
+        if ( (int) _bandwidth_scale.size() != nobservables)
+            throw Error("Size of bandwidth_scale array must be same as number of observables.");
+
+        if (nobservables > MAX_NOBS)
+            throw Error("Exceeded maximum number of observables.  Edit MAX_NOBS in pdfz.cpp to fix this!");
+
+        this->samples.copyFromHost(&_samples.front(), _samples.size());
+
+        // Default bandwidth from the spread of the samples in the domain
+        const int nsamples = _samples.size() / nfields;
+        std::vector<double> sum(nobservables, 0), sum2(nobservables, 0);
+        int ninside = 0;
+        for (int isample=0; isample < nsamples; isample++) {
+            const float *sample = &_samples[isample * nfields];
+            bool in_pdf_domain = true;
+            for (int iobs=0; iobs < nobservables; iobs++) {
+                if (sample[iobs] < lower[iobs] || sample[iobs] >= upper[iobs]) {
+                    in_pdf_domain = false;
+                    break;
+                }
+            }
+            if (!in_pdf_domain)
+                continue;
+
+            ninside++;
+            for (int iobs=0; iobs < nobservables; iobs++) {
+                sum[iobs] += sample[iobs];
+                sum2[iobs] += sample[iobs] * sample[iobs];
+            }
+        }
+
+        const double scott = EPANECHNIKOV_SCALE * pow(std::max(ninside, 1), -1.0 / (nobservables + 4));
+        double *bandwidth = this->bandwidth.writeOnlyHostPtr();
+        for (int iobs=0; iobs < nobservables; iobs++) {
+            const double span = upper[iobs] - lower[iobs];
+            double sigma = 0;
+            if (ninside > 1) {
+                const double mean = sum[iobs] / ninside;
+                sigma = sqrt(std::max(sum2[iobs] / ninside - mean * mean, 0.0));
+            }
+            if (!(sigma > 0))
+                sigma = span / sqrt(12.0); // flat
+            bandwidth[iobs] = scott * sigma * _bandwidth_scale[iobs];
+
+            if (!(bandwidth[iobs] > 0))
+                throw Error("Kernel bandwidth must be positive.");
+        }
+
+        // Grid cells at least one bandwidth wide, so the support of a kernel
+        // only reaches the neighboring cells, with about one sample per cell
+        // at most
+        const int max_ncells = std::max(1, (int) pow(nsamples, 1.0 / nobservables));
+        int *ncells = this->ncells.writeOnlyHostPtr();
+        for (int iobs=0; iobs < nobservables; iobs++) {
+            const double span = upper[iobs] - lower[iobs];
+            ncells[iobs] = std::max(1, std::min(max_ncells, (int) (span / bandwidth[iobs])));
+        }
+
+        int *cell_stride = this->cell_stride.writeOnlyHostPtr();
+        cell_stride[nobservables - 1] = 1;
+        for (int i=nobservables-2; i >= 0; i--)
+            cell_stride[i] = ncells[i+1] * cell_stride[i+1];
+        this->total_ncells = cell_stride[0] * ncells[0];
+
+        this->cell_start.copyFromHost(&std::vector<int>(this->total_ncells + 1, 0).front(),
+                                      this->total_ncells + 1);
+
+        this->nthreads_per_block = 256;
+        this->nblocks = 64;
+    }
+
+    EvalKernel::~EvalKernel()
+    {
+        delete this->eval_points;
+        delete this->eval_cells;
+    }
+
+    Eval *EvalKernel::Clone() const
+    {
+        const float *samples = this->samples.readOnlyHostPtr();
+        const double *lower = this->lower.readOnlyHostPtr();
+        const double *upper = this->upper.readOnlyHostPtr();
+
+        EvalKernel *clone = new EvalKernel(std::vector<float>(samples, samples + this->samples.size()),
+                                           this->nfields, this->nobservables,
+                                           std::vector<double>(lower, lower + this->nobservables),
+                                           std::vector<double>(upper, upper + this->nobservables),
+                                           this->bandwidth_scale);
+
+        if (this->syst) {
+            clone->syst = new hemi::Array<SystematicDescriptor>(this->syst->size(), true);
+            clone->syst->copyFromHost(this->syst->readOnlyHostPtr(), this->syst->size());
+        }
+
+        return clone;
+    }
+
+    std::vector<double> EvalKernel::GetBandwidth() const
+    {
+        const double *bandwidth = this->bandwidth.readOnlyHostPtr();
+        return std::vector<double>(bandwidth, bandwidth + this->nobservables);
+    }
+
+    void EvalKernel::SetEvalPoints(const std::vector<float> &points)
+    {
+        if (points.size() % this->nobservables != 0)
+            throw Error("Number of entries in evaluation points array not divisible by number of observables.");
+
+        const int npoints = points.size() / this->nobservables;
+
+        delete this->eval_points;
+        this->eval_points = new hemi::Array<float>(points.size(), false);
+        if (npoints > 0)
+            this->eval_points->copyFromHost(&points.front(), points.size());
+
+        delete this->eval_cells;
+        this->eval_cells = new hemi::Array<int>(npoints, false);
+        int *eval_cells = this->eval_cells->writeOnlyHostPtr();
+
+        // The grid is fixed, so the cell of each point never changes
+        const double *lower = this->lower.readOnlyHostPtr();
+        const double *upper = this->upper.readOnlyHostPtr();
+        const int *ncells = this->ncells.readOnlyHostPtr();
+        const int *cell_stride = this->cell_stride.readOnlyHostPtr();
+
+        for (int ipoint=0; ipoint < npoints; ipoint++) {
+            int cell_id = 0;
+            for (int iobs=0; iobs < this->nobservables; iobs++) {
+                double element = points[ipoint * this->nobservables + iobs];
+
+                // Filled in with NaN during evaluation
+                if (element < lower[iobs] || element >= upper[iobs]) {
+                    cell_id = -1;
+                    break;
+                }
+
+                int cell = (int) ((element - lower[iobs]) * ncells[iobs] / (upper[iobs] - lower[iobs]));
+                cell_id += std::min(cell, ncells[iobs] - 1) * cell_stride[iobs];
+            }
+            eval_cells[ipoint] = cell_id;
+        }
+    }
+
+    ///// EvalKernel kernels
+
+    // Integral of the Epanechnikov kernel from -1 to u, for |u| <= 1
+    HEMI_DEV_CALLABLE_INLINE
+    double epanechnikov_cdf(double u)
+    {
+        return 0.25 * (2 + 3 * u - u * u * u);
+    }
+
+    // Apply the systematics to one sample and find its cell, and the factor
+    // that normalizes its kernel to the part inside the domain.  Samples
+    // outside the domain get cell -1.
+    HEMI_DEV_CALLABLE_INLINE
+    void kde_place_sample(int isample, const float *samples,
+                          const int nobs, const int nfields,
+                          const double * __restrict__ lower, const double * __restrict__ upper,
+                          const double * __restrict__ bandwidth,
+                          const int * __restrict__ ncells, const int * __restrict__ cell_stride,
+                          const int nsyst, const SystematicDescriptor * __restrict__ syst,
+                          const double * __restrict__ parameters, const int param_stride,
+                          float *positions, float *kernel_norms, int *sample_cells)
+    {
+        int cell_id = 0;
+        double inside = 1.0;
+        for (int iobs=0; iobs < nobs; iobs++) {
+            const double element = observable_value<double>(samples + isample * nfields, 1, iobs,
+                                                            nsyst, syst, parameters, param_stride);
+            if (element < lower[iobs] || element >= upper[iobs]) {
+                sample_cells[isample] = -1;
+                return;
+            }
+
+            int cell = (int) ((element - lower[iobs]) * ncells[iobs] / (upper[iobs] - lower[iobs]));
+            cell_id += min(cell, ncells[iobs] - 1) * cell_stride[iobs];
+
+            const double h = bandwidth[iobs];
+            const double lo = max(-1.0, (lower[iobs] - element) / h);
+            const double hi = min(1.0, (upper[iobs] - element) / h);
+            inside *= epanechnikov_cdf(hi) - epanechnikov_cdf(lo);
+
+            positions[isample * nobs + iobs] = element;
+        }
+
+        kernel_norms[isample] = 1.0 / inside;
+        sample_cells[isample] = cell_id;
+    }
+
+    // Sum the kernels of the samples in the cells around a point
+    HEMI_DEV_CALLABLE_INLINE
+    float kde_eval_point(const float *point, int cell_id, const int nobs,
+                         const double * __restrict__ bandwidth,
+                         const int * __restrict__ ncells, const int * __restrict__ cell_stride,
+                         const int * __restrict__ cell_start,
+                         const float * __restrict__ sorted_positions,
+                         const float * __restrict__ sorted_norms,
+                         unsigned int norm)
+    {
+        if (cell_id < 0)
+            return nanf("");
+
+        int cell[MAX_NOBS];
+        double inv_h[MAX_NOBS];
+        double volume = 1.0;
+        int nneighbors = 1;
+        for (int iobs=0; iobs < nobs; iobs++) {
+            cell[iobs] = (cell_id / cell_stride[iobs]) % ncells[iobs];
+            inv_h[iobs] = 1.0 / bandwidth[iobs];
+            volume *= bandwidth[iobs];
+            nneighbors *= 3;
+        }
+
+        double sum = 0;
+        for (int ineighbor=0; ineighbor < nneighbors; ineighbor++) {
+            int neighbor_id = 0;
+            bool in_grid = true;
+            for (int iobs=0, k=ineighbor; iobs < nobs; iobs++, k /= 3) {
+                const int c = cell[iobs] + k % 3 - 1;
+                if (c < 0 || c >= ncells[iobs]) {
+                    in_grid = false;
+                    break;
+                }
+                neighbor_id += c * cell_stride[iobs];
+            }
+            if (!in_grid)
+                continue;
+
+            for (int j=cell_start[neighbor_id]; j < cell_start[neighbor_id + 1]; j++) {
+                double kernel = sorted_norms[j];
+                for (int iobs=0; iobs < nobs; iobs++) {
+                    const double u = (point[iobs] - sorted_positions[j * nobs + iobs]) * inv_h[iobs];
+                    kernel *= max(0.0, 0.75 * (1 - u * u));
+                }
+                sum += kernel;
+            }
+        }
+
+        return sum / (volume * norm);
+    }
+
+    HEMI_KERNEL(kde_place_samples)(int nsamples, const float *samples,
+                                   const int nobs, const int nfields,
+                                   const double * __restrict__ lower, const double * __restrict__ upper,
+                                   const double * __restrict__ bandwidth,
+                                   const int * __restrict__ ncells, const int * __restrict__ cell_stride,
+                                   const int nsyst, const SystematicDescriptor * __restrict__ syst,
+                                   const double * __restrict__ parameters, const int param_stride,
+                                   float *positions, float *kernel_norms, int *sample_cells)
+    {
+        int offset = hemiGetElementOffset();
+        int stride = hemiGetElementStride();
+
+        for (int isample=offset; isample < nsamples; isample += stride)
+            kde_place_sample(isample, samples, nobs, nfields, lower, upper, bandwidth,
+                             ncells, cell_stride, nsyst, syst, parameters, param_stride,
+                             positions, kernel_norms, sample_cells);
+    }
+
+    HEMI_KERNEL(kde_set_norm)(unsigned int *norm, unsigned int value)
+    {
+        *norm = value;
+    }
+
+    HEMI_KERNEL(kde_eval)(int npoints, const float *points, const int *eval_cells,
+                          const int nobs, const double * __restrict__ bandwidth,
+                          const int * __restrict__ ncells, const int * __restrict__ cell_stride,
+                          const int * __restrict__ cell_start,
+                          const float * __restrict__ sorted_positions,
+                          const float * __restrict__ sorted_norms,
+                          const unsigned int * __restrict__ norm,
+                          float *output, int output_stride)
+    {
+        int offset = hemiGetElementOffset();
+        int stride = hemiGetElementStride();
+
+        for (int ipoint=offset; ipoint < npoints; ipoint += stride)
+            output[output_stride * ipoint] = \
+                kde_eval_point(points + ipoint * nobs, eval_cells[ipoint], nobs, bandwidth,
+                               ncells, cell_stride, cell_start, sorted_positions, sorted_norms, *norm);
+    }
+    ///// End EvalKernel kernels
+
+    void EvalKernel::EvalAsync(bool do_eval_pdf)
+    {
+        const int nsamples = this->samples.size() / this->nfields;
+        const int nobs = this->nobservables;
+
+        // Handle no systematics case
+        int nsyst = 0;
+        const SystematicDescriptor *syst_ptr = 0;
+        if (this->syst) {
+            nsyst = this->syst->size();
+            syst_ptr = this->syst->readOnlyPtr();
+        }
+
+        // Transform the samples and find their cells
+        #ifdef __CUDACC__
+        HEMI_KERNEL_LAUNCH(kde_place_samples, this->nblocks, this->nthreads_per_block, 0, this->cuda_state->stream,
+                           nsamples, this->samples.readOnlyPtr(), nobs, this->nfields,
+                           this->lower.readOnlyPtr(), this->upper.readOnlyPtr(), this->bandwidth.readOnlyPtr(),
+                           this->ncells.readOnlyPtr(), this->cell_stride.readOnlyPtr(),
+                           nsyst, syst_ptr,
+                           this->param_buffer->readOnlyPtr() + this->param_offset, this->param_stride,
+                           this->positions.writeOnlyPtr(), this->kernel_norms.writeOnlyPtr(),
+                           this->sample_cells.writeOnlyPtr());
+        #else
+        {
+            const float *samples = this->samples.readOnlyPtr();
+            const double *lower = this->lower.readOnlyPtr();
+            const double *upper = this->upper.readOnlyPtr();
+            const double *bandwidth = this->bandwidth.readOnlyPtr();
+            const int *ncells = this->ncells.readOnlyPtr();
+            const int *cell_stride = this->cell_stride.readOnlyPtr();
+            const double *parameters = this->param_buffer->readOnlyPtr() + this->param_offset;
+            float *positions = this->positions.writeOnlyPtr();
+            float *kernel_norms = this->kernel_norms.writeOnlyPtr();
+            int *sample_cells = this->sample_cells.writeOnlyPtr();
+
+            #pragma omp parallel for schedule(static)
+            for (int isample=0; isample < nsamples; isample++)
+                kde_place_sample(isample, samples, nobs, this->nfields, lower, upper, bandwidth,
+                                 ncells, cell_stride, nsyst, syst_ptr, parameters, this->param_stride,
+                                 positions, kernel_norms, sample_cells);
+        }
+        #endif
+
+        // Counting sort of the samples by cell, so the samples of each cell
+        // are contiguous.  Samples are independent of the evaluation points,
+        // so this is cheap next to the evaluation.
+        const int *sample_cells = this->sample_cells.readOnlyHostPtr();
+        const float *positions = this->positions.readOnlyHostPtr();
+        const float *kernel_norms = this->kernel_norms.readOnlyHostPtr();
+        int *cell_start = this->cell_start.writeOnlyHostPtr();
+        float *sorted_positions = this->sorted_positions.writeOnlyHostPtr();
+        float *sorted_norms = this->sorted_norms.writeOnlyHostPtr();
+
+        std::fill(cell_start, cell_start + this->total_ncells + 1, 0);
+        for (int isample=0; isample < nsamples; isample++)
+            if (sample_cells[isample] >= 0)
+                cell_start[sample_cells[isample] + 1]++;
+        for (int icell=0; icell < this->total_ncells; icell++)
+            cell_start[icell + 1] += cell_start[icell];
+        const unsigned int norm = cell_start[this->total_ncells];
+
+        std::vector<int> fill(cell_start, cell_start + this->total_ncells);
+        for (int isample=0; isample < nsamples; isample++) {
+            if (sample_cells[isample] < 0)
+                continue;
+            const int j = fill[sample_cells[isample]]++;
+            for (int iobs=0; iobs < nobs; iobs++)
+                sorted_positions[j * nobs + iobs] = positions[isample * nobs + iobs];
+            sorted_norms[j] = kernel_norms[isample];
+        }
+
+        HEMI_KERNEL_LAUNCH(kde_set_norm, 1, 1, 0, this->cuda_state->stream,
+                           this->norm_buffer->ptr() + this->norm_offset, norm);
+
+        if (this->eval_points == 0 || !do_eval_pdf)
+            return;
+
+        const int npoints = this->eval_cells->size();
+
+        #ifdef __CUDACC__
+        HEMI_KERNEL_LAUNCH(kde_eval, this->nblocks, this->nthreads_per_block, 0, this->cuda_state->stream,
+                           npoints, this->eval_points->readOnlyPtr(), this->eval_cells->readOnlyPtr(),
+                           nobs, this->bandwidth.readOnlyPtr(),
+                           this->ncells.readOnlyPtr(), this->cell_stride.readOnlyPtr(),
+                           this->cell_start.readOnlyPtr(),
+                           this->sorted_positions.readOnlyPtr(), this->sorted_norms.readOnlyPtr(),
+                           this->norm_buffer->readOnlyPtr() + this->norm_offset,
+                           this->pdf_buffer->writeOnlyPtr() + this->pdf_offset, this->pdf_stride);
+        #else
+        {
+            const float *points = this->eval_points->readOnlyPtr();
+            const int *eval_cells = this->eval_cells->readOnlyPtr();
+            const double *bandwidth = this->bandwidth.readOnlyPtr();
+            const int *ncells = this->ncells.readOnlyPtr();
+            const int *cell_stride = this->cell_stride.readOnlyPtr();
+            float *output = this->pdf_buffer->writeOnlyPtr() + this->pdf_offset;
+
+            // Points in dense regions cost more, so hand them out in chunks
+            #pragma omp parallel for schedule(dynamic, 256)
+            for (int ipoint=0; ipoint < npoints; ipoint++)
+                output[this->pdf_stride * ipoint] = \
+                    kde_eval_point(points + ipoint * nobs, eval_cells[ipoint], nobs, bandwidth,
+                                   ncells, cell_stride, cell_start, sorted_positions, sorted_norms, norm);
+        }
+        #endif
+    }
+
+    void EvalKernel::EvalFinished()
+    {
+        #ifdef __CUDACC__
+        checkCuda( cudaStreamSynchronize(this->cuda_state->stream) );
+        #endif
+    }
+
 } // namespace pdfz
@@ -85,6 +85,8 @@
 #include <hemi/array.h>                                                         
 #endif
 
+struct RNGState;
+
 namespace pdfz {
 
     /**
@@ -239,10 +241,36 @@ namespace pdfz {
         virtual void SetParameterBuffer(hemi::Array<double> *params, int offset=0, int stride=1);
 
 
-        /** Add a systematic transformation to this PDF */
+        /** Add a systematic transformation to this PDF
+
+            Systematics are applied in the order they are added.  Raises
+            pdfz::Error if the true field of a resolution systematic would
+            itself be transformed by a systematic.
+        */
         virtual void AddSystematic(const Systematic &syst);
 
 
+        /** Get the parameters the systematics of this PDF depend on.
+
+            Returns the index j of each systematic parameter, as read from
+            params[offset + j * stride] in the buffer given to
+            SetParameterBuffer().  The PDF need not be re-evaluated unless
+            one of these parameters changes.
+        */
+        virtual std::vector<int> GetSystematicParameters();
+
+
+        /** Create an independent copy of this evaluator.
+
+            The copy has the same samples, bounds and systematics, but its own
+            histogram storage, evaluation points and CUDA stream, so the two
+            can be used concurrently from different threads.  The buffers
+            given to Set*Buffer() are not shared and must be set again on the
+            copy.  The caller owns the returned object.
+        */
+        virtual Eval *Clone() const=0;
+
+
         /** Launch evaluation of the PDF at all the points given in the last call to
             SetEvalPoints() using the systematic parameters read from the
             parameter buffer specified in SetParameterBuffer().
@@ -287,7 +315,16 @@ namespace pdfz {
     };
 
 
-    /** Evaluate a PDF using an N-dimensional histogram */
+    /** Evaluate a PDF using an N-dimensional histogram
+
+        If all systematics are shifts or scales of the same observable, the
+        transform preserves the order of the samples along it.  When the
+        samples outnumber the bins enough, they are then reordered once,
+        grouped by their bin in the other observables and sorted along the
+        shifted one, and each evaluation finds the bin edges by binary
+        search instead of rebinning every sample.  The result is the same
+        histogram, at a cost of O(nbins log(nsamples)).
+    */
     class EvalHist : public Eval
     {
     public:
@@ -306,9 +343,45 @@ namespace pdfz {
                  const std::vector<double> &lower, const std::vector<double> &upper,
                  const std::vector<int> &nbins, bool optimize=true);
 
+        /** Create a PDF evaluator that reads samples it does not own, such
+            as a read-only mapping of a file shared by several processes.
+            ``samples`` is column-major (field i of sample j at
+            i * nsamples + j), as returned by GetSamples().  The samples and
+            weights must outlive the evaluator and its clones, which share
+            them.  CUDA builds still copy them to the device.
+
+            If the systematics call for the sorted layout (see the class
+            description), the samples are only used that way if they are
+            already in sorted order, as GetSamples() returns them after an
+            evaluation.
+        */
+        EvalHist(const float *samples, const int *weights, int nsamples, int nfields, int nobservables,
+                 const std::vector<double> &lower, const std::vector<double> &upper,
+                 const std::vector<int> &nbins, bool optimize=true);
+
         virtual ~EvalHist();
+        virtual Eval *Clone() const;
         virtual void SetEvalPoints(const std::vector<float> &points);
 
+        /** Apply the systematics and compute the bins in single rather than
+            double precision.  This is faster, especially on GPUs, but
+            samples within rounding of a bin edge may move to the next bin.
+            The sorted layout used for shifts and scales always uses double
+            precision.  Off by default.
+        */
+        void SetSinglePrecision(bool single) { this->single_precision = single; }
+        bool GetSinglePrecision() const { return this->single_precision; }
+
+        /** True if the last evaluation used the sorted sample layout (see
+            the class description) rather than binning every sample.
+        */
+        bool GetSortedLayout() const { return this->sorted_obs >= 0; }
+
+        /** Copy out the samples, column-major, and their weights, in the
+            order they are currently stored.
+        */
+        void GetSamples(std::vector<float> &samples, std::vector<int> &weights) const;
+
         /** Dump the current PDF contents (as of the last EvalAsync/Finished call)
          *  into a new TH1 object and return it.  Obviously only works for 
          *  1, 2 or 3 histograms.
@@ -320,7 +393,11 @@ namespace pdfz {
          */
         TH1* DefaultHistogram();
 
-        /** Brute force tests a bunch of CUDA configurations to find the best one */
+        /** Chooses CUDA launch configurations for this PDF: from the tuning
+         *  cache (see TuningCache) if this shape was tuned before, predicted
+         *  from a similar shape in the cache, or else by brute force testing
+         *  a bunch of configurations and storing the best in the cache.
+         */
         virtual void Optimize();
         virtual void OptimizeBin();
         virtual void OptimizeEval();
@@ -329,22 +406,93 @@ namespace pdfz {
         virtual void EvalFinished();
 
 
-        int RandomSample(std::vector<float> &events, std::vector<int> &eventweights, double nexpected, std::vector<double> &syst_vals, std::vector<float> &uppers, std::vector<float> &lowers, bool poisson=false, long int maxsamples=1e7);
+        /** Draw a fake data set from the PDF, with the systematic parameters
+            given in syst_vals.
 
-        int RandomSample(std::vector<float> &events, std::vector<int> &eventweights, double nexpected, bool poisson=false, long int maxsamples=1e7){
-          std::vector<double> syst_vals(syst->size(),0);
+            Events are appended to ``events`` (row-major, one value per
+            observable) and their weights to ``eventweights``.  The number of
+            events is nexpected, or Poisson-distributed around it if poisson
+            is set.  Only the parts of the PDF inside the optional
+            ``lowers``/``uppers`` bounds are sampled.  If there are more than
+            maxsamples events, the most populated bins produce fewer events
+            with weights above 1.
+
+            Bins are drawn from an alias table and positions are uniform
+            within each bin, in parallel.  Random numbers come from ``rng``
+            (seeded from gRandom if NULL), which is advanced past the values
+            used, and do not depend on the number of threads.
+
+            Returns the number of events (the sum of the weights).
+        */
+        int RandomSample(std::vector<float> &events, std::vector<int> &eventweights, double nexpected, std::vector<double> &syst_vals, std::vector<float> &uppers, std::vector<float> &lowers, bool poisson=false, long int maxsamples=1e7, RNGState *rng=0);
+
+        int RandomSample(std::vector<float> &events, std::vector<int> &eventweights, double nexpected, bool poisson=false, long int maxsamples=1e7, RNGState *rng=0){
+          std::vector<double> syst_vals(syst ? syst->size() : 0,0);
           std::vector<float> _upper;
           std::vector<float> _lower;
-          return RandomSample(events, eventweights, nexpected,syst_vals,_upper,_lower, poisson, maxsamples);
+          return RandomSample(events, eventweights, nexpected,syst_vals,_upper,_lower, poisson, maxsamples, rng);
         };
 
+
+        /** Draw a Poisson-fluctuated fake data set bin by bin.
+
+            Each bin gets an independent Poisson count with mean nexpected
+            times its share of the PDF inside the bounds, and contributes at
+            most max(1, maxsamples / number of bins) weighted pseudo-events
+            placed uniformly within it.  The work is proportional to the
+            number of bins rather than the number of events, which makes this
+            the method of choice for very large nexpected.  Arguments are as
+            for RandomSample().
+
+            Returns the number of events (the sum of the weights).
+        */
+        int BinnedSample(std::vector<float> &events, std::vector<int> &eventweights, double nexpected, std::vector<double> &syst_vals, std::vector<float> &uppers, std::vector<float> &lowers, long int maxsamples=1e7, RNGState *rng=0);
+
     protected:
-        hemi::Array<float> samples;
+        /** Evaluate the histogram with the systematic parameters syst_vals
+            and compute the content of each bin inside the sampling bounds.
+            The edges of each bin along each dimension, clipped to the
+            bounds, are written to edge_lo/edge_hi.  Returns the total.
+        */
+        double SamplingWeights(std::vector<double> &syst_vals, std::vector<float> &uppers, std::vector<float> &lowers,
+                               std::vector<double> &bin_weight,
+                               std::vector<std::vector<double> > &edge_lo,
+                               std::vector<std::vector<double> > &edge_hi);
+
+        /** Launch the binning of the samples into the (zeroed) histogram
+            on the GPU, with per-warp or per-block histograms in shared
+            memory where they fit.  Only defined in CUDA builds.
+        */
+        void BinSamplesAsync(int nblocks, int nthreads_per_block);
+
+        /** Set up the sorted sample layout if the current systematics
+            allow it and it pays off (see the class description), setting
+            sorted_obs to the shifted observable, or to -1 otherwise.
+        */
+        void SortSamples();
+
+        /** Common part of the constructors */
+        void Init(int nsamples, const std::vector<double> &lower, const std::vector<double> &upper,
+                  const std::vector<int> &nbins);
+
+        /** Samples and weights as read by the binning kernels */
+        const float *SamplesPtr() const { return this->shared_samples ? this->shared_samples : this->samples.readOnlyPtr(); }
+        const int *WeightsPtr() const { return this->shared_weights ? this->shared_weights : this->weights.readOnlyPtr(); }
+
+        /** Samples and weights on the host */
+        const float *HostSamplesPtr() const { return this->shared_samples ? this->shared_samples : this->samples.readOnlyHostPtr(); }
+        const int *HostWeightsPtr() const { return this->shared_weights ? this->shared_weights : this->weights.readOnlyHostPtr(); }
+
+        int nsamples;
+        hemi::Array<float> samples;  // column-major: field i of sample j at i * nsamples + j
         hemi::Array<int> weights;
+        const float *shared_samples;  // samples owned elsewhere, used instead of the above, or 0
+        const int *shared_weights;
         hemi::Array<int> *read_bins;
         hemi::Array<int> nbins;
         hemi::Array<int> bin_stride;
         hemi::Array<unsigned int> *bins;
+        hemi::Array<unsigned int> *fused_accum;  // bin_eval_fused sums, GPU only, else 0
         int total_nbins;
         double bin_volume;
 
@@ -353,18 +501,43 @@ namespace pdfz {
         int eval_nthreads_per_block;
         int eval_nblocks;
 
+        int host_nthreads;
+        std::vector<unsigned int> host_thread_bins;
+
+        int sorted_obs;  // observable the samples are sorted along, or -1
+        int sorted_nsyst;  // number of systematics when sorted_obs was set
+        hemi::Array<int> sorted_row_start;  // first sample of each row
+        hemi::Array<unsigned int> sorted_cum_weights;  // prefix sums of weights
+
+        bool single_precision;
+
         bool needs_optimization;
     };
 
 
-    /** Evaluate a PDF using a kernel density estimator */
+    /** Evaluate a PDF using a kernel density estimator
+
+        The PDF is a sum of product Epanechnikov kernels, one per sample
+        inside the domain after the systematic transformations.  Each kernel
+        is renormalized to its part inside the bounds, so the PDF integrates
+        to one over the domain and does not drop at the edges.  The kernel
+        has finite support, so the samples are sorted into a grid of cells
+        no narrower than the bandwidth, and each evaluation point only reads
+        the samples in its own and the neighboring cells.
+    */
     class EvalKernel : public Eval
     {
+    public:
         /** See Eval::Eval() for description of parameters.  
             ``bandwidth scale`` gives rescales the bandwidths in each dimension
             by the given value.  Pass an array of 1.0f to use the default
             bandwidth calculation.
 
+            The default bandwidth in each dimension is Scott's rule,
+            sigma * n^(-1/(nobs + 4)), converted to the equivalent
+            Epanechnikov kernel half-width, with sigma the standard deviation
+            of the samples in the domain before any systematics.
+
             Raises all exceptions of PDFEval(), as well as pdfz::Error if 
             bandwidth_scale.size() != nobs.
         */
@@ -373,9 +546,37 @@ namespace pdfz {
                    const std::vector<double> &bandwidth_scale);
 
         virtual ~EvalKernel();
+        virtual Eval *Clone() const;
         virtual void SetEvalPoints(const std::vector<float> &points);
         virtual void EvalAsync(bool do_eval_pdf=true);
         virtual void EvalFinished();
+
+        /** Get the kernel half-width in each dimension */
+        std::vector<double> GetBandwidth() const;
+
+    protected:
+        hemi::Array<float> samples;
+        std::vector<double> bandwidth_scale;
+        hemi::Array<double> bandwidth;
+
+        // Grid of cells, fixed at construction
+        hemi::Array<int> ncells;
+        hemi::Array<int> cell_stride;
+        int total_ncells;
+
+        // Per-evaluation sample placement, and the samples sorted by cell
+        hemi::Array<float> positions;
+        hemi::Array<float> kernel_norms;
+        hemi::Array<int> sample_cells;
+        hemi::Array<int> cell_start;
+        hemi::Array<float> sorted_positions;
+        hemi::Array<float> sorted_norms;
+
+        hemi::Array<float> *eval_points;
+        hemi::Array<int> *eval_cells;
+
+        int nthreads_per_block;
+        int nblocks;
     };
 
 } // end namespace pdfz
@@ -0,0 +1,203 @@
+/**
+ * \file rng.h
+ * \brief Counter-based random number generation for host and device code
+ *
+ * Implements the Philox4x32-10 generator (Salmon et al., "Parallel random
+ * numbers: as easy as 1, 2, 3", SC11). Every output is a pure function of a
+ * 64-bit key (the seed) and a 128-bit counter, which here addresses a block
+ * within a stream identified by (experiment, chain, substream). Streams are
+ * independent and need no shared state, so results do not depend on how the
+ * work is split among CPU threads or CUDA blocks, and the same code runs on
+ * either.
+ */
+
+#ifndef __RNG_H__
+#define __RNG_H__
+
+#include <math.h>
+#include <hemi/hemi.h>
+
+/**
+ * \struct RNGState
+ * \brief Position in one Philox stream
+ *
+ * The block index advances every four 32-bit outputs. It is 48 bits wide,
+ * in counter[0] and the low half of counter[1], so each stream provides
+ * 2^50 values. The substream is in the high half of counter[1].
+ */
+struct RNGState {
+  unsigned key[2];  //!< 64-bit seed
+  unsigned counter[4];  //!< block, substream and block, chain, experiment
+  unsigned output[4];  //!< outputs of the current block
+  unsigned used;  //!< number of outputs of the current block consumed
+};
+
+
+/** Chain index of the streams used to generate fake data */
+#define RNG_FAKE_DATA_CHAIN 0xffffffff
+
+
+/**
+ * Philox4x32-10 block function.
+ *
+ * \param counter 128-bit counter
+ * \param key 64-bit key
+ * \param output 128 bits of output
+ */
+HEMI_DEV_CALLABLE_INLINE
+void philox4x32(const unsigned* counter, const unsigned* key,
+                unsigned* output) {
+  unsigned c0 = counter[0], c1 = counter[1];
+  unsigned c2 = counter[2], c3 = counter[3];
+  unsigned k0 = key[0], k1 = key[1];
+
+  for (int r=0; r<10; r++) {
+    unsigned long long p0 = 0xD2511F53ull * c0;
+    unsigned long long p1 = 0xCD9E8D57ull * c2;
+    c0 = (unsigned) (p1 >> 32) ^ c1 ^ k0;
+    c1 = (unsigned) p1;
+    c2 = (unsigned) (p0 >> 32) ^ c3 ^ k1;
+    c3 = (unsigned) p0;
+    k0 += 0x9E3779B9;
+    k1 += 0xBB67AE85;
+  }
+
+  output[0] = c0;
+  output[1] = c1;
+  output[2] = c2;
+  output[3] = c3;
+}
+
+
+/**
+ * Set up a generator at the start of a stream.
+ *
+ * \param state The generator
+ * \param seed Random seed, shared by all streams of a job
+ * \param experiment Fake experiment index
+ * \param chain MCMC chain index
+ * \param substream Index within the chain, e.g. the fit parameter, below 2^16
+ */
+HEMI_DEV_CALLABLE_INLINE
+void rng_init(RNGState* state, unsigned long long seed, unsigned experiment,
+              unsigned chain, unsigned substream) {
+  state->key[0] = (unsigned) seed;
+  state->key[1] = (unsigned) (seed >> 32);
+  state->counter[0] = 0;
+  state->counter[1] = substream << 16;
+  state->counter[2] = chain;
+  state->counter[3] = experiment;
+  state->used = 4;
+}
+
+
+/**
+ * Jump ahead in the stream.
+ *
+ * Moves to the block n blocks after the next unused one, discarding any
+ * outputs left in the current block. Work item i of a parallel loop can
+ * start from a copy of a generator skipped by i times the number of blocks
+ * each item uses, which gives the same values for any number of threads.
+ *
+ * \param state The generator
+ * \param n Number of blocks of four outputs to skip
+ */
+HEMI_DEV_CALLABLE_INLINE
+void rng_skip(RNGState* state, unsigned long long n) {
+  unsigned long long low = state->counter[0] + (n & 0xffffffffull);
+  state->counter[0] = (unsigned) low;
+  state->counter[1] += (unsigned) (n >> 32) + (unsigned) (low >> 32);
+  state->used = 4;
+}
+
+
+/**
+ * Draw 32 random bits.
+ */
+HEMI_DEV_CALLABLE_INLINE
+unsigned rng_next(RNGState* state) {
+  if (state->used == 4) {
+    philox4x32(state->counter, state->key, state->output);
+    if (++state->counter[0] == 0)
+      state->counter[1]++;
+    state->used = 0;
+  }
+  return state->output[state->used++];
+}
+
+
+/**
+ * Draw a uniform deviate in (0, 1], with 53 random bits.
+ */
+HEMI_DEV_CALLABLE_INLINE
+double rng_uniform(RNGState* state) {
+  unsigned a = rng_next(state) >> 5;
+  unsigned b = rng_next(state) >> 6;
+  return (a * 67108864.0 + b + 1.0) * (1.0 / 9007199254740992.0);
+}
+
+
+/**
+ * Draw a standard normal deviate (Box-Muller).
+ */
+HEMI_DEV_CALLABLE_INLINE
+double rng_normal(RNGState* state) {
+  double u1 = rng_uniform(state);
+  double u2 = rng_uniform(state);
+  return sqrt(-2.0 * log(u1)) * cos(6.283185307179586 * u2);
+}
+
+
+/**
+ * Draw a Poisson-distributed count.
+ *
+ * Uses multiplication of uniforms for small means and the transformed
+ * rejection method PTRS (Hormann, 1993) otherwise.
+ *
+ * \param state The generator
+ * \param mean Expected count
+ */
+HEMI_DEV_CALLABLE_INLINE
+long long rng_poisson(RNGState* state, double mean) {
+  if (mean <= 0) {
+    return 0;
+  }
+
+  if (mean < 10) {
+    double limit = exp(-mean);
+    double p = rng_uniform(state);
+    long long k = 0;
+    while (p > limit) {
+      p *= rng_uniform(state);
+      k++;
+    }
+    return k;
+  }
+
+  double smu = sqrt(mean);
+  double b = 0.931 + 2.53 * smu;
+  double a = -0.059 + 0.02483 * b;
+  double inv_alpha = 1.1239 + 1.1328 / (b - 3.4);
+  double vr = 0.9277 - 3.6224 / (b - 2);
+  double log_mean = log(mean);
+
+  while (true) {
+    double u = rng_uniform(state) - 0.5;
+    double v = rng_uniform(state);
+    double us = 0.5 - fabs(u);
+    double k = floor((2 * a / us + b) * u + mean + 0.43);
+    if (us >= 0.07 && v <= vr) {
+      return (long long) k;
+    }
+    if (k < 0 || (us < 0.013 && v > us)) {
+      continue;
+    }
+    if (log(v) + log(inv_alpha) - log(a / (us * us) + b) <=
+        -mean + k * log_mean - lgamma(k + 1)) {
+      return (long long) k;
+    }
+  }
+}
+
+#endif  // __RNG_H__
+
@@ -0,0 +1,102 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <assert.h>
+#include <TNtuple.h>
+
+#include <sxmc/sample_store.h>
+
+SampleStore::SampleStore(const std::vector<std::string>& _names)
+    : names(_names), columns(_names.size()), nentries(0) {}
+
+
+void SampleStore::append(const float* rows, size_t nrows) {
+  size_t ncolumns = this->names.size();
+  for (size_t j=0; j<ncolumns; j++) {
+    std::vector<float>& column = this->columns[j];
+    size_t n = column.size();
+    column.resize(n + nrows);
+    for (size_t i=0; i<nrows; i++) {
+      column[n + i] = rows[i * ncolumns + j];
+    }
+  }
+  this->nentries += nrows;
+}
+
+
+void SampleStore::reserve(size_t n) {
+  for (size_t j=0; j<this->columns.size(); j++) {
+    this->columns[j].reserve(n);
+  }
+}
+
+
+void SampleStore::clear() {
+  for (size_t j=0; j<this->columns.size(); j++) {
+    this->columns[j].clear();
+  }
+  this->nentries = 0;
+}
+
+
+int SampleStore::get_index(const std::string& name) const {
+  for (size_t j=0; j<this->names.size(); j++) {
+    if (this->names[j] == name) {
+      return j;
+    }
+  }
+  return -1;
+}
+
+
+const float* SampleStore::get_column(const std::string& name) const {
+  int index = get_index(name);
+  if (index < 0) {
+    std::cerr << "SampleStore::get_column: Unknown column " << name
+              << std::endl;
+    throw(1);
+  }
+  return get_column(index);
+}
+
+
+SampleStore* SampleStore::select_below(const std::string& name,
+                                       float max) const {
+  SampleStore* selected = new SampleStore(this->names);
+  const float* cut = get_column(name);
+
+  for (size_t j=0; j<this->columns.size(); j++) {
+    const std::vector<float>& column = this->columns[j];
+    for (size_t i=0; i<this->nentries; i++) {
+      if (cut[i] < max) {
+        selected->columns[j].push_back(column[i]);
+      }
+    }
+  }
+  selected->nentries = \
+    (selected->columns.empty() ? 0 : selected->columns[0].size());
+
+  return selected;
+}
+
+
+TNtuple* SampleStore::to_ntuple(const std::string& name,
+                                const std::string& title) const {
+  std::string varlist;
+  for (size_t j=0; j<this->names.size(); j++) {
+    varlist += (j > 0 ? ":" : "") + this->names[j];
+  }
+
+  TNtuple* nt = new TNtuple(name.c_str(), title.c_str(), varlist.c_str());
+
+  std::vector<float> row(this->names.size());
+  for (size_t i=0; i<this->nentries; i++) {
+    for (size_t j=0; j<this->names.size(); j++) {
+      row[j] = this->columns[j][i];
+    }
+    nt->Fill(&row[0]);
+  }
+
+  return nt;
+}
+
@@ -0,0 +1,108 @@
+/**
+ * \file sample_store.h
+ * \brief Columnar in-memory storage for likelihood space samples
+ */
+
+#ifndef __SAMPLE_STORE_H__
+#define __SAMPLE_STORE_H__
+
+#include <cstddef>
+#include <vector>
+#include <string>
+
+class TNtuple;
+
+/**
+ * \class SampleStore
+ * \brief Struct-of-arrays store of MCMC samples
+ *
+ * Holds one contiguous float column per variable, e.g. each fit parameter
+ * followed by the likelihood. Rows are appended in the same layout as the
+ * MCMC jump buffer, so a buffer can be added without any conversion, and
+ * statistics can scan a single column without touching the others.
+ */
+class SampleStore {
+  public:
+    /**
+     * Constructor
+     *
+     * \param _names Names of the columns
+     */
+    SampleStore(const std::vector<std::string>& _names);
+
+    /**
+     * Append rows.
+     *
+     * \param rows Row-major array of nrows x get_ncolumns() values
+     * \param nrows Number of rows to append
+     */
+    void append(const float* rows, size_t nrows=1);
+
+    /** Reserve space for a total of n rows. */
+    void reserve(size_t n);
+
+    /** Remove all rows. */
+    void clear();
+
+    /** Get the number of rows. */
+    size_t get_entries() const { return this->nentries; }
+
+    /** Get the number of columns. */
+    size_t get_ncolumns() const { return this->names.size(); }
+
+    /** Get the names of the columns. */
+    const std::vector<std::string>& get_names() const { return this->names; }
+
+    /**
+     * Get the index of a column.
+     *
+     * \param name Name of the column
+     * \returns The column index, or -1 if there is no such column
+     */
+    int get_index(const std::string& name) const;
+
+    /**
+     * Get a column.
+     *
+     * \param i Index of the column
+     * \returns Pointer to get_entries() contiguous values
+     */
+    const float* get_column(size_t i) const {
+      return this->columns[i].empty() ? NULL : &this->columns[i][0];
+    }
+
+    /**
+     * Get a column by name.
+     *
+     * \param name Name of the column, which must exist
+     * \returns Pointer to get_entries() contiguous values
+     */
+    const float* get_column(const std::string& name) const;
+
+    /**
+     * Copy the rows where one column is below a threshold.
+     *
+     * \param name Name of the column to cut on
+     * \param max Keep rows with values strictly less than this
+     * \returns A new SampleStore with the selected rows (caller owns)
+     */
+    SampleStore* select_below(const std::string& name, float max) const;
+
+    /**
+     * Export to a TNtuple.
+     *
+     * \param name Name of the new TNtuple
+     * \param title Title of the new TNtuple
+     * \returns A new TNtuple with one branch per column (caller owns)
+     */
+    TNtuple* to_ntuple(const std::string& name,
+                       const std::string& title="Likelihood space") const;
+
+  protected:
+    std::vector<std::string> names;  //!< column names
+    std::vector<std::vector<float> > columns;  //!< column data
+    size_t nentries;  //!< number of rows
+};
+
+#endif  // __SAMPLE_STORE_H__
+
@@ -37,55 +37,6 @@ void Signal::do_r3_hack(std::vector<float>& samples,
   }
 }
 
-void Signal::read_dataset_to_samples(std::vector<float>& samples,
-    std::vector<float>& dataset,
-    std::vector<std::string>& sample_fields,
-    std::vector<std::string>& dataset_fields,
-    std::vector<Observable>& cuts)
-{
-  std::vector<bool> field_has_cut(dataset_fields.size(), false);
-  std::vector<double> field_cut_lower(dataset_fields.size());
-  std::vector<double> field_cut_upper(dataset_fields.size());
-  for (size_t i=0; i<dataset_fields.size(); i++) {
-    for (size_t j=0; j<cuts.size(); j++) {
-      if (cuts[j].field == dataset_fields[i]) {
-        field_has_cut[i] = true;
-        field_cut_lower[i] = cuts[j].lower;
-        field_cut_upper[i] = cuts[j].upper;
-      }
-    }
-  }
-
-  std::vector<size_t> sample_to_dataset_map;
-  for (size_t i=0;i<sample_fields.size();i++){
-    size_t index = (std::find(dataset_fields.begin(), dataset_fields.end(),
-          sample_fields[i]) - dataset_fields.begin());
-    sample_to_dataset_map.push_back(index);
-  }
-
-  size_t ndata = (size_t) dataset.size()/dataset_fields.size();
-  size_t sample_index = 0;
-  for (size_t i=0; i<ndata; i++) {
-    bool event_valid = true;
-    for (size_t j=0;j<dataset_fields.size();j++){
-      float data = dataset[i * dataset_fields.size() + j];
-      if (field_has_cut[j] &&
-          (data < field_cut_lower[j] || data > field_cut_upper[j])) {
-        event_valid = false;
-        break;
-      }
-    }
-    if (!event_valid)
-      continue;
-    for (size_t j=0; j<sample_fields.size(); j++) {
-      float data = dataset[i * dataset_fields.size() + sample_to_dataset_map[j]];
-      samples[sample_index * sample_fields.size() + j] = data;
-    }
-    sample_index++;
-  }
-  samples.resize(sample_index*sample_fields.size());
-}
-
 void Signal::apply_exclusions(std::vector<float>& samples,
     std::vector<std::string>& sample_fields,
     std::vector<int>& weights,
@@ -157,26 +108,31 @@ void Signal::set_efficiency(std::vector<Systematic> &systematics)
   dynamic_cast<pdfz::EvalHist*>(this->histogram)->EvalAsync(false);
   dynamic_cast<pdfz::EvalHist*>(this->histogram)->EvalFinished();
 
+  set_efficiency((size_t) norms_buffer.readOnlyHostPtr()[0]);
+}
+
+void Signal::set_efficiency(size_t _nevents)
+{
   // efficiency is the number of events that make it into the histogram over the number of physical events input
   // note that this is dependent on the systematics, and for now it is calculated with all systematics at means 
-  this->nevents = norms_buffer.readOnlyHostPtr()[0];
+  this->nevents = _nevents;
   this->efficiency = this->nevents / (double) (this->nevents_physical);
   // nexpected = physical events expected * efficiency
   this->nexpected *= this->efficiency;
   // uncertainty scales by efficiency as well
   this->sigma *= this->efficiency;
 
-  std::cout << "Signal::Signal: " << this->nevents << " events remaining. " << this->nevents_physical-this->nevents << " events cut out of " << this->nevents_physical << " events. Total efficiency: " << this->efficiency << std::endl;
+  std::cout << "Signal::Signal: " << this->name << ": " << this->nevents << " events remaining. " << this->nevents_physical-this->nevents << " events cut out of " << this->nevents_physical << " events. Total efficiency: " << this->efficiency << std::endl;
 }
 
-void Signal::build_pdfz(std::vector<float> &samples,std::vector<int> &weights, int nfields,
-    std::vector<Observable> &observables,
-    std::vector<Systematic> &systematics)
+// build bin and limit arrays
+static void get_binning(int nfields, std::vector<Observable> &observables,
+    std::vector<double> &lower, std::vector<double> &upper,
+    std::vector<int> &nbins)
 {
-  // build bin and limit arrays
-  std::vector<double> lower(observables.size());
-  std::vector<double> upper(observables.size());
-  std::vector<int> nbins(observables.size());
+  lower.resize(observables.size());
+  upper.resize(observables.size());
+  nbins.resize(observables.size());
   for (size_t i=0; i<(size_t) nfields; i++) {
     for (size_t j=0; j<observables.size(); j++) {
       if (observables[j].field_index == i) {
@@ -187,12 +143,43 @@ void Signal::build_pdfz(std::vector<float> &samples,std::vector<int> &weights, i
       }
     }
   }
+}
+
+void Signal::build_pdfz(std::vector<float> &samples,std::vector<int> &weights, int nfields,
+    std::vector<Observable> &observables,
+    std::vector<Systematic> &systematics)
+{
+  std::vector<double> lower, upper;
+  std::vector<int> nbins;
+  get_binning(nfields, observables, lower, upper, nbins);
 
   // build the histogram evaluator
   this->histogram = new pdfz::EvalHist(samples, weights, nfields,
       observables.size(),
       lower, upper, nbins);
 
+  add_systematics(systematics);
+}
+
+void Signal::build_pdfz(const float *samples, const int *weights,
+    size_t nsamples, int nfields,
+    std::vector<Observable> &observables,
+    std::vector<Systematic> &systematics)
+{
+  std::vector<double> lower, upper;
+  std::vector<int> nbins;
+  get_binning(nfields, observables, lower, upper, nbins);
+
+  // the evaluator reads the samples in place
+  this->histogram = new pdfz::EvalHist(samples, weights, nsamples, nfields,
+      observables.size(),
+      lower, upper, nbins);
+
+  add_systematics(systematics);
+}
+
+void Signal::add_systematics(std::vector<Systematic> &systematics)
+{
   for (size_t i=0; i<systematics.size(); i++) {
     Systematic* syst = &systematics[i];
 
@@ -218,28 +205,135 @@ void Signal::build_pdfz(std::vector<float> &samples,std::vector<int> &weights, i
   }
 }
 
+PDFCacheKey Signal::cache_key(const std::string& dataset,
+    const std::vector<std::string>& dataset_fields,
+    const std::vector<std::string>& sample_fields,
+    const std::vector<Observable>& observables,
+    const std::vector<Observable>& cuts,
+    const std::vector<Systematic>& systematics,
+    const std::vector<std::string>& filenames)
+{
+  PDFCacheKey key;
+  key.add(dataset);
+  for (size_t i=0; i<dataset_fields.size(); i++) {
+    key.add(dataset_fields[i]);
+  }
+  key.add("samples");
+  for (size_t i=0; i<sample_fields.size(); i++) {
+    key.add(sample_fields[i]);
+  }
+  key.add("observables");
+  for (size_t i=0; i<observables.size(); i++) {
+    key.add(observables[i].field);
+    key.add(observables[i].field_index);
+    key.add(observables[i].bins);
+    key.add(observables[i].lower);
+    key.add(observables[i].upper);
+    key.add(observables[i].exclude);
+    key.add(observables[i].exclude_min);
+    key.add(observables[i].exclude_max);
+  }
+  key.add("cuts");
+  for (size_t i=0; i<cuts.size(); i++) {
+    key.add(cuts[i].field);
+    key.add(cuts[i].lower);
+    key.add(cuts[i].upper);
+  }
+  // the efficiency is found with the systematics at their means
+  key.add("systematics");
+  for (size_t i=0; i<systematics.size(); i++) {
+    key.add(systematics[i].type);
+    key.add(systematics[i].observable_field_index);
+    key.add(systematics[i].truth_field_index);
+    key.add(systematics[i].mean);
+  }
+  key.add("files");
+  for (size_t i=0; i<filenames.size(); i++) {
+    key.add_file(filenames[i]);
+  }
+  return key;
+}
+
+bool Signal::load_cached(const PDFCache* cache, const PDFCacheKey& key,
+    std::vector<Observable> &observables,
+    std::vector<Systematic> &systematics)
+{
+  // samples are used straight from the mapped file, so concurrent
+  // processes share them
+  PDFCacheEntry entry;
+  const float* samples;
+  const int* weights;
+  size_t nsamples;
+  if (!cache || !cache->map(key, entry, samples, weights, nsamples) ||
+      !entry.column_major) {
+    return false;
+  }
+
+  std::cout << "Signal::Signal: Mapped " << this->name
+    << " samples from PDF cache" << std::endl;
+
+  this->nevents_physical = entry.nevents_physical;
+  build_pdfz(samples,weights,nsamples,entry.nfields,observables,systematics);
+  set_efficiency((size_t) entry.nevents);
+  return true;
+}
+
+void Signal::store_cached(const PDFCache* cache, const PDFCacheKey& key,
+    int nfields)
+{
+  if (!cache || !cache->enabled()) {
+    return;
+  }
+
+  // store the samples as the evaluator holds them after an evaluation,
+  // so that one built on the mapped file can use them as they are
+  PDFCacheEntry entry;
+  entry.nfields = nfields;
+  entry.column_major = true;
+  dynamic_cast<pdfz::EvalHist*>(this->histogram)->GetSamples(entry.samples,
+      entry.weights);
+  entry.nevents_physical = this->nevents_physical;
+  entry.nevents = this->nevents;
+  entry.nexpected = 0;
+  entry.efficiency = this->efficiency;
+  cache->store(key, entry);
+}
+
 // construct signal from root files
 Signal::Signal(std::string _name, std::string _title, float _nexpected, float _sigma, std::string _category,
     std::vector<std::string>& sample_fields,
     std::vector<Observable>& observables,
     std::vector<Observable>& cuts,
     std::vector<Systematic>& systematics,
-    std::vector<std::string>& filenames) : name(_name), title(_title), category(_category), nexpected(_nexpected),
+    std::vector<std::string>& filenames,
+    const PDFCache* cache) : name(_name), title(_title), category(_category), nexpected(_nexpected),
   sigma(_sigma), efficiency(1)
 {
-  std::vector<float> dataset;
-  std::vector<unsigned int> rank;
-  std::vector<std::string> ttree_fields;
-  for (size_t i=0; i<filenames.size(); i++) {
-    int code = read_float_vector_ttree(filenames[i], dataset, rank, ttree_fields);
-    assert(code >= 0);
+  PDFCacheKey key = cache_key("", std::vector<std::string>(), sample_fields,
+      observables, cuts, systematics, filenames);
+  if (load_cached(cache, key, observables, systematics)) {
+    return;
+  }
+
+  // read only the sample fields, and the cut fields, of events passing cuts
+  std::vector<BranchCut> branch_cuts;
+  for (size_t i=cuts.size(); i>0; i--) {
+    bool seen = false;
+    for (size_t j=0; j<branch_cuts.size(); j++) {
+      seen = seen || branch_cuts[j].branch == cuts[i-1].field;
+    }
+    if (!seen) {
+      BranchCut cut = { cuts[i-1].field, cuts[i-1].lower, cuts[i-1].upper };
+      branch_cuts.push_back(cut);
+    }
   }
 
-  // 2. copy over the relevant data into sample array
-  this->nevents_physical = rank[0];
-  std::vector<float> samples(this->nevents_physical * sample_fields.size());
+  std::vector<float> samples;
+  this->nevents_physical = 0;
+  int code = read_float_columns_ttree(filenames, sample_fields, branch_cuts,
+      samples, this->nevents_physical);
+  assert(code >= 0);
 
-  read_dataset_to_samples(samples,dataset,sample_fields,ttree_fields,cuts);
   do_r3_hack(samples,sample_fields,observables);
   apply_exclusions(samples,sample_fields,observables);
 
@@ -252,6 +346,8 @@ Signal::Signal(std::string _name, std::string _title, float _nexpected, float _s
   // Evaluate histogram at mean of systematics to see how many
   // of our samples fall within our observable min and max limits
   set_efficiency(systematics);
+
+  store_cached(cache,key,sample_fields.size());
 }
 
 
@@ -263,22 +359,44 @@ Signal::Signal(std::string _name, std::string _title, float _nexpected, float _s
     std::vector<Observable>& observables,
     std::vector<Observable>& cuts,
     std::vector<Systematic>& systematics,
-    std::vector<std::string>& filenames) : name(_name), title(_title), category(_category), nexpected(_nexpected),
+    std::vector<std::string>& filenames,
+    const PDFCache* cache) : name(_name), title(_title), category(_category), nexpected(_nexpected),
   sigma(_sigma), efficiency(1)
 {
-  std::vector<float> dataset;
-  std::vector<unsigned> rank;
+  PDFCacheKey key = cache_key(this->name, hdf5_fields, sample_fields,
+      observables, cuts, systematics, filenames);
+  if (load_cached(cache, key, observables, systematics)) {
+    return;
+  }
+
+  // read only the sample fields, and the cut fields, of events passing cuts
+  std::vector<unsigned int> columns;
+  for (size_t i=0; i<sample_fields.size(); i++) {
+    size_t index = (std::find(hdf5_fields.begin(), hdf5_fields.end(),
+          sample_fields[i]) - hdf5_fields.begin());
+    assert(index < hdf5_fields.size());
+    columns.push_back(index);
+  }
+
+  std::vector<ColumnCut> column_cuts;
+  for (size_t i=0; i<hdf5_fields.size(); i++) {
+    for (size_t j=cuts.size(); j>0; j--) {
+      if (cuts[j-1].field == hdf5_fields[i]) {
+        ColumnCut cut = { (unsigned int) i, cuts[j-1].lower, cuts[j-1].upper };
+        column_cuts.push_back(cut);
+        break;
+      }
+    }
+  }
+
+  std::vector<float> samples;
+  this->nevents_physical = 0;
   for (size_t i=0; i<filenames.size(); i++) {
-    int code = read_float_vector_hdf5(filenames[i], this->name,
-        dataset, rank);
+    int code = read_float_columns_hdf5(filenames[i], this->name,
+        columns, column_cuts, samples, this->nevents_physical);
     assert(code >= 0);
   }
 
-  // 2. copy over the relevant data into sample array
-  this->nevents_physical = rank[0];
-  std::vector<float> samples(this->nevents_physical * sample_fields.size());
-
-  read_dataset_to_samples(samples,dataset,sample_fields,hdf5_fields,cuts);
   do_r3_hack(samples,sample_fields,observables);
   apply_exclusions(samples,sample_fields,observables);
 
@@ -291,6 +409,8 @@ Signal::Signal(std::string _name, std::string _title, float _nexpected, float _s
   // Evaluate histogram at mean of systematics to see how many
   // of our samples fall within our observable min and max limits
   set_efficiency(systematics);
+
+  store_cached(cache,key,sample_fields.size());
 }
 
 Signal::Signal(std::string _name, std::string _title, float _nexpected, float _sigma, std::string _category,
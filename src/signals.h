@@ -12,6 +12,7 @@
 #include <string>
 #include <vector>
 #include <sxmc/pdfz.h>
+#include <sxmc/pdf_cache.h>
 
 /**
  * \struct Observable
@@ -65,17 +66,20 @@ class Signal {
      * Construct a Signal from a list of root files
      *
      * \param filenames
+     * \param cache Cache of samples passing cuts, or NULL
      */ 
     Signal(std::string _name, std::string _title, float _nexpected, float _sigma, std::string _category,
         std::vector<std::string>& sample_fields,
         std::vector<Observable>& observables,
         std::vector<Observable>& cuts,
         std::vector<Systematic>& systematics,
-        std::vector<std::string>& filenames);
+        std::vector<std::string>& filenames,
+        const PDFCache* cache=NULL);
     /**
      * Construct a Signal from a list of hdf5 files
      *
      * \param filenames
+     * \param cache Cache of samples passing cuts, or NULL
      */ 
     Signal(std::string _name, std::string _title, float _nexpected, float _sigma, std::string _category,
         std::vector<std::string>& hdf5_fields,
@@ -83,7 +87,8 @@ class Signal {
         std::vector<Observable>& observables,
         std::vector<Observable>& cuts,
         std::vector<Systematic>& systematics,
-        std::vector<std::string>& filenames);
+        std::vector<std::string>& filenames,
+        const PDFCache* cache=NULL);
     /**
      * Construct a Signal from a list of samples and weights 
      *
@@ -107,14 +112,56 @@ class Signal {
     size_t nevents_physical;  //!< number of simulated events used to make pdf (nevents/efficiency)
     pdfz::Eval* histogram;  //!< PDF
 
+    /**
+     * Get the key under which the samples of a signal read from files are
+     * cached: everything that determines the samples and the efficiency.
+     *
+     * \param dataset HDF5 dataset name, or "" for root files
+     * \param dataset_fields Fields in the HDF5 files, or empty for root
+     */
+    static PDFCacheKey cache_key(const std::string& dataset,
+        const std::vector<std::string>& dataset_fields,
+        const std::vector<std::string>& sample_fields,
+        const std::vector<Observable>& observables,
+        const std::vector<Observable>& cuts,
+        const std::vector<Systematic>& systematics,
+        const std::vector<std::string>& filenames);
+
   protected:
 
+    /**
+     * Build the PDF from cached samples, if they are in the cache.
+     *
+     * \return True if the signal was built
+     */
+    bool load_cached(const PDFCache* cache, const PDFCacheKey& key,
+        std::vector<Observable> &observables,
+        std::vector<Systematic> &systematics);
+
+    /** Store the samples of the PDF in the cache, after it is evaluated */
+    void store_cached(const PDFCache* cache, const PDFCacheKey& key,
+        int nfields);
+
     void build_pdfz(std::vector<float> &samples,std::vector<int> &weights, int nfields,
         std::vector<Observable> &observables,
         std::vector<Systematic> &systematics);
 
+    /**
+     * Build the PDF on column-major samples owned elsewhere, which must
+     * outlive it (see pdfz::EvalHist).
+     */
+    void build_pdfz(const float *samples, const int *weights,
+        size_t nsamples, int nfields,
+        std::vector<Observable> &observables,
+        std::vector<Systematic> &systematics);
+
+    void add_systematics(std::vector<Systematic> &systematics);
+
     void set_efficiency(std::vector<Systematic> &systematics);
 
+    /** Set the efficiency given the number of events in the PDF */
+    void set_efficiency(size_t _nevents);
+
     void apply_exclusions(std::vector<float>& samples,
         std::vector<std::string>& sample_fields,
         std::vector<int>& weights,
@@ -127,12 +174,6 @@ class Signal {
       apply_exclusions(samples,sample_fields,fake,observables);
     };
 
-    void read_dataset_to_samples(std::vector<float>& samples,
-        std::vector<float>& dataset,
-        std::vector<std::string>& sample_fields,
-        std::vector<std::string>& dataset_fields,
-        std::vector<Observable>& cuts);
-
     void do_r3_hack(std::vector<float>& samples,
         std::vector<std::string>& sample_fields,
         std::vector<Observable>& observables);
@@ -0,0 +1,537 @@
+#include <cmath>
+#include <cfloat>
+#include <cstdlib>
+#include <string>
+
+#include <sxmc/simd_kernels.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SXMC_SIMD_X86
+#include <immintrin.h>
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define SIMD_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+namespace simd {
+
+////////////////////////////////////////////////////////////////////////////
+// Scalar reference implementations, identical to the HEMI kernel loops
+
+static double nll_event_sum_scalar(const float* lut, const int* dataweights,
+                                   const double* pars, size_t ne, size_t ns,
+                                   size_t first) {
+  double sum = 0;
+  for (size_t i=first; i<ne; i++) {
+    double s = 0;
+    for (size_t j=0; j<ns; j++) {
+      float v = lut[j * ne + i];
+      s += pars[j] * (!std::isnan(v) ? v : 0);  // handle nans from empty hists
+    }
+    sum += log(s) * dataweights[i];
+  }
+  return sum;
+}
+
+
+static void eval_pdf_scalar(int first, int npoints, const int* read_bins,
+                            const unsigned int* bins, double bin_norm,
+                            float* output, int output_stride) {
+  for (int ipoint=first; ipoint<npoints; ipoint++) {
+    int bin_id = read_bins[ipoint];
+
+    double pdf_value = 0.0f;
+    if (bin_id < 0)
+      pdf_value = nanf("");
+    else
+      pdf_value = bins[bin_id] / bin_norm;
+
+    output[output_stride * ipoint] = pdf_value;
+  }
+}
+
+
+static void sum_histograms_scalar(const unsigned int* hists, int nhists,
+                                  size_t hist_stride, size_t first,
+                                  size_t last, unsigned int* output) {
+  for (size_t i=first; i<last; i++) {
+    unsigned int sum = 0;
+    for (int k=0; k<nhists; k++) {
+      sum += hists[k * hist_stride + i];
+    }
+    output[i] = sum;
+  }
+}
+
+
+#ifdef SXMC_SIMD_X86
+
+// Coefficients for log(1+f) = f - f^2/2 + s*(f^2/2 + R(s^2)), s = f/(2+f),
+// from the fdlibm __ieee754_log implementation
+static const double kLg1 = 6.666666666666735130e-01;
+static const double kLg2 = 3.999999999940941908e-01;
+static const double kLg3 = 2.857142874366239149e-01;
+static const double kLg4 = 2.222219843214978396e-01;
+static const double kLg5 = 1.818357216161805012e-01;
+static const double kLg6 = 1.531383769920937332e-01;
+static const double kLg7 = 1.479819860511658591e-01;
+static const double kLn2Hi = 6.93147180369123816490e-01;
+static const double kLn2Lo = 1.90821492927058770002e-10;
+
+// 2^52 + 1023: subtracting it from the exponent bits ORed into the mantissa
+// of 2^52 gives the unbiased exponent as a double
+static const double kExponentMagic = 4503599627370496.0 + 1023.0;
+static const long long kExponentMagicBits = 0x4330000000000000LL;
+static const long long kMantissaBits = 0x000fffffffffffffLL;
+static const long long kOneBits = 0x3ff0000000000000LL;
+
+////////////////////////////////////////////////////////////////////////////
+// AVX2
+
+/**
+ * Natural log of four doubles.
+ *
+ * Accurate for positive normal inputs; other lanes are recomputed with the
+ * scalar log so that zeros, negatives and NaNs behave as in the scalar code.
+ */
+SIMD_TARGET_AVX2
+static inline __m256d log_avx2(__m256d x) {
+  __m256i xi = _mm256_castpd_si256(x);
+
+  // x = 2^e * m, m in [1, 2)
+  __m256i ebits = _mm256_srli_epi64(xi, 52);
+  __m256d e = _mm256_sub_pd(
+    _mm256_castsi256_pd(_mm256_or_si256(ebits,
+                        _mm256_set1_epi64x(kExponentMagicBits))),
+    _mm256_set1_pd(kExponentMagic));
+  __m256d m = _mm256_castsi256_pd(
+    _mm256_or_si256(_mm256_and_si256(xi, _mm256_set1_epi64x(kMantissaBits)),
+                    _mm256_set1_epi64x(kOneBits)));
+
+  // reduce to m in [sqrt(2)/2, sqrt(2))
+  __m256d big = _mm256_cmp_pd(m, _mm256_set1_pd(M_SQRT2), _CMP_GE_OQ);
+  m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), big);
+  e = _mm256_add_pd(e, _mm256_and_pd(big, _mm256_set1_pd(1.0)));
+
+  __m256d f = _mm256_sub_pd(m, _mm256_set1_pd(1.0));
+  __m256d s = _mm256_div_pd(f, _mm256_add_pd(f, _mm256_set1_pd(2.0)));
+  __m256d z = _mm256_mul_pd(s, s);
+  __m256d w = _mm256_mul_pd(z, z);
+  __m256d t1 = _mm256_fmadd_pd(w, _mm256_set1_pd(kLg6), _mm256_set1_pd(kLg4));
+  t1 = _mm256_fmadd_pd(w, t1, _mm256_set1_pd(kLg2));
+  t1 = _mm256_mul_pd(w, t1);
+  __m256d t2 = _mm256_fmadd_pd(w, _mm256_set1_pd(kLg7), _mm256_set1_pd(kLg5));
+  t2 = _mm256_fmadd_pd(w, t2, _mm256_set1_pd(kLg3));
+  t2 = _mm256_fmadd_pd(w, t2, _mm256_set1_pd(kLg1));
+  t2 = _mm256_mul_pd(z, t2);
+  __m256d r = _mm256_add_pd(t1, t2);
+  __m256d hfsq = _mm256_mul_pd(_mm256_set1_pd(0.5), _mm256_mul_pd(f, f));
+
+  // e*ln2_hi - ((hfsq - (s*(hfsq+R) + e*ln2_lo)) - f)
+  __m256d lo = _mm256_fmadd_pd(s, _mm256_add_pd(hfsq, r),
+                               _mm256_mul_pd(e, _mm256_set1_pd(kLn2Lo)));
+  __m256d result = _mm256_sub_pd(_mm256_mul_pd(e, _mm256_set1_pd(kLn2Hi)),
+                                 _mm256_sub_pd(_mm256_sub_pd(hfsq, lo), f));
+
+  // zero, negative, denormal, infinite and NaN lanes
+  __m256d ok = _mm256_and_pd(
+    _mm256_cmp_pd(x, _mm256_set1_pd(DBL_MIN), _CMP_GE_OQ),
+    _mm256_cmp_pd(x, _mm256_set1_pd(HUGE_VAL), _CMP_LT_OQ));
+  if (_mm256_movemask_pd(ok) != 0xf) {
+    double xs[4], rs[4];
+    _mm256_storeu_pd(xs, x);
+    _mm256_storeu_pd(rs, result);
+    int mask = _mm256_movemask_pd(ok);
+    for (int l=0; l<4; l++) {
+      if (!(mask & (1 << l))) {
+        rs[l] = log(xs[l]);
+      }
+    }
+    result = _mm256_loadu_pd(rs);
+  }
+
+  return result;
+}
+
+
+/** Sum over signals for four events, with NaN lut entries as zero */
+SIMD_TARGET_AVX2
+static inline __m256d signal_sum_avx2(const float* lut, const double* pars,
+                                      size_t ne, size_t ns, size_t i) {
+  __m256d s = _mm256_setzero_pd();
+  for (size_t j=0; j<ns; j++) {
+    __m256d v = _mm256_cvtps_pd(_mm_loadu_ps(lut + j * ne + i));
+    v = _mm256_and_pd(v, _mm256_cmp_pd(v, v, _CMP_ORD_Q));
+    s = _mm256_fmadd_pd(_mm256_set1_pd(pars[j]), v, s);
+  }
+  return s;
+}
+
+
+SIMD_TARGET_AVX2
+static double nll_event_sum_avx2(const float* lut, const int* dataweights,
+                                 const double* pars, size_t ne, size_t ns) {
+  __m256d acc0 = _mm256_setzero_pd();
+  __m256d acc1 = _mm256_setzero_pd();
+
+  // two vectors per iteration to hide the latency of the signal-axis FMAs
+  size_t i = 0;
+  for (; i + 8 <= ne; i += 8) {
+    __m256d s0 = signal_sum_avx2(lut, pars, ne, ns, i);
+    __m256d s1 = signal_sum_avx2(lut, pars, ne, ns, i + 4);
+    __m256d w0 = _mm256_cvtepi32_pd(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(dataweights + i)));
+    __m256d w1 = _mm256_cvtepi32_pd(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(dataweights + i + 4)));
+    acc0 = _mm256_fmadd_pd(log_avx2(s0), w0, acc0);
+    acc1 = _mm256_fmadd_pd(log_avx2(s1), w1, acc1);
+  }
+
+  double lanes[4];
+  _mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+  double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+  return sum + nll_event_sum_scalar(lut, dataweights, pars, ne, ns, i);
+}
+
+
+SIMD_TARGET_AVX2
+static void eval_pdf_avx2(int npoints, const int* read_bins,
+                          const unsigned int* bins, double bin_norm,
+                          float* output, int output_stride) {
+  const __m256d norm = _mm256_set1_pd(bin_norm);
+  const __m128 nan = _mm_set1_ps(nanf(""));
+
+  int ipoint = 0;
+  for (; ipoint + 4 <= npoints; ipoint += 4) {
+    __m128i idx = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(read_bins + ipoint));
+    __m128i valid = _mm_cmpgt_epi32(idx, _mm_set1_epi32(-1));
+    __m128i counts = _mm_mask_i32gather_epi32(
+      _mm_setzero_si128(), reinterpret_cast<const int*>(bins), idx, valid, 4);
+
+    // unsigned to double, exactly: flip the sign bit and add back 2^31
+    __m256d c = _mm256_add_pd(
+      _mm256_cvtepi32_pd(_mm_xor_si128(counts,
+                                       _mm_set1_epi32(0x80000000))),
+      _mm256_set1_pd(2147483648.0));
+    __m128 v = _mm256_cvtpd_ps(_mm256_div_pd(c, norm));
+    v = _mm_blendv_ps(nan, v, _mm_castsi128_ps(valid));
+
+    if (output_stride == 1) {
+      _mm_storeu_ps(output + ipoint, v);
+    }
+    else {
+      float vs[4];
+      _mm_storeu_ps(vs, v);
+      for (int l=0; l<4; l++) {
+        output[output_stride * (ipoint + l)] = vs[l];
+      }
+    }
+  }
+
+  eval_pdf_scalar(ipoint, npoints, read_bins, bins, bin_norm,
+                  output, output_stride);
+}
+
+
+SIMD_TARGET_AVX2
+static void sum_histograms_avx2(const unsigned int* hists, int nhists,
+                                size_t hist_stride, size_t first, size_t last,
+                                unsigned int* output) {
+  size_t i = first;
+  for (; i + 8 <= last; i += 8) {
+    __m256i sum = _mm256_setzero_si256();
+    for (int k=0; k<nhists; k++) {
+      sum = _mm256_add_epi32(sum, _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(hists + k * hist_stride + i)));
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), sum);
+  }
+
+  sum_histograms_scalar(hists, nhists, hist_stride, i, last, output);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+// AVX-512
+
+// Some GCC versions warn about the deliberately undefined pass-through
+// operand inside the unmasked AVX-512 intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+/** Natural log of eight doubles, see log_avx2() */
+SIMD_TARGET_AVX512
+static inline __m512d log_avx512(__m512d x) {
+  __m512i xi = _mm512_castpd_si512(x);
+
+  // x = 2^e * m, m in [1, 2)
+  __m512i ebits = _mm512_srli_epi64(xi, 52);
+  __m512d e = _mm512_sub_pd(
+    _mm512_castsi512_pd(_mm512_or_si512(ebits,
+                        _mm512_set1_epi64(kExponentMagicBits))),
+    _mm512_set1_pd(kExponentMagic));
+  __m512d m = _mm512_castsi512_pd(
+    _mm512_or_si512(_mm512_and_si512(xi, _mm512_set1_epi64(kMantissaBits)),
+                    _mm512_set1_epi64(kOneBits)));
+
+  // reduce to m in [sqrt(2)/2, sqrt(2))
+  __mmask8 big = _mm512_cmp_pd_mask(m, _mm512_set1_pd(M_SQRT2), _CMP_GE_OQ);
+  m = _mm512_mask_mul_pd(m, big, m, _mm512_set1_pd(0.5));
+  e = _mm512_mask_add_pd(e, big, e, _mm512_set1_pd(1.0));
+
+  __m512d f = _mm512_sub_pd(m, _mm512_set1_pd(1.0));
+  __m512d s = _mm512_div_pd(f, _mm512_add_pd(f, _mm512_set1_pd(2.0)));
+  __m512d z = _mm512_mul_pd(s, s);
+  __m512d w = _mm512_mul_pd(z, z);
+  __m512d t1 = _mm512_fmadd_pd(w, _mm512_set1_pd(kLg6), _mm512_set1_pd(kLg4));
+  t1 = _mm512_fmadd_pd(w, t1, _mm512_set1_pd(kLg2));
+  t1 = _mm512_mul_pd(w, t1);
+  __m512d t2 = _mm512_fmadd_pd(w, _mm512_set1_pd(kLg7), _mm512_set1_pd(kLg5));
+  t2 = _mm512_fmadd_pd(w, t2, _mm512_set1_pd(kLg3));
+  t2 = _mm512_fmadd_pd(w, t2, _mm512_set1_pd(kLg1));
+  t2 = _mm512_mul_pd(z, t2);
+  __m512d r = _mm512_add_pd(t1, t2);
+  __m512d hfsq = _mm512_mul_pd(_mm512_set1_pd(0.5), _mm512_mul_pd(f, f));
+
+  __m512d lo = _mm512_fmadd_pd(s, _mm512_add_pd(hfsq, r),
+                               _mm512_mul_pd(e, _mm512_set1_pd(kLn2Lo)));
+  __m512d result = _mm512_sub_pd(_mm512_mul_pd(e, _mm512_set1_pd(kLn2Hi)),
+                                 _mm512_sub_pd(_mm512_sub_pd(hfsq, lo), f));
+
+  // zero, negative, denormal, infinite and NaN lanes
+  __mmask8 ok = _mm512_cmp_pd_mask(x, _mm512_set1_pd(DBL_MIN), _CMP_GE_OQ) &
+                _mm512_cmp_pd_mask(x, _mm512_set1_pd(HUGE_VAL), _CMP_LT_OQ);
+  if (ok != 0xff) {
+    double xs[8], rs[8];
+    _mm512_storeu_pd(xs, x);
+    _mm512_storeu_pd(rs, result);
+    for (int l=0; l<8; l++) {
+      if (!(ok & (1 << l))) {
+        rs[l] = log(xs[l]);
+      }
+    }
+    result = _mm512_loadu_pd(rs);
+  }
+
+  return result;
+}
+
+
+/** Sum over signals for eight events, with NaN lut entries as zero */
+SIMD_TARGET_AVX512
+static inline __m512d signal_sum_avx512(const float* lut, const double* pars,
+                                        size_t ne, size_t ns, size_t i) {
+  __m512d s = _mm512_setzero_pd();
+  for (size_t j=0; j<ns; j++) {
+    __m512d v = _mm512_cvtps_pd(_mm256_loadu_ps(lut + j * ne + i));
+    v = _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(v, v, _CMP_ORD_Q), v);
+    s = _mm512_fmadd_pd(_mm512_set1_pd(pars[j]), v, s);
+  }
+  return s;
+}
+
+
+SIMD_TARGET_AVX512
+static double nll_event_sum_avx512(const float* lut, const int* dataweights,
+                                   const double* pars, size_t ne, size_t ns) {
+  __m512d acc0 = _mm512_setzero_pd();
+  __m512d acc1 = _mm512_setzero_pd();
+
+  size_t i = 0;
+  for (; i + 16 <= ne; i += 16) {
+    __m512d s0 = signal_sum_avx512(lut, pars, ne, ns, i);
+    __m512d s1 = signal_sum_avx512(lut, pars, ne, ns, i + 8);
+    __m512d w0 = _mm512_cvtepi32_pd(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dataweights + i)));
+    __m512d w1 = _mm512_cvtepi32_pd(
+      _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(dataweights + i + 8)));
+    acc0 = _mm512_fmadd_pd(log_avx512(s0), w0, acc0);
+    acc1 = _mm512_fmadd_pd(log_avx512(s1), w1, acc1);
+  }
+
+  double sum = _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+
+  return sum + nll_event_sum_scalar(lut, dataweights, pars, ne, ns, i);
+}
+
+
+SIMD_TARGET_AVX512
+static void eval_pdf_avx512(int npoints, const int* read_bins,
+                            const unsigned int* bins, double bin_norm,
+                            float* output, int output_stride) {
+  const __m512d norm = _mm512_set1_pd(bin_norm);
+  const __m512d nan = _mm512_set1_pd(nanf(""));
+
+  int ipoint = 0;
+  for (; ipoint + 16 <= npoints; ipoint += 16) {
+    __m512i idx = _mm512_loadu_si512(read_bins + ipoint);
+    __mmask16 valid = _mm512_cmpge_epi32_mask(idx, _mm512_setzero_si512());
+    __m512i counts = _mm512_mask_i32gather_epi32(
+      _mm512_setzero_si512(), valid, idx, bins, 4);
+
+    __m512d c0 = _mm512_cvtepu32_pd(_mm512_castsi512_si256(counts));
+    __m512d c1 = _mm512_cvtepu32_pd(_mm512_extracti64x4_epi64(counts, 1));
+    __m512d v0 = _mm512_mask_blend_pd((__mmask8) valid, nan,
+                                      _mm512_div_pd(c0, norm));
+    __m512d v1 = _mm512_mask_blend_pd((__mmask8) (valid >> 8), nan,
+                                      _mm512_div_pd(c1, norm));
+
+    float vs[16];
+    _mm256_storeu_ps(vs, _mm512_cvtpd_ps(v0));
+    _mm256_storeu_ps(vs + 8, _mm512_cvtpd_ps(v1));
+    for (int l=0; l<16; l++) {
+      output[output_stride * (ipoint + l)] = vs[l];
+    }
+  }
+
+  eval_pdf_scalar(ipoint, npoints, read_bins, bins, bin_norm,
+                  output, output_stride);
+}
+
+
+SIMD_TARGET_AVX512
+static void sum_histograms_avx512(const unsigned int* hists, int nhists,
+                                  size_t hist_stride, size_t first,
+                                  size_t last, unsigned int* output) {
+  size_t i = first;
+  for (; i + 16 <= last; i += 16) {
+    __m512i sum = _mm512_setzero_si512();
+    for (int k=0; k<nhists; k++) {
+      sum = _mm512_add_epi32(sum,
+                             _mm512_loadu_si512(hists + k * hist_stride + i));
+    }
+    _mm512_storeu_si512(output + i, sum);
+  }
+
+  sum_histograms_scalar(hists, nhists, hist_stride, i, last, output);
+}
+
+#pragma GCC diagnostic pop
+
+#endif  // SXMC_SIMD_X86
+
+
+////////////////////////////////////////////////////////////////////////////
+// Dispatch
+
+static Level detect() {
+#ifdef SXMC_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return AVX512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return AVX2;
+  }
+#endif
+  return SCALAR;
+}
+
+
+Level supported() {
+  static const Level level = detect();
+  return level;
+}
+
+
+static Level requested() {
+  Level level = supported();
+
+  const char* env = getenv("SXMC_SIMD");
+  if (env) {
+    std::string s(env);
+    if (s == "scalar" && level > SCALAR) {
+      level = SCALAR;
+    }
+    else if (s == "avx2" && level > AVX2) {
+      level = AVX2;
+    }
+  }
+
+  return level;
+}
+
+
+Level active() {
+  static const Level level = requested();
+  return level;
+}
+
+
+const char* name(Level level) {
+  switch (level) {
+    case AVX512: return "avx512";
+    case AVX2: return "avx2";
+    default: return "scalar";
+  }
+}
+
+
+double nll_event_sum(const float* lut, const int* dataweights,
+                     const double* pars, size_t ne, size_t ns, Level level) {
+  if (level > supported()) {
+    level = supported();
+  }
+
+#ifdef SXMC_SIMD_X86
+  if (level == AVX512) {
+    return nll_event_sum_avx512(lut, dataweights, pars, ne, ns);
+  }
+  if (level == AVX2) {
+    return nll_event_sum_avx2(lut, dataweights, pars, ne, ns);
+  }
+#endif
+
+  return nll_event_sum_scalar(lut, dataweights, pars, ne, ns, 0);
+}
+
+
+void eval_pdf(int npoints, const int* read_bins, const unsigned int* bins,
+              double bin_norm, float* output, int output_stride,
+              Level level) {
+  if (level > supported()) {
+    level = supported();
+  }
+
+#ifdef SXMC_SIMD_X86
+  if (level == AVX512) {
+    eval_pdf_avx512(npoints, read_bins, bins, bin_norm, output,
+                    output_stride);
+    return;
+  }
+  if (level == AVX2) {
+    eval_pdf_avx2(npoints, read_bins, bins, bin_norm, output, output_stride);
+    return;
+  }
+#endif
+
+  eval_pdf_scalar(0, npoints, read_bins, bins, bin_norm, output,
+                  output_stride);
+}
+
+
+void sum_histograms(const unsigned int* hists, int nhists, size_t hist_stride,
+                    size_t first, size_t last, unsigned int* output,
+                    Level level) {
+  if (level > supported()) {
+    level = supported();
+  }
+
+#ifdef SXMC_SIMD_X86
+  if (level == AVX512) {
+    sum_histograms_avx512(hists, nhists, hist_stride, first, last, output);
+    return;
+  }
+  if (level == AVX2) {
+    sum_histograms_avx2(hists, nhists, hist_stride, first, last, output);
+    return;
+  }
+#endif
+
+  sum_histograms_scalar(hists, nhists, hist_stride, first, last, output);
+}
+
+}  // namespace simd
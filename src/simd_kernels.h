@@ -0,0 +1,117 @@
+/**
+ * \file simd_kernels.h
+ * \brief Vectorized host implementations of the hottest CPU-mode kernels
+ *
+ * In CPU builds, the event loop of the NLL and the PDF lookup dominate the
+ * MCMC step time. These functions provide AVX2 and AVX-512 versions of those
+ * loops, and of the merge of per-thread histograms, selected at runtime
+ * according to the features of the CPU, with a scalar fallback that
+ * matches the HEMI kernels exactly.
+ *
+ * The vector paths are compiled with per-function target attributes, so no
+ * special compiler flags are needed and the binary still runs on CPUs
+ * without these instruction sets.
+ */
+
+#ifndef __SIMD_KERNELS_H__
+#define __SIMD_KERNELS_H__
+
+#include <cstddef>
+
+namespace simd {
+
+/**
+ * \enum Level
+ * \brief Instruction set used by the vectorized kernels
+ */
+enum Level {
+  SCALAR = 0,  //!< plain C++, identical to the HEMI kernels
+  AVX2 = 1,  //!< AVX2 + FMA, 4 doubles per vector
+  AVX512 = 2  //!< AVX-512F, 8 doubles per vector
+};
+
+
+/**
+ * Get the best instruction set supported by this CPU.
+ */
+Level supported();
+
+
+/**
+ * Get the instruction set used by default.
+ *
+ * This is supported(), unless lowered with the SXMC_SIMD environment
+ * variable (one of "scalar", "avx2", "avx512").
+ */
+Level active();
+
+
+/**
+ * Get the name of an instruction set level.
+ */
+const char* name(Level level);
+
+
+/**
+ * Compute the event term sum(w_i * log(sum_j(Nj * Pj(xi)))) of the NLL.
+ *
+ * NaN entries in the lookup table (from empty histograms) count as zero.
+ * The vector versions sum in a different order and use their own log, so
+ * results agree with SCALAR to rounding, not bit for bit.
+ *
+ * \param lut Pj(xi) lookup table, one column of ne values per signal
+ * \param dataweights Weight of each event
+ * \param pars Event rates (normalizations) for each signal
+ * \param ne Number of events
+ * \param ns Number of signals
+ * \param level Instruction set to use, capped at supported()
+ * \returns The weighted sum of logs
+ */
+double nll_event_sum(const float* lut, const int* dataweights,
+                     const double* pars, size_t ne, size_t ns,
+                     Level level=active());
+
+
+/**
+ * Look up PDF values for precomputed bin indices.
+ *
+ * Writes bins[read_bins[i]] / bin_norm to output[i * output_stride], or NaN
+ * for points outside the PDF domain (negative bin index). All levels give
+ * bit-identical results.
+ *
+ * \param npoints Number of evaluation points
+ * \param read_bins Bin index of each point
+ * \param bins Histogram contents
+ * \param bin_norm Normalization (total count times bin volume)
+ * \param output Output PDF values
+ * \param output_stride Stride between output values
+ * \param level Instruction set to use, capped at supported()
+ */
+void eval_pdf(int npoints, const int* read_bins, const unsigned int* bins,
+              double bin_norm, float* output, int output_stride,
+              Level level=active());
+
+
+/**
+ * Sum histograms bin by bin.
+ *
+ * Writes sum_k hists[k * hist_stride + i] to output[i], for bins i from
+ * first to last - 1, as when merging per-thread histograms. All levels give
+ * bit-identical results.
+ *
+ * \param hists Histograms, hist_stride apart
+ * \param nhists Number of histograms
+ * \param hist_stride Offset between consecutive histograms
+ * \param first First bin to sum
+ * \param last One past the last bin to sum
+ * \param output Summed histogram
+ * \param level Instruction set to use, capped at supported()
+ */
+void sum_histograms(const unsigned int* hists, int nhists, size_t hist_stride,
+                    size_t first, size_t last, unsigned int* output,
+                    Level level=active());
+
+}  // namespace simd
+
+#endif  // __SIMD_KERNELS_H__
+
@@ -36,6 +36,10 @@
 #include <sxmc/likelihood.h>
 #include <sxmc/plots.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 /**
  * Run an ensemble of independent fake experiments
  *
@@ -43,6 +47,12 @@
  * sensitivity for each, creating a histogram of limits. The estimated
  * sensitivity is the median of the limits of the ensemble.
  *
+ * Up to nparallel experiments run at once on CPU threads, each with its own
+ * copies of the PDFs. The random numbers of each fit depend only on the seed
+ * and the experiment index, not on which worker runs it. Steps which use
+ * ROOT (file output and plotting) are serialized. With
+ * more than one experiment, outputs are prefixed with the experiment index.
+ *
  * \param signals List of Signals defining PDFs, rates, etc.
  * \param systematics List of Systematics applied to PDFs
  * \param observables List of Observables common to PDFs
@@ -53,7 +63,17 @@
  * \param nexperiments Number of fake experiments to run
  * \param live_time Experiment live time in years
  * \param debug_mode If true, accept and save all steps
- * \returns A list of the upper limits
+ * \param output_path Directory to write output files to
+ * \param nchains Number of parallel-tempering chains per fit
+ * \param max_temperature Temperature of the hottest chain
+ * \param swap_interval Steps between chain swap proposals
+ * \param adaptive Use the adaptive Metropolis proposal
+ * \param binned Fit the data histogrammed in the PDF binning, with a binned
+ *               Poisson likelihood
+ * \param nparallel Number of experiments to run concurrently (0 for one per
+ *                  CPU thread)
+ * \param seed Random seed for the fits
+ * \returns A list of the upper limits, in experiment order
  */
 std::vector<float> ensemble(std::vector<Signal>& signals,
                              std::vector<Systematic>& systematics,
@@ -62,7 +82,10 @@ std::vector<float> ensemble(std::vector<Signal>& signals,
                              unsigned steps, float burnin_fraction,
                              float confidence, unsigned nexperiments,
                              float live_time, const bool debug_mode,
-                             std::string output_path) {
+                             std::string output_path, unsigned nchains,
+                             float max_temperature, unsigned swap_interval,
+                             bool adaptive, bool binned, unsigned nparallel,
+                             unsigned long long seed) {
   std::vector<float> limits;
 
   for (size_t i=0;i<signals.size();i++){
@@ -72,42 +95,98 @@ std::vector<float> ensemble(std::vector<Signal>& signals,
     f1.Close();
   }
 
-  for (unsigned i=0; i<nexperiments; i++) {
-    std::cout << "Experiment " << i + 1 << " / " << nexperiments << std::endl;
+#ifdef _OPENMP
+  if (nparallel == 0) {
+    nparallel = omp_get_max_threads();
+  }
+#else
+  nparallel = 1;
+#endif
+  nparallel = std::max(1u, std::min(nparallel, nexperiments));
+
+  // each concurrent worker needs its own pdfs, since fits set evaluation
+  // points and buffers on them
+  std::vector<std::vector<Signal> > worker_signals(nparallel, signals);
+  if (nparallel > 1) {
+    TH1::AddDirectory(false);
+    for (unsigned k=0; k<nparallel; k++) {
+      for (size_t j=0; j<signals.size(); j++) {
+        worker_signals[k][j].histogram = signals[j].histogram->Clone();
+      }
+    }
+  }
+
+  std::vector<std::vector<float> > experiment_limits(nexperiments);
+
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(nparallel) schedule(dynamic, 1)
+#endif
+  for (int i=0; i<(int)nexperiments; i++) {
+    unsigned worker = 0;
+#ifdef _OPENMP
+    worker = omp_get_thread_num();
+#endif
+    std::vector<Signal>& wsignals = worker_signals[worker];
+
+    std::ostringstream prefix;
+    prefix << output_path;
+    if (nexperiments > 1) {
+      prefix << "experiment" << i << "_";
+    }
 
     std::vector<double> params;
     std::vector<std::string> param_names;
-    for (size_t j=0; j<signals.size(); j++) {
-      params.push_back(signals[j].nexpected);
-      param_names.push_back(signals[j].name);
+    for (size_t j=0; j<wsignals.size(); j++) {
+      params.push_back(wsignals[j].nexpected);
+      param_names.push_back(wsignals[j].name);
     }
     for (size_t j=0; j<systematics.size(); j++) {
       params.push_back(systematics[j].mean);
       param_names.push_back(systematics[j].name);
     }
 
+    // one write per line, so lines from concurrent experiments do not mix
+    std::ostringstream started;
+    started << "Experiment " << i + 1 << " / " << nexperiments << "\n";
+    std::cout << started.str() << std::flush;
 
     // Make fake data
     std::pair<std::vector<float>, std::vector<int> > data = \
-      make_fake_dataset(signals, systematics, observables, params, true);
+      make_fake_dataset(wsignals, systematics, observables, params, true,
+                        1e7, seed, i);
+
+    // the likelihood then runs over occupied bins rather than events
+    if (binned) {
+      data = bin_dataset(data.first, data.second, observables);
+    }
 
     // Run MCMC
-    MCMC mcmc(signals, systematics, observables);
-    LikelihoodSpace* ls = mcmc(data.first, data.second, steps, burnin_fraction, debug_mode);
+    MCMC mcmc(wsignals, systematics, observables, seed, i);
+    LikelihoodSpace* ls = mcmc(data.first, data.second, steps, burnin_fraction,
+                               debug_mode, 10000, nchains, max_temperature,
+                               swap_interval, adaptive);
+
+#ifdef _OPENMP
+    #pragma omp critical (sxmc_root)
+#endif
+    {
+      std::cout << "Experiment " << i + 1 << " results:" << std::endl;
 
-    // Write out samples for debugging
-    TFile f((output_path+"lspace.root").c_str(), "recreate");
-    TNtuple* lsclone = (TNtuple*) ls->GetSamples()->Clone("ls");
-    lsclone->Write();
-    lsclone->Delete();
-    f.Close();
+      // Write out samples for debugging
+      TFile f((prefix.str() + "lspace.root").c_str(), "recreate");
+      TNtuple* lsclone = ls->get_ntuple("ls");
+      lsclone->Write();
+      lsclone->Delete();
+      f.Close();
 
-    ls->print_best_fit();
-    ls->print_correlations();
+      ls->print_best_fit();
+      ls->print_correlations();
 
-    // Make spectral plots
-    plot_fit(ls->get_best_fit(), live_time, signals,
-             systematics, observables, data.first, data.second ,output_path);
+      // Make spectral plots
+      plot_fit(ls->get_best_fit(), live_time, wsignals,
+               systematics, observables, data.first, data.second,
+               prefix.str());
+    }
 
     /*
     // Signal sensitivity, Bayesian for now
@@ -122,12 +201,26 @@ std::vector<float> ensemble(std::vector<Signal>& signals,
                   signal_projection->GetBinWidth(bin);
 
     std::cout << "Signal limit: " << limit << std::endl;
-    limits.push_back(limit);
+    experiment_limits[i].push_back(limit);
     */
 
     delete ls;
   }
 
+  // gather results in experiment order
+  for (unsigned i=0; i<nexperiments; i++) {
+    limits.insert(limits.end(), experiment_limits[i].begin(),
+                  experiment_limits[i].end());
+  }
+
+  if (nparallel > 1) {
+    for (unsigned k=0; k<nparallel; k++) {
+      for (size_t j=0; j<signals.size(); j++) {
+        delete worker_signals[k][j].histogram;
+      }
+    }
+  }
+
   return limits;
 }
 
@@ -162,13 +255,22 @@ int main(int argc, char* argv[]) {
   // Load configuration from JSON file
   std::string config_filename = std::string(argv[1]);
   FitConfig fc(config_filename);
+
+  // without a configured seed, draw one so that the run can be repeated
+  if (fc.seed == 0) {
+    fc.seed = gRandom->Integer(2147483647) + 1;
+  }
+  gRandom->SetSeed(fc.seed);
+
   fc.print();
 
   // Run ensemble
   std::vector<float> limits = \
     ensemble(fc.signals, fc.systematics, fc.observables, fc.cuts, fc.steps,
              fc.burnin_fraction, fc.confidence,
-             fc.experiments, fc.live_time, fc.debug_mode, output_path);
+             fc.experiments, fc.live_time, fc.debug_mode, output_path,
+             fc.chains, fc.max_temperature, fc.swap_interval, fc.adaptive,
+             fc.binned, fc.parallel_experiments, fc.seed);
 
 
   /*
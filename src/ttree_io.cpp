@@ -7,6 +7,7 @@
 #include <string>
 #include <unistd.h>
 #include <iostream>
+#include <algorithm>
  
 #include <TFile.h>
 #include <TTree.h>
@@ -15,20 +16,29 @@
 #include <TCollection.h>
 #include <TBranch.h>
 #include <TDataType.h>
+#include <TROOT.h>
+#include <RVersion.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
  
-int read_float_vector_ttree(const std::string &filename,
-                            std::vector<float> &data, 
-                            std::vector<unsigned int> &rank,
-                            std::vector<std::string> &ttree_fields) {
-  TFile *f;
+// Open a root file, with relative paths taken from the working directory
+static TFile* open_ttree_file(const std::string &filename) {
   if (filename.compare(0,1,".") == 0){
     char filePath[256];
     getcwd(filePath, sizeof(filePath));
     printf("FILENAME: %s\n",(std::string(filePath)+filename.substr(1)).c_str());
-    f = TFile::Open((std::string(filePath)+filename.substr(1)).c_str());
-  }else{
-    f = TFile::Open(filename.c_str());
+    return TFile::Open((std::string(filePath)+filename.substr(1)).c_str());
   }
+  return TFile::Open(filename.c_str());
+}
+
+int read_float_vector_ttree(const std::string &filename,
+                            std::vector<float> &data, 
+                            std::vector<unsigned int> &rank,
+                            std::vector<std::string> &ttree_fields) {
+  TFile *f = open_ttree_file(filename);
 
   if (!f){
     std::cout << "Problem opening " << filename << std::endl;
@@ -133,3 +143,177 @@ int read_float_vector_ttree(const std::string &filename,
   f->Close();
   return 0;
 }
+
+
+// A branch read as floats, one entry at a time
+struct FloatBranch {
+  TBranch* branch;
+  EDataType type;
+  union {
+    Int_t i;
+    Float_t f;
+    Double_t d;
+    Bool_t b;
+  } value;
+
+  float get(Long64_t entry) {
+    this->branch->GetEntry(entry);
+    switch (this->type) {
+      case kInt_t: return (float) this->value.i;
+      case kFloat_t: return this->value.f;
+      case kDouble_t: return (float) this->value.d;
+      default: return (float) this->value.b;
+    }
+  }
+};
+
+
+// Read the needed branches of the tree in one file, appending the entries
+// that pass the cuts to data
+static int read_float_columns_ttree_file(const std::string &filename,
+                                         const std::vector<std::string> &fields,
+                                         const std::vector<BranchCut> &cuts,
+                                         std::vector<float> &data,
+                                         size_t &nentries) {
+  TFile *f = open_ttree_file(filename);
+  if (!f){
+    std::cout << "Problem opening " << filename << std::endl;
+    return -1;
+  }
+
+  // get whatever ttree is in there
+  TKey *k = (TKey*) f->GetListOfKeys()->First();
+  TTree *t = (TTree*) f->Get(k->GetName());
+  Long64_t num_entries = t->GetEntries();
+
+  // each branch is read once, even if it is used by several fields and cuts
+  std::vector<std::string> names;
+  std::vector<size_t> field_index;
+  for (size_t i=0;i<fields.size();i++){
+    size_t index = std::find(names.begin(), names.end(), fields[i]) - names.begin();
+    if (index == names.size()){
+      names.push_back(fields[i]);
+    }
+    field_index.push_back(index);
+  }
+  std::vector<const BranchCut*> branch_cuts;
+  std::vector<size_t> cut_index;
+  for (size_t i=0;i<cuts.size();i++){
+    if (t->GetBranch(cuts[i].branch.c_str())){
+      size_t index = std::find(names.begin(), names.end(), cuts[i].branch) - names.begin();
+      if (index == names.size()){
+        names.push_back(cuts[i].branch);
+      }
+      branch_cuts.push_back(&cuts[i]);
+      cut_index.push_back(index);
+    }
+  }
+
+  t->SetBranchStatus("*", 0);
+  t->SetCacheSize(32 * 1024 * 1024);
+  std::vector<FloatBranch> branches(names.size());
+  for (size_t i=0;i<names.size();i++){
+    TBranch *b = t->GetBranch(names[i].c_str());
+    TClass *my_class;
+    EDataType type = kOther_t;
+    if (b){
+      b->GetExpectedType(my_class, type);
+    }
+    if (type != kInt_t && type != kFloat_t &&
+        type != kDouble_t && type != kBool_t){
+      std::cout << "Cannot read branch " << names[i] << " from "
+                << filename << " as float" << std::endl;
+      f->Close();
+      return -1;
+    }
+    t->SetBranchStatus(names[i].c_str(), 1);
+    t->AddBranchToCache(b, true);
+    branches[i].branch = b;
+    branches[i].type = type;
+  }
+  t->StopCacheLearningPhase();
+  for (size_t i=0;i<branches.size();i++){
+    branches[i].branch->SetAddress(&branches[i].value);
+  }
+
+  const size_t nfields = fields.size();
+  std::vector<Long64_t> passed;
+  TTree::TClusterIterator clusters = t->GetClusterIterator(0);
+  Long64_t first;
+  while ((first = clusters()) < num_entries){
+    Long64_t last = std::min(clusters.GetNextEntry(), num_entries);
+
+    // apply the cuts a branch at a time, so each basket is read once
+    passed.clear();
+    for (Long64_t i=first;i<last;i++){
+      passed.push_back(i);
+    }
+    for (size_t j=0;j<branch_cuts.size();j++){
+      FloatBranch &b = branches[cut_index[j]];
+      size_t npassed = 0;
+      for (size_t i=0;i<passed.size();i++){
+        float v = b.get(passed[i]);
+        if (v >= branch_cuts[j]->lower && v <= branch_cuts[j]->upper){
+          passed[npassed++] = passed[i];
+        }
+      }
+      passed.resize(npassed);
+    }
+
+    // then read the output fields of the entries that are left
+    size_t oldsize = data.size();
+    data.resize(oldsize + passed.size() * nfields);
+    for (size_t j=0;j<nfields;j++){
+      for (size_t i=0;i<passed.size();i++){
+        data[oldsize + i*nfields + j] = branches[field_index[j]].get(passed[i]);
+      }
+    }
+  }
+
+  nentries += num_entries;
+  f->Close();
+  return 0;
+}
+
+
+int read_float_columns_ttree(const std::vector<std::string> &filenames,
+                             const std::vector<std::string> &fields,
+                             const std::vector<BranchCut> &cuts,
+                             std::vector<float> &data,
+                             size_t &nentries) {
+  const int nfiles = filenames.size();
+  std::vector<std::vector<float> > file_data(nfiles);
+  std::vector<size_t> file_entries(nfiles, 0);
+  std::vector<int> codes(nfiles, 0);
+
+  // ROOT before 6.06 has no thread-safety switch, and is not safe to use
+  // from several threads at once, including from other callers of this
+  // function
+  int nthreads = 1;
+#if defined(_OPENMP) && ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+  ROOT::EnableThreadSafety();
+  nthreads = std::max(1, std::min(omp_get_max_threads(), nfiles));
+#endif
+
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1)
+#endif
+  for (int i=0;i<nfiles;i++){
+#if defined(_OPENMP) && ROOT_VERSION_CODE < ROOT_VERSION(6,6,0)
+    #pragma omp critical(root_io)
+#endif
+    codes[i] = read_float_columns_ttree_file(filenames[i], fields, cuts,
+                                             file_data[i], file_entries[i]);
+  }
+
+  for (int i=0;i<nfiles;i++){
+    if (codes[i] < 0){
+      return codes[i];
+    }
+    data.insert(data.end(), file_data[i].begin(), file_data[i].end());
+    std::vector<float>().swap(file_data[i]);
+    nentries += file_entries[i];
+  }
+
+  return 0;
+}
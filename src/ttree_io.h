@@ -32,5 +32,41 @@ int read_float_vector_ttree(const std::string &filename,
                             std::vector<unsigned int> &rank,
                             std::vector<std::string> &ttree_fields);
 
+/**
+ * \struct BranchCut
+ *
+ * A range a branch must fall in (inclusive) for its entry to be read
+ */
+struct BranchCut {
+  std::string branch;  //!< Name of the branch
+  double lower;  //!< Lower limit
+  double upper;  //!< Upper limit
+};
+
+/**
+ * Opens root files and reads some branches of the tree in each, keeping
+ * only the entries that pass all of the cuts.
+ *
+ * Only the branches that are needed are activated and cached. Entries are
+ * read a cluster at a time, one branch at a time: first the cut branches,
+ * then the others for just the entries that pass. Cuts on branches that
+ * are not in a tree are ignored. With OpenMP on ROOT 6.06 or later, files
+ * are read in parallel. The output is always in file order. It may be
+ * called from several threads at once; on older ROOT the files are then
+ * read one at a time.
+ *
+ * \param filenames Names of files to read from
+ * \param fields Branches to read, in the order they are stored in data
+ * \param cuts Cuts to apply to each entry
+ * \param data Passing entries are appended to this, row-major
+ * \param nentries Incremented by the number of entries in the trees
+ * \return Status code, negative in case of failure
+ */
+int read_float_columns_ttree(const std::vector<std::string> &filenames,
+                             const std::vector<std::string> &fields,
+                             const std::vector<BranchCut> &cuts,
+                             std::vector<float> &data,
+                             size_t &nentries);
+
 #endif // __TTREE_IO_H__
 
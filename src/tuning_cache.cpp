@@ -0,0 +1,135 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+
+#include <sxmc/tuning_cache.h>
+
+TuningCache::TuningCache(const std::string& _filename) : filename(_filename) {
+  if (this->filename.empty()) {
+    return;
+  }
+
+  std::ifstream f(this->filename.c_str());
+  std::string line;
+  while (std::getline(f, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+
+    // Device names contain spaces, so fields are separated by tabs
+    std::istringstream fields(line);
+    TuningKey key;
+    LaunchConfig config;
+    std::getline(fields, key.device, '\t');
+    fields >> key.nsamples >> key.nbins >> key.nsyst >> key.npoints
+           >> config.bin_nblocks >> config.bin_nthreads_per_block
+           >> config.eval_nblocks >> config.eval_nthreads_per_block;
+    if (!fields) {
+      std::cerr << "TuningCache: Ignoring bad line in " << this->filename
+                << ": " << line << std::endl;
+      continue;
+    }
+
+    this->keys.push_back(key);
+    this->configs.push_back(config);
+  }
+}
+
+
+bool TuningCache::find(const TuningKey& key, LaunchConfig& config) const {
+  // Search backwards, so later entries take precedence
+  for (size_t i=this->keys.size(); i>0; i--) {
+    const TuningKey& k = this->keys[i - 1];
+    if (k.device == key.device && k.nsamples == key.nsamples &&
+        k.nbins == key.nbins && k.nsyst == key.nsyst &&
+        k.npoints == key.npoints) {
+      config = this->configs[i - 1];
+      return true;
+    }
+  }
+  return false;
+}
+
+
+bool TuningCache::predict(const TuningKey& key,
+                          LaunchConfig& config) const {
+  const double max_ratio = log(2.0);
+  double best_distance = -1;
+
+  for (size_t i=this->keys.size(); i>0; i--) {
+    const TuningKey& k = this->keys[i - 1];
+    if (k.device != key.device || k.nsyst != key.nsyst) {
+      continue;
+    }
+
+    double dsamples = fabs(log((k.nsamples + 1.0) / (key.nsamples + 1.0)));
+    double dbins = fabs(log((k.nbins + 1.0) / (key.nbins + 1.0)));
+    double dpoints = fabs(log((k.npoints + 1.0) / (key.npoints + 1.0)));
+    if (dsamples > max_ratio || dbins > max_ratio || dpoints > max_ratio) {
+      continue;
+    }
+
+    double distance = dsamples + dbins + dpoints;
+    if (best_distance < 0 || distance < best_distance) {
+      best_distance = distance;
+      config = this->configs[i - 1];
+    }
+  }
+
+  return best_distance >= 0;
+}
+
+
+void TuningCache::insert(const TuningKey& key, const LaunchConfig& config) {
+  this->keys.push_back(key);
+  this->configs.push_back(config);
+
+  if (this->filename.empty()) {
+    return;
+  }
+
+  // One short write per entry, so that lines from concurrent jobs do not
+  // interleave
+  std::ostringstream line;
+  line << key.device << "\t" << key.nsamples << "\t" << key.nbins << "\t"
+       << key.nsyst << "\t" << key.npoints << "\t"
+       << config.bin_nblocks << "\t" << config.bin_nthreads_per_block << "\t"
+       << config.eval_nblocks << "\t" << config.eval_nthreads_per_block
+       << "\n";
+
+  std::ofstream f(this->filename.c_str(), std::ios::app);
+  if (!f) {
+    std::cerr << "TuningCache: Cannot write " << this->filename << std::endl;
+    return;
+  }
+  if (f.tellp() == 0) {
+    f << "# device\tnsamples\tnbins\tnsyst\tnpoints\t"
+      << "bin_nblocks\tbin_nthreads\teval_nblocks\teval_nthreads\n";
+  }
+  f << line.str();
+}
+
+
+TuningCache& TuningCache::get_default() {
+  static TuningCache* cache = NULL;
+
+  if (!cache) {
+    std::string filename;
+    const char* env = getenv("SXMC_TUNING_CACHE");
+    const char* home = getenv("HOME");
+    if (env) {
+      filename = env;
+    }
+    else if (home) {
+      filename = std::string(home) + "/.sxmc_tuning_cache";
+    }
+    cache = new TuningCache(filename);
+  }
+
+  return *cache;
+}
+
@@ -0,0 +1,105 @@
+/**
+ * \file tuning_cache.h
+ * \brief Persistent cache of tuned kernel launch configurations
+ */
+
+#ifndef __TUNING_CACHE_H__
+#define __TUNING_CACHE_H__
+
+#include <string>
+#include <vector>
+
+/**
+ * \struct TuningKey
+ * \brief The shape of a PDF evaluation, which determines its best launch
+ */
+struct TuningKey {
+  std::string device;  //!< device name and compute capability
+  int nsamples;  //!< number of samples
+  int nbins;  //!< total number of bins
+  int nsyst;  //!< number of systematics
+  int npoints;  //!< number of evaluation points
+};
+
+
+/**
+ * \struct LaunchConfig
+ * \brief Grid and block sizes for the binning and evaluation kernels
+ */
+struct LaunchConfig {
+  int bin_nblocks;  //!< grid size of the binning kernel
+  int bin_nthreads_per_block;  //!< block size of the binning kernel
+  int eval_nblocks;  //!< grid size of the evaluation kernel
+  int eval_nthreads_per_block;  //!< block size of the evaluation kernel
+};
+
+
+/**
+ * \class TuningCache
+ * \brief Launch configurations found by pdfz::EvalHist::Optimize
+ *
+ * Entries are kept in memory and appended to a tab-separated text file,
+ * one per line, so that later processes on the same device reuse them
+ * instead of tuning again. Concurrent jobs may append to the same file;
+ * if a key appears more than once, the last entry wins.
+ */
+class TuningCache {
+  public:
+    /**
+     * Constructor
+     *
+     * \param _filename File to load and append to, or "" for memory only
+     */
+    TuningCache(const std::string& _filename);
+
+    /**
+     * Look up a configuration tuned for exactly this shape.
+     *
+     * \param key The shape
+     * \param config Set to the cached configuration, if any
+     * \returns True if the shape was found
+     */
+    bool find(const TuningKey& key, LaunchConfig& config) const;
+
+    /**
+     * Predict a configuration for a shape that was not tuned.
+     *
+     * The model is the nearest tuned shape on the same device with the
+     * same number of systematics, by distance in log(nsamples),
+     * log(nbins) and log(npoints), provided each is within a factor of
+     * two. Launch configurations vary slowly with these, so this avoids
+     * tuning each of many similar PDFs.
+     *
+     * \param key The shape
+     * \param config Set to the predicted configuration, if any
+     * \returns True if there is a close enough tuned shape
+     */
+    bool predict(const TuningKey& key, LaunchConfig& config) const;
+
+    /**
+     * Add a tuned configuration, and append it to the file.
+     *
+     * \param key The shape
+     * \param config Its best configuration
+     */
+    void insert(const TuningKey& key, const LaunchConfig& config);
+
+    /** Get the number of entries. */
+    size_t size() const { return this->keys.size(); }
+
+    /**
+     * Get the cache shared by all PDFs in this process.
+     *
+     * Its file is $SXMC_TUNING_CACHE if set (an empty value disables the
+     * file), otherwise ~/.sxmc_tuning_cache.
+     */
+    static TuningCache& get_default();
+
+  protected:
+    std::string filename;  //!< cache file, or "" for none
+    std::vector<TuningKey> keys;  //!< tuned shapes
+    std::vector<LaunchConfig> configs;  //!< configuration for each shape
+};
+
+#endif  // __TUNING_CACHE_H__
+
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <cmath>
 #include <assert.h>
 #include <TCanvas.h>
 #include <TLegend.h>
@@ -10,6 +12,11 @@
 #include <TMath.h>
 
 #include <sxmc/utils.h>
+#include <sxmc/sample_store.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 float get_ntuple_entry(TNtuple* nt, int i, std::string field) {
   float v;
@@ -21,57 +28,139 @@ float get_ntuple_entry(TNtuple* nt, int i, std::string field) {
 }
 
 
-std::vector<float> get_correlation_matrix(TNtuple* nt) {
-  int nentries = nt->GetEntries();
+std::vector<float> get_correlation_matrix(const SampleStore& samples) {
+  long nentries = samples.get_entries();
 
-  // get list of branch names
-  std::vector<std::string> names;
-  for (int i=0; i<nt->GetListOfBranches()->GetEntries(); i++) {
-    std::string name = nt->GetListOfBranches()->At(i)->GetName();
-    if (name == "likelihood") {
+  // get list of parameter columns
+  std::vector<const float*> columns;
+  for (size_t i=0; i<samples.get_ncolumns(); i++) {
+    if (samples.get_names()[i] == "likelihood") {
       continue;
     }
-    names.push_back(name);
+    columns.push_back(samples.get_column(i));
   }
+  size_t npars = columns.size();
 
-  std::vector<float> matrix(names.size() * names.size());
+  // accumulate co-moments over chunks of rows, one chunk per thread
+  int nthreads = 1;
+#ifdef _OPENMP
+  nthreads = std::max(1, std::min(omp_get_max_threads(),
+                                  (int) (nentries / 100000)));
+#endif
+  std::vector<RunningCovariance> partial(nthreads, RunningCovariance(npars));
 
-  // convert the ntuple to a vector, calculating means as we go
-  std::vector<float> table(names.size() * nentries);
-  std::vector<float> means(names.size(), 0);
-  for (int i=0; i<nentries; i++) {
-    for (size_t j=0; j<names.size(); j++) {
-      float v = get_ntuple_entry(nt, i, names.at(j));
-      table.at(j + i * names.size()) = v;
-      means.at(j) += v;
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(nthreads) schedule(static, 1)
+#endif
+  for (int t=0; t<nthreads; t++) {
+    long first = nentries * t / nthreads;
+    long last = nentries * (t + 1) / nthreads;
+    std::vector<float> row(npars);
+    for (long k=first; k<last; k++) {
+      for (size_t j=0; j<npars; j++) {
+        row[j] = columns[j][k];
+      }
+      partial[t].add(&row[0]);
     }
   }
 
-  // sums to means
-  for (size_t i=0; i<names.size(); i++) {
-    means.at(i) /= nentries;
+  for (int t=1; t<nthreads; t++) {
+    partial[0].merge(partial[t]);
   }
 
-  // compute correlations
-  for (size_t i=0; i<names.size(); i++) {
-    for (size_t j=i; j<names.size(); j++) {
-      float t = 0;
-      float dx2 = 0;
-      float dy2 = 0;
-      for (int k=0; k<nentries; k++) {
-        float x1 = table.at(i + k * names.size()) - means.at(i);
-        float x2 = table.at(j + k * names.size()) - means.at(j);
-        t += x1 * x2;
-        dx2 += x1 * x1;
-        dy2 += x2 * x2;
-      }
-      matrix.at(i * names.size() + j) = t / TMath::Sqrt(dx2 * dy2);
+  std::vector<float> matrix(npars * npars);
+  for (size_t i=0; i<npars; i++) {
+    for (size_t j=i; j<npars; j++) {
+      float r = partial[0].correlation(i, j);
+      matrix.at(i * npars + j) = r;
+      matrix.at(j * npars + i) = r;
     }
   }
 
   return matrix;
 }
 
+
+void RunningCovariance::reset(size_t _dim) {
+  this->dim = _dim;
+  this->n = 0;
+  this->means.assign(_dim, 0);
+  this->m2.assign(_dim * _dim, 0);
+  this->delta.assign(_dim, 0);
+  this->delta2.assign(_dim, 0);
+}
+
+
+void RunningCovariance::merge(const RunningCovariance& other) {
+  assert(other.dim == this->dim);
+  if (other.n == 0) {
+    return;
+  }
+
+  double na = this->n;
+  double nb = other.n;
+  double n = na + nb;
+  for (size_t i=0; i<this->dim; i++) {
+    this->delta[i] = other.means[i] - this->means[i];
+  }
+  for (size_t i=0; i<this->dim; i++) {
+    for (size_t j=i; j<this->dim; j++) {
+      this->m2[i * this->dim + j] += \
+        other.m2[i * this->dim + j] +
+        this->delta[i] * this->delta[j] * na * nb / n;
+    }
+  }
+  for (size_t i=0; i<this->dim; i++) {
+    this->means[i] += this->delta[i] * nb / n;
+  }
+  this->n += other.n;
+}
+
+
+double RunningCovariance::correlation(size_t i, size_t j) const {
+  if (i > j) {
+    std::swap(i, j);
+  }
+  return this->m2[i * this->dim + j] /
+         sqrt(this->m2[i * this->dim + i] * this->m2[j * this->dim + j]);
+}
+
+
+double RunningCovariance::covariance(size_t i, size_t j) const {
+  if (this->n < 2) {
+    return 0;
+  }
+  if (i > j) {
+    std::swap(i, j);
+  }
+  return this->m2[i * this->dim + j] / (this->n - 1);
+}
+
+
+bool cholesky_decompose(const std::vector<double>& a, size_t n,
+                        std::vector<double>& l) {
+  l.assign(n * n, 0);
+  for (size_t i=0; i<n; i++) {
+    for (size_t j=0; j<=i; j++) {
+      double sum = a[i * n + j];
+      for (size_t k=0; k<j; k++) {
+        sum -= l[i * n + k] * l[j * n + k];
+      }
+      if (i == j) {
+        if (!(sum > 0)) {
+          return false;
+        }
+        l[i * n + i] = sqrt(sum);
+      }
+      else {
+        l[i * n + j] = sum / l[j * n + j];
+      }
+    }
+  }
+  return true;
+}
+
+
 double LinearInterpolator::operator()(double _x)
 {
     if (_x < x.front() || _x > x.back()){
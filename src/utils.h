@@ -10,6 +10,7 @@
 #include <string>
 
 class TNtuple;
+class SampleStore;
 
 /**
  * A container for a range of values
@@ -33,16 +34,119 @@ float get_ntuple_entry(TNtuple* nt, int i, std::string field);
 
 
 /**
- * Build a correlation matrix for a TNtuple.
+ * Build a correlation matrix for a set of samples.
  *
  * Creates a matrix with Pearson product-moment correlation coefficients
- * computed between pairs of variables in a TNtuple. The matrix expressed
- * as a vector of length (entries x entries). Only the upper half is set.
+ * computed between pairs of parameters, i.e. all columns except the
+ * likelihood. The matrix expressed as a vector of length (entries x
+ * entries), and is symmetric.
  *
- * \param nt The source TNtuple
+ * The co-moments are accumulated in a single pass over the samples, split
+ * across threads for large sample sets.
+ *
+ * \param samples The source samples
  * \returns A correlation matrix as a 1D vector
  */
-std::vector<float> get_correlation_matrix(TNtuple* nt);
+std::vector<float> get_correlation_matrix(const SampleStore& samples);
+
+/**
+ * \class RunningCovariance
+ * \brief Single-pass mean and covariance of a stream of vectors
+ *
+ * Uses Welford's update, which is numerically stable and costs O(d^2) per
+ * sample without storing the samples.
+ */
+class RunningCovariance {
+  public:
+    /**
+     * Constructor
+     *
+     * \param _dim Dimension of the sample vectors
+     */
+    RunningCovariance(size_t _dim=0) { reset(_dim); }
+
+    /**
+     * Discard all samples and set the dimension.
+     *
+     * \param _dim Dimension of the sample vectors
+     */
+    void reset(size_t _dim);
+
+    /**
+     * Add a sample.
+     *
+     * \param x Sample vector, of length dimension()
+     */
+    template <class T>
+    void add(const T* x) {
+      this->n++;
+      for (size_t i=0; i<this->dim; i++) {
+        this->delta[i] = x[i] - this->means[i];
+        this->means[i] += this->delta[i] / this->n;
+      }
+      // upper triangle only, using the updated means
+      for (size_t j=0; j<this->dim; j++) {
+        this->delta2[j] = x[j] - this->means[j];
+      }
+      for (size_t i=0; i<this->dim; i++) {
+        const double di = this->delta[i];
+        double* row = &this->m2[i * this->dim];
+        const double* d2 = &this->delta2[0];
+#ifdef _OPENMP
+        #pragma omp simd
+#endif
+        for (size_t j=i; j<this->dim; j++) {
+          row[j] += di * d2[j];
+        }
+      }
+    }
+
+    /**
+     * Add all samples accumulated by another instance.
+     *
+     * Uses the pairwise update of Chan et al., so partial results computed
+     * in parallel can be combined.
+     *
+     * \param other Accumulator with the same dimension
+     */
+    void merge(const RunningCovariance& other);
+
+    /** Get the dimension of the sample vectors */
+    size_t dimension() const { return this->dim; }
+
+    /** Get the number of samples added */
+    unsigned long entries() const { return this->n; }
+
+    /** Get the mean of component i */
+    double mean(size_t i) const { return this->means[i]; }
+
+    /** Get the sample covariance of components i and j */
+    double covariance(size_t i, size_t j) const;
+
+    /** Get the Pearson correlation coefficient of components i and j */
+    double correlation(size_t i, size_t j) const;
+
+  protected:
+    size_t dim;  //!< dimension of the sample vectors
+    unsigned long n;  //!< number of samples
+    std::vector<double> means;  //!< running means
+    std::vector<double> m2;  //!< sums of products of deviations (upper)
+    std::vector<double> delta;  //!< scratch space for the update
+    std::vector<double> delta2;  //!< scratch space for the update
+};
+
+
+/**
+ * Cholesky decomposition of a symmetric positive-definite matrix.
+ *
+ * \param a Matrix (n x n, row major); only the lower triangle is read
+ * \param n Dimension of the matrix
+ * \param l Output lower-triangular factor with a = l * l^T (n x n, row major)
+ * \returns False if the matrix is not positive definite
+ */
+bool cholesky_decompose(const std::vector<double>& a, size_t n,
+                        std::vector<double>& l);
+
 
 class LinearInterpolator{
   public:
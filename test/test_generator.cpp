@@ -0,0 +1,48 @@
+#include <gtest/gtest.h>
+#include "generator.h"
+
+#include <vector>
+
+TEST(BinDataset, Counts2D)
+{
+    std::vector<Observable> observables(2);
+    observables[0].field_index = 0;
+    observables[0].bins = 2;
+    observables[0].lower = 0;
+    observables[0].upper = 1;
+    observables[1].field_index = 1;
+    observables[1].bins = 4;
+    observables[1].lower = -2;
+    observables[1].upper = 2;
+
+    float events[] = {
+        0.1, -1.5,  // bin (0, 0)
+        0.2, -1.9,  // bin (0, 0)
+        0.9,  1.5,  // bin (1, 3)
+        0.6,  0.0,  // bin (1, 2)
+        1.0,  0.0,  // out of range
+        0.5, -2.5,  // out of range
+    };
+    int w[] = {1, 2, 5, 1, 1, 1};
+    std::vector<float> data(events, events + 12);
+    std::vector<int> weights(w, w + 6);
+
+    std::pair<std::vector<float>, std::vector<int> > binned = \
+        bin_dataset(data, weights, observables);
+
+    // occupied bins in bin order, at their centers
+    ASSERT_EQ((size_t) 3, binned.second.size());
+    ASSERT_EQ((size_t) 6, binned.first.size());
+
+    EXPECT_EQ(3, binned.second[0]);
+    EXPECT_FLOAT_EQ(0.25, binned.first[0]);
+    EXPECT_FLOAT_EQ(-1.5, binned.first[1]);
+
+    EXPECT_EQ(1, binned.second[1]);
+    EXPECT_FLOAT_EQ(0.75, binned.first[2]);
+    EXPECT_FLOAT_EQ(0.5, binned.first[3]);
+
+    EXPECT_EQ(5, binned.second[2]);
+    EXPECT_FLOAT_EQ(0.75, binned.first[4]);
+    EXPECT_FLOAT_EQ(1.5, binned.first[5]);
+}
@@ -71,3 +71,104 @@ TEST(HDF5IO, ReadWrite2D)
         for (unsigned int icol=0; icol < test_rank[1]; icol++)
             EXPECT_EQ(2 * irow + icol, a[irow * test_rank[1] + icol]);
 }
+
+TEST(HDF5IO, ReadColumns)
+{
+    const unsigned int rows = 1000;
+    const unsigned int cols = 5;
+
+    std::vector<float> a(rows * cols);
+    for (unsigned int irow=0; irow < rows; irow++)
+        for (unsigned int icol=0; icol < cols; icol++)
+            a[irow * cols + icol] = irow + 0.1 * icol;
+
+    std::vector<unsigned int> rank(2);
+    rank[0] = rows;
+    rank[1] = cols;
+
+    std::string filename("/tmp/sxmc_test_columns.hdf5");
+    std::string dataset("/a");
+
+    ASSERT_TRUE(write_float_vector_hdf5(filename, dataset, a, rank) >= 0);
+
+    ///////
+
+    // Columns out of order, and a cut on a column that is not read
+    std::vector<unsigned int> columns;
+    columns.push_back(3);
+    columns.push_back(1);
+    columns.push_back(2);
+
+    std::vector<ColumnCut> cuts(1);
+    cuts[0].column = 0;
+    cuts[0].lower = 100;
+    cuts[0].upper = 899;
+
+    // Chunks that do not divide the rows evenly
+    std::vector<float> test_a(1, -1);
+    size_t nrows = 1;
+    ASSERT_TRUE(read_float_columns_hdf5(filename, dataset, columns, cuts,
+                                        test_a, nrows, 64) >= 0);
+
+    EXPECT_EQ(rows + 1, nrows);
+    ASSERT_EQ(1 + 800 * columns.size(), test_a.size());
+    EXPECT_EQ(-1, test_a[0]);
+    for (unsigned int i=0; i < 800; i++)
+        for (unsigned int j=0; j < columns.size(); j++)
+            EXPECT_FLOAT_EQ(i + 100 + 0.1 * columns[j], test_a[1 + i * columns.size() + j]);
+
+    // Column out of range
+    columns.push_back(cols);
+    EXPECT_TRUE(read_float_columns_hdf5(filename, dataset, columns, cuts,
+                                        test_a, nrows) < 0);
+}
+
+TEST(HDF5IO, ReadColumnsConcurrently)
+{
+    const unsigned int rows = 5000;
+    const unsigned int cols = 3;
+
+    std::vector<float> a(rows * cols);
+    for (unsigned int i=0; i < a.size(); i++)
+        a[i] = i;
+
+    std::vector<unsigned int> rank(2);
+    rank[0] = rows;
+    rank[1] = cols;
+
+    std::string filename("/tmp/sxmc_test_columns_concurrent.hdf5");
+    std::string dataset("/a");
+
+    ASSERT_TRUE(write_float_vector_hdf5(filename, dataset, a, rank) >= 0);
+
+    ///////
+
+    // Several threads read the file at once, as when signals are loaded
+    // in parallel
+    std::vector<unsigned int> columns;
+    columns.push_back(2);
+    columns.push_back(0);
+
+    const int nreaders = 8;
+    std::vector<std::vector<float> > test_a(nreaders);
+    std::vector<size_t> nrows(nreaders, 0);
+    std::vector<int> codes(nreaders, 0);
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for (int i=0; i < nreaders; i++) {
+        codes[i] = read_float_columns_hdf5(filename, dataset, columns,
+                                           std::vector<ColumnCut>(),
+                                           test_a[i], nrows[i], 128);
+    }
+
+    for (int i=0; i < nreaders; i++) {
+        ASSERT_TRUE(codes[i] >= 0);
+        EXPECT_EQ(rows, nrows[i]);
+        ASSERT_EQ(rows * columns.size(), test_a[i].size());
+        for (unsigned int irow=0; irow < rows; irow++)
+            for (unsigned int j=0; j < columns.size(); j++)
+                EXPECT_EQ(a[irow * cols + columns[j]], test_a[i][irow * columns.size() + j]);
+    }
+}
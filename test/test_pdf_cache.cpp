@@ -0,0 +1,101 @@
+#include <gtest/gtest.h>
+#include "pdf_cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+TEST(PDFCache, StoreLoad)
+{
+    std::string directory("/tmp");
+    PDFCache cache(directory);
+    ASSERT_TRUE(cache.enabled());
+
+    PDFCacheKey key;
+    key.add("sxmc_test_pdf_cache");
+    key.add(0.1);
+
+    PDFCacheEntry entry;
+    entry.nfields = 3;
+    entry.column_major = false;
+    for (int i=0; i < 7; i++) {
+        for (int j=0; j < 3; j++)
+            entry.samples.push_back(i + 0.25 * j);
+        entry.weights.push_back(i + 1);
+    }
+    entry.nevents_physical = 100;
+    entry.nevents = 7;
+    entry.nexpected = 12.5;
+    entry.efficiency = 0.07;
+    ASSERT_TRUE(cache.store(key, entry));
+
+    PDFCacheEntry test_entry;
+    ASSERT_TRUE(cache.load(key, test_entry));
+    EXPECT_EQ(entry.nfields, test_entry.nfields);
+    EXPECT_EQ(entry.column_major, test_entry.column_major);
+    EXPECT_EQ(entry.samples, test_entry.samples);
+    EXPECT_EQ(entry.weights, test_entry.weights);
+    EXPECT_EQ(entry.nevents_physical, test_entry.nevents_physical);
+    EXPECT_EQ(entry.nevents, test_entry.nevents);
+    EXPECT_EQ(entry.nexpected, test_entry.nexpected);
+    EXPECT_EQ(entry.efficiency, test_entry.efficiency);
+
+    // Mapped in place
+    PDFCacheEntry mapped_entry;
+    const float *samples;
+    const int *weights;
+    size_t nsamples;
+    ASSERT_TRUE(cache.map(key, mapped_entry, samples, weights, nsamples));
+    ASSERT_EQ(entry.weights.size(), nsamples);
+    EXPECT_TRUE(std::equal(entry.samples.begin(), entry.samples.end(), samples));
+    EXPECT_TRUE(std::equal(entry.weights.begin(), entry.weights.end(), weights));
+    EXPECT_EQ(entry.nevents_physical, mapped_entry.nevents_physical);
+
+    // Any change to the key is a miss
+    PDFCacheKey other_key;
+    other_key.add("sxmc_test_pdf_cache");
+    other_key.add(0.1f);
+    EXPECT_FALSE(cache.load(other_key, test_entry));
+
+    remove((directory + "/" + key.hash() + ".pdf").c_str());
+    EXPECT_FALSE(cache.load(key, test_entry));
+}
+
+TEST(PDFCache, FileIdentity)
+{
+    std::string filename("/tmp/sxmc_test_pdf_cache_input");
+    {
+        std::ofstream f(filename.c_str());
+        f << "abc";
+    }
+    PDFCacheKey key;
+    key.add_file(filename);
+
+    {
+        std::ofstream f(filename.c_str(), std::ios::app);
+        f << "def";
+    }
+    PDFCacheKey changed_key;
+    changed_key.add_file(filename);
+
+    EXPECT_NE(key.str(), changed_key.str());
+    EXPECT_NE(key.hash(), changed_key.hash());
+
+    remove(filename.c_str());
+}
+
+TEST(PDFCache, Disabled)
+{
+    PDFCache cache("");
+    EXPECT_FALSE(cache.enabled());
+
+    PDFCacheKey key;
+    key.add("x");
+    PDFCacheEntry entry;
+    entry.nfields = 1;
+    entry.column_major = false;
+    EXPECT_FALSE(cache.store(key, entry));
+    EXPECT_FALSE(cache.load(key, entry));
+}
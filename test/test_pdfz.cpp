@@ -1,4 +1,5 @@
 #include "test_pdfz_fixtures.h"
+#include "rng.h"
 
 #include <cmath>
 
@@ -41,36 +42,65 @@ TEST(SystematicObjects, ResolutionScaleSystematicConstructor)
 
 TEST_F(EvalHistConstructor, WrongSampleSize)
 {
-    ASSERT_THROW(pdfz::EvalHist(samples, 2 /* nfields */, nobservables, lower, upper, nbins), pdfz::Error);
+    ASSERT_THROW(pdfz::EvalHist(samples, weights, 2 /* nfields */, nobservables, lower, upper, nbins), pdfz::Error);
 }
 
 TEST_F(EvalHistConstructor, NobsLargerThanNfields)
 {
-    ASSERT_THROW(pdfz::EvalHist(samples, nfields , 7 /* nobservables */, lower, upper, nbins), pdfz::Error);
+    ASSERT_THROW(pdfz::EvalHist(samples, weights, nfields , 7 /* nobservables */, lower, upper, nbins), pdfz::Error);
 }
 
 TEST_F(EvalHistConstructor, WrongLowerSize)
 {
     lower.resize(2);
-    ASSERT_THROW(pdfz::EvalHist(samples, nfields, nobservables, lower, upper, nbins), pdfz::Error);
+    ASSERT_THROW(pdfz::EvalHist(samples, weights, nfields, nobservables, lower, upper, nbins), pdfz::Error);
 }
 
 TEST_F(EvalHistConstructor, WrongUpperSize)
 {
     upper.resize(2);
-    ASSERT_THROW(pdfz::EvalHist(samples, nfields, nobservables, lower, upper, nbins), pdfz::Error);
+    ASSERT_THROW(pdfz::EvalHist(samples, weights, nfields, nobservables, lower, upper, nbins), pdfz::Error);
 }
 
 TEST_F(EvalHistConstructor, WrongNbinsSize)
 {
     nbins.resize(2);
-    ASSERT_THROW(pdfz::EvalHist(samples, nfields, nobservables, lower, upper, nbins), pdfz::Error);
+    ASSERT_THROW(pdfz::EvalHist(samples, weights, nfields, nobservables, lower, upper, nbins), pdfz::Error);
 }
 
 TEST_F(EvalHistConstructor, ZeroBins)
 {
     nbins[0] = 0;
-    ASSERT_THROW(pdfz::EvalHist(samples, nfields, nobservables, lower, upper, nbins), pdfz::Error);
+    ASSERT_THROW(pdfz::EvalHist(samples, weights, nfields, nobservables, lower, upper, nbins), pdfz::Error);
+}
+
+TEST_F(EvalHistConstructor, ManyFields)
+{
+    // Extra fields are not limited; the last one is the true value for a
+    // resolution systematic, as in EvalResolutionScaleSystematics.PosScale
+    const int many_nfields = 16;
+    std::vector<float> many_samples;
+    for (size_t i=0; i < samples.size(); i++) {
+        many_samples.push_back(samples[i]);
+        for (int ifield=1; ifield < many_nfields - 1; ifield++)
+            many_samples.push_back(100.0 + ifield);
+        many_samples.push_back(0.7);
+    }
+
+    hemi::Array<unsigned int> norm(1, true);
+    hemi::Array<double> params(1, true);
+    params.writeOnlyHostPtr()[0] = 0.30;
+
+    pdfz::EvalHist evaluator(many_samples, weights, many_nfields, nobservables, lower, upper, nbins);
+    evaluator.SetNormalizationBuffer(&norm);
+    evaluator.SetParameterBuffer(&params);
+    evaluator.AddSystematic(pdfz::ResolutionScaleSystematic(0, many_nfields - 1, 0));
+
+    TH1 *hist = evaluator.CreateHistogram();
+    EXPECT_EQ((unsigned int) 4, *norm.readOnlyHostPtr());
+    EXPECT_FLOAT_EQ(2.0, hist->GetBinContent(1));
+    EXPECT_FLOAT_EQ(0.0, hist->GetBinContent(2));
+    delete hist;
 }
 
 ///////////////
@@ -125,6 +155,54 @@ TEST_F(EvalHistMethods, EvaluationOffsetStride)
     ASSERT_TRUE(isnan(results[13]));
 }
 
+TEST_F(EvalHistMethods, EvaluationManySamples)
+{
+    // Enough samples to shard across worker threads in CPU builds
+    const int nsamples = 400000;
+    std::vector<float> many_samples(nsamples);
+    std::vector<int> many_weights(nsamples, 1);
+    for (int i=0; i < nsamples; i++) {
+        // 3/4 of samples in the lower bin, 1/4 in the upper bin, and every
+        // tenth sample outside the PDF domain
+        if (i % 10 == 0)
+            many_samples[i] = 1.5;
+        else if (i % 4 == 0)
+            many_samples[i] = 0.75;
+        else
+            many_samples[i] = 0.25;
+    }
+
+    pdfz::EvalHist many(many_samples, many_weights, nfields, nobservables, lower, upper, nbins);
+    many.SetEvalPoints(eval_points);
+    many.SetPDFValueBuffer(pdf_values);
+    many.SetNormalizationBuffer(norm);
+    many.SetParameterBuffer(params);
+    many.EvalAsync();
+    many.EvalFinished();
+
+    // i % 10 == 0 -> out of range; of the rest, i % 4 == 0 -> upper bin
+    unsigned int nupper = 0;
+    unsigned int nlower = 0;
+    for (int i=0; i < nsamples; i++) {
+        if (i % 10 == 0)
+            continue;
+        if (i % 4 == 0)
+            nupper++;
+        else
+            nlower++;
+    }
+
+    EXPECT_EQ(nupper + nlower, *norm->readOnlyHostPtr());
+
+    float *results = pdf_values->hostPtr();
+    ASSERT_TRUE(isnan(results[0]));
+    ASSERT_FLOAT_EQ(2.0 * nlower / (nupper + nlower), results[1]);
+    ASSERT_FLOAT_EQ(2.0 * nlower / (nupper + nlower), results[2]);
+    ASSERT_FLOAT_EQ(2.0 * nupper / (nupper + nlower), results[3]);
+    ASSERT_FLOAT_EQ(2.0 * nupper / (nupper + nlower), results[4]);
+    ASSERT_TRUE(isnan(results[5]));
+}
+
 TEST_F(EvalHistMethods, CreateHistogram1D)
 {
     evaluator->SetNormalizationBuffer(norm);
@@ -139,3 +217,109 @@ TEST_F(EvalHistMethods, CreateHistogram1D)
 
     delete hist;
 }
+
+TEST_F(EvalHistMethods, RandomSampleBounds)
+{
+    // the bounds cut both bins in half, leaving 2 : 0.5 of the content
+    std::vector<float> events;
+    std::vector<int> eventweights;
+    std::vector<double> syst_vals;
+    std::vector<float> lowers(1, 0.25);
+    std::vector<float> uppers(1, 0.75);
+    RNGState rng;
+    rng_init(&rng, 1234, 0, 0, 0);
+
+    const int n = 100000;
+    int observed = evaluator->RandomSample(events, eventweights, n, syst_vals, uppers, lowers, false, 1e7, &rng);
+
+    EXPECT_EQ(n, observed);
+    ASSERT_EQ((size_t) n, events.size());
+    ASSERT_EQ((size_t) n, eventweights.size());
+
+    int nlow = 0;
+    for (int i=0; i < n; i++) {
+        ASSERT_GE(events[i], 0.25);
+        ASSERT_LE(events[i], 0.75);
+        ASSERT_EQ(1, eventweights[i]);
+        if (events[i] < 0.5)
+            nlow++;
+    }
+    EXPECT_NEAR(0.8, 1.0 * nlow / n, 0.01);
+}
+
+TEST_F(EvalHistMethods, RandomSampleReproducible)
+{
+    std::vector<float> events1, events2;
+    std::vector<int> weights1, weights2;
+    RNGState rng1, rng2;
+    rng_init(&rng1, 42, 7, 0, 0);
+    rng_init(&rng2, 42, 7, 0, 0);
+
+    evaluator->RandomSample(events1, weights1, 1000, true, 1e7, &rng1);
+    evaluator->RandomSample(events2, weights2, 1000, true, 1e7, &rng2);
+    EXPECT_EQ(events1, events2);
+
+    // the generator has moved on, so the next draw is different
+    std::vector<float> events3;
+    std::vector<int> weights3;
+    evaluator->RandomSample(events3, weights3, 1000, true, 1e7, &rng1);
+    EXPECT_NE(events1, events3);
+}
+
+TEST_F(EvalHistMethods, RandomSampleWeighted)
+{
+    std::vector<float> events;
+    std::vector<int> eventweights;
+    RNGState rng;
+    rng_init(&rng, 99, 0, 0, 0);
+
+    const int n = 100000;
+    int observed = evaluator->RandomSample(events, eventweights, n, false, 1000, &rng);
+
+    EXPECT_EQ(n, observed);
+    EXPECT_LT(events.size(), (size_t) n / 10);
+    ASSERT_EQ(events.size(), eventweights.size());
+
+    long total = 0;
+    for (size_t i=0; i < eventweights.size(); i++) {
+        ASSERT_GE(eventweights[i], 1);
+        total += eventweights[i];
+    }
+    EXPECT_EQ(n, total);
+}
+
+TEST_F(EvalHistMethods, BinnedSample)
+{
+    // one pseudo-event per bin, carrying a Poisson count
+    std::vector<float> events;
+    std::vector<int> eventweights;
+    std::vector<double> syst_vals;
+    std::vector<float> lowers(1, 0.25);
+    std::vector<float> uppers(1, 0.75);
+    RNGState rng;
+    rng_init(&rng, 5678, 0, 0, 0);
+
+    const int n = 1000000;
+    int observed = evaluator->BinnedSample(events, eventweights, n, syst_vals, uppers, lowers, 2, &rng);
+
+    ASSERT_EQ((size_t) 2, events.size());
+    ASSERT_EQ((size_t) 2, eventweights.size());
+    EXPECT_NEAR(n, observed, 5 * sqrt(n));
+    EXPECT_EQ(observed, eventweights[0] + eventweights[1]);
+
+    EXPECT_GE(events[0], 0.25);
+    EXPECT_LT(events[0], 0.5);
+    EXPECT_GE(events[1], 0.5);
+    EXPECT_LE(events[1], 0.75);
+    EXPECT_NEAR(0.8, 1.0 * eventweights[0] / observed, 0.01);
+
+    // a larger cap splits each bin's count among more events
+    std::vector<float> events2;
+    std::vector<int> eventweights2;
+    observed = evaluator->BinnedSample(events2, eventweights2, n, syst_vals, uppers, lowers, 200, &rng);
+    ASSERT_EQ((size_t) 200, eventweights2.size());
+    long total = 0;
+    for (size_t i=0; i < eventweights2.size(); i++)
+        total += eventweights2[i];
+    EXPECT_EQ(observed, total);
+}
@@ -25,12 +25,15 @@ protected:
 
     nbins.resize(1);
     nbins[0] = 2;
+
+    weights.resize(7, 1);
   }
 
   // virtual void TearDown() {}
   int nobservables;
   int nfields;
   std::vector<float> samples;
+  std::vector<int> weights;
   std::vector<double> lower;
   std::vector<double> upper;
   std::vector<int> nbins;
@@ -40,7 +43,7 @@ class EvalHistMethods : public EvalHistConstructor {
 protected:
     virtual void SetUp() {
         EvalHistConstructor::SetUp();
-        evaluator = new pdfz::EvalHist(samples, nfields, nobservables, lower, upper, nbins);
+        evaluator = new pdfz::EvalHist(samples, weights, nfields, nobservables, lower, upper, nbins);
         eval_points.resize(6);
         eval_points[0] = -0.1;
         eval_points[1] = 0.0;
@@ -0,0 +1,230 @@
+#include <gtest/gtest.h>
+#include "pdfz.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+class EvalKernelMethods : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        nobservables = 1;
+        nfields = 1;
+
+        // standard normal samples, some outside the domain
+        srand(2468);
+        samples.resize(20000);
+        for (size_t i=0; i < samples.size(); i += 2) {
+            double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+            double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+            samples[i] = sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+            samples[i + 1] = sqrt(-2 * log(u1)) * sin(2 * M_PI * u2);
+        }
+
+        lower.resize(1, -3.0);
+        upper.resize(1, 3.0);
+        bandwidth_scale.resize(1, 1.0);
+
+        evaluator = new pdfz::EvalKernel(samples, nfields, nobservables, lower, upper, bandwidth_scale);
+
+        neval_points = 600;
+        for (int i=0; i < neval_points; i++)
+            eval_points.push_back(-3.0 + 6.0 * (i + 0.5) / neval_points);
+
+        pdf_values = new hemi::Array<float>(neval_points, true);
+        norm = new hemi::Array<unsigned int>(1, true);
+        params = new hemi::Array<double>(1, true);
+        params->writeOnlyHostPtr()[0] = 0.0;
+
+        evaluator->SetEvalPoints(eval_points);
+        evaluator->SetPDFValueBuffer(pdf_values);
+        evaluator->SetNormalizationBuffer(norm);
+        evaluator->SetParameterBuffer(params);
+    }
+
+    virtual void TearDown() {
+        delete evaluator;
+        delete pdf_values;
+        delete norm;
+        delete params;
+    }
+
+    // Sum of the kernels of every sample, without the grid
+    double BruteForce(double x, double shift) {
+        double h = evaluator->GetBandwidth()[0];
+        double sum = 0;
+        int n = 0;
+        for (size_t i=0; i < samples.size(); i++) {
+            double s = samples[i] + shift;
+            if (s < lower[0] || s >= upper[0])
+                continue;
+            n++;
+            double lo = std::max(-1.0, (lower[0] - s) / h);
+            double hi = std::min(1.0, (upper[0] - s) / h);
+            double inside = 0.25 * (3 * hi - hi * hi * hi) - 0.25 * (3 * lo - lo * lo * lo);
+            double u = (x - s) / h;
+            if (fabs(u) < 1)
+                sum += 0.75 * (1 - u * u) / h / inside;
+        }
+        return sum / n;
+    }
+
+    int nobservables;
+    int nfields;
+    int neval_points;
+    std::vector<float> samples;
+    std::vector<double> lower;
+    std::vector<double> upper;
+    std::vector<double> bandwidth_scale;
+    std::vector<float> eval_points;
+    pdfz::EvalKernel *evaluator;
+    hemi::Array<float> *pdf_values;
+    hemi::Array<unsigned int> *norm;
+    hemi::Array<double> *params;
+};
+
+TEST_F(EvalKernelMethods, Bandwidth)
+{
+    // Scott's rule for sigma ~ 1, as an Epanechnikov half-width
+    double h = evaluator->GetBandwidth()[0];
+    EXPECT_NEAR(2.214 * pow(samples.size(), -0.2), h, 0.05 * h);
+
+    std::vector<double> scale(1, 0.5);
+    pdfz::EvalKernel narrow(samples, nfields, nobservables, lower, upper, scale);
+    EXPECT_DOUBLE_EQ(0.5 * h, narrow.GetBandwidth()[0]);
+
+    EXPECT_THROW(pdfz::EvalKernel(samples, nfields, nobservables, lower, upper,
+                                  std::vector<double>(2, 1.0)), pdfz::Error);
+}
+
+TEST_F(EvalKernelMethods, Evaluation)
+{
+    evaluator->EvalAsync();
+    evaluator->EvalFinished();
+
+    unsigned int ninside = 0;
+    for (size_t i=0; i < samples.size(); i++)
+        if (samples[i] >= -3 && samples[i] < 3)
+            ninside++;
+    EXPECT_EQ(ninside, *norm->readOnlyHostPtr());
+
+    // the grid only skips samples with no support at the point
+    const float *results = pdf_values->readOnlyHostPtr();
+    double integral = 0;
+    for (int i=0; i < neval_points; i++) {
+        EXPECT_NEAR(BruteForce(eval_points[i], 0), results[i], 1e-5);
+        integral += results[i] * 6.0 / neval_points;
+    }
+
+    // normalized within the domain, including the edges
+    EXPECT_NEAR(1.0, integral, 1e-3);
+
+    // smooth estimate of the normal density
+    EXPECT_NEAR(0.3989, results[neval_points / 2], 0.02);
+}
+
+TEST_F(EvalKernelMethods, OutsideDomain)
+{
+    std::vector<float> points(3);
+    points[0] = -3.5;
+    points[1] = 0.0;
+    points[2] = 3.0;
+    evaluator->SetEvalPoints(points);
+    evaluator->EvalAsync();
+    evaluator->EvalFinished();
+
+    const float *results = pdf_values->readOnlyHostPtr();
+    EXPECT_TRUE(std::isnan(results[0]));
+    EXPECT_FALSE(std::isnan(results[1]));
+    EXPECT_TRUE(std::isnan(results[2]));
+}
+
+TEST_F(EvalKernelMethods, ShiftSystematic)
+{
+    evaluator->AddSystematic(pdfz::ShiftSystematic(0, 0));
+    params->writeOnlyHostPtr()[0] = 0.4;
+    evaluator->EvalAsync();
+    evaluator->EvalFinished();
+
+    const float *results = pdf_values->readOnlyHostPtr();
+    for (int i=0; i < neval_points; i += 7)
+        EXPECT_NEAR(BruteForce(eval_points[i], 0.4), results[i], 1e-5);
+}
+
+TEST_F(EvalKernelMethods, Clone)
+{
+    evaluator->AddSystematic(pdfz::ScaleSystematic(0, 0));
+    params->writeOnlyHostPtr()[0] = 0.1;
+    evaluator->EvalAsync();
+    evaluator->EvalFinished();
+    std::vector<float> expected(pdf_values->readOnlyHostPtr(),
+                                pdf_values->readOnlyHostPtr() + neval_points);
+
+    pdfz::Eval *clone = evaluator->Clone();
+    hemi::Array<float> clone_values(neval_points, true);
+    clone->SetEvalPoints(eval_points);
+    clone->SetPDFValueBuffer(&clone_values);
+    clone->SetNormalizationBuffer(norm);
+    clone->SetParameterBuffer(params);
+    clone->EvalAsync();
+    clone->EvalFinished();
+
+    const float *results = clone_values.readOnlyHostPtr();
+    for (int i=0; i < neval_points; i++)
+        EXPECT_FLOAT_EQ(expected[i], results[i]);
+
+    delete clone;
+}
+
+TEST(EvalKernel2D, GridMatchesBruteForce)
+{
+    // correlated 2D samples, with a third field that is not an observable
+    srand(1357);
+    const int nsamples = 5000;
+    std::vector<float> samples(nsamples * 3);
+    for (int i=0; i < nsamples; i++) {
+        float a = 1.0 * rand() / RAND_MAX;
+        float b = 1.0 * rand() / RAND_MAX;
+        samples[i * 3] = a;
+        samples[i * 3 + 1] = 0.5 * (a + b);
+        samples[i * 3 + 2] = 99;
+    }
+    std::vector<double> lower(2, 0.0), upper(2, 1.0), scale(2, 1.0);
+    pdfz::EvalKernel evaluator(samples, 3, 2, lower, upper, scale);
+    std::vector<double> h = evaluator.GetBandwidth();
+
+    std::vector<float> points;
+    for (int i=0; i < 50; i++) {
+        points.push_back(1.0 * rand() / RAND_MAX);
+        points.push_back(1.0 * rand() / RAND_MAX);
+    }
+
+    hemi::Array<float> pdf_values(50, true);
+    hemi::Array<unsigned int> norm(1, true);
+    hemi::Array<double> params(1, true);
+    params.writeOnlyHostPtr()[0] = 0.0;
+    evaluator.SetEvalPoints(points);
+    evaluator.SetPDFValueBuffer(&pdf_values);
+    evaluator.SetNormalizationBuffer(&norm);
+    evaluator.SetParameterBuffer(&params);
+    evaluator.EvalAsync();
+    evaluator.EvalFinished();
+
+    const float *results = pdf_values.readOnlyHostPtr();
+    for (int p=0; p < 50; p++) {
+        double sum = 0;
+        for (int i=0; i < nsamples; i++) {
+            double k = 1;
+            for (int d=0; d < 2; d++) {
+                double s = samples[i * 3 + d];
+                double lo = std::max(-1.0, -s / h[d]);
+                double hi = std::min(1.0, (1 - s) / h[d]);
+                double inside = 0.25 * (3 * hi - hi * hi * hi) - 0.25 * (3 * lo - lo * lo * lo);
+                double u = (points[p * 2 + d] - s) / h[d];
+                k *= (fabs(u) < 1) ? 0.75 * (1 - u * u) / h[d] / inside : 0;
+            }
+            sum += k;
+        }
+        EXPECT_NEAR(sum / nsamples, results[p], 1e-4 * sum / nsamples + 1e-6);
+    }
+}
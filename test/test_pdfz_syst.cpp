@@ -1,5 +1,6 @@
 #include "test_pdfz_fixtures.h"
 #include <cmath>
+#include <algorithm>
 
 #ifndef __CUDACC__
 #define isnan std::isnan
@@ -68,6 +69,34 @@ TEST_F(EvalShiftSystematics, NegShift)
     ASSERT_TRUE(isnan(results[5]));
 }
 
+TEST_F(EvalShiftSystematics, Clone)
+{
+    // the clone keeps the samples and systematics, but not the buffers
+    pdfz::Eval *clone = evaluator->Clone();
+    clone->SetEvalPoints(eval_points);
+    clone->SetPDFValueBuffer(pdf_values);
+    clone->SetNormalizationBuffer(norm);
+    clone->SetParameterBuffer(params);
+    delete evaluator;
+    evaluator = 0;
+
+    params->writeOnlyHostPtr()[0] = -0.25;
+    clone->EvalAsync();
+    clone->EvalFinished();
+
+    EXPECT_EQ((unsigned int) 4, *norm->readOnlyHostPtr());
+
+    float *results = pdf_values->hostPtr();
+    ASSERT_TRUE(isnan(results[0]));
+    ASSERT_FLOAT_EQ(1.5, results[1]);
+    ASSERT_FLOAT_EQ(1.5, results[2]);
+    ASSERT_FLOAT_EQ(0.5, results[3]);
+    ASSERT_FLOAT_EQ(0.5, results[4]);
+    ASSERT_TRUE(isnan(results[5]));
+
+    delete clone;
+}
+
 TEST_F(EvalShiftSystematics, PosShift)
 {
     params->writeOnlyHostPtr()[0] = 0.25;
@@ -172,7 +201,7 @@ protected:
         samples[10] = 1.1; samples[11] = 0.7;
         samples[12] = -0.1; samples[13] = 0.7;
 
-        evaluator = new pdfz::EvalHist(samples, nfields, nobservables, lower, upper, nbins);
+        evaluator = new pdfz::EvalHist(samples, weights, nfields, nobservables, lower, upper, nbins);
         eval_points.resize(6);
         eval_points[0] = -0.1;
         eval_points[1] = 0.0;
@@ -264,4 +293,342 @@ TEST_F(EvalResolutionScaleSystematics, PosScale)
     ASSERT_TRUE(isnan(results[5]));
 }
 
+TEST_F(EvalResolutionScaleSystematics, TrueFieldTransformed)
+{
+    // Field 1 is the true value of observable 0, so may not be shifted
+    ASSERT_THROW(evaluator->AddSystematic(pdfz::ShiftSystematic(1, 1)), pdfz::Error);
+    ASSERT_THROW(evaluator->AddSystematic(pdfz::ResolutionScaleSystematic(0, 0, 1)), pdfz::Error);
+    evaluator->AddSystematic(pdfz::ShiftSystematic(0, 1));
+}
+
+////////////// Specialized shapes
+
+TEST(EvalHistShapes, MatchesReference)
+{
+    // 1-3 observables with 0-3 systematics use specialized loops, and the
+    // rest the generic one; all must bin as computed here.  There are too
+    // many bins for the sorted layout, which would bypass those loops when
+    // only one observable is shifted or scaled.
+    const int nsamples = 2000;
+    const int nbins_per_obs[] = { 0, 128, 12, 6, 4 };
+    srand(31);
+
+    for (int nobs=1; nobs <= 4; nobs++) {
+        const int nbins_obs = nbins_per_obs[nobs];
+        for (int nsyst=0; nsyst <= 4; nsyst++) {
+            // The last field is the true value for resolution systematics
+            const int nfields = nobs + 1;
+            std::vector<float> samples(nsamples * nfields);
+            std::vector<int> weights(nsamples);
+            for (int i=0; i < nsamples; i++) {
+                for (int ifield=0; ifield < nfields; ifield++)
+                    samples[i * nfields + ifield] = -0.2 + 1.4 * rand() / RAND_MAX;
+                weights[i] = 1 + i % 2;
+            }
+
+            std::vector<double> lower(nobs, 0.0);
+            std::vector<double> upper(nobs, 1.0);
+            std::vector<int> nbins(nobs, nbins_obs);
+            int total_nbins = 1;
+            for (int iobs=0; iobs < nobs; iobs++)
+                total_nbins *= nbins_obs;
+
+            hemi::Array<unsigned int> norm(1, true);
+            hemi::Array<double> params(nsyst + 1, true);
+            double *pars = params.writeOnlyHostPtr();
+
+            pdfz::EvalHist evaluator(samples, weights, nfields, nobs, lower, upper, nbins);
+            evaluator.SetNormalizationBuffer(&norm);
+            evaluator.SetParameterBuffer(&params);
+
+            // Cycle through the systematic types and observables
+            for (int isyst=0; isyst < nsyst; isyst++) {
+                const int obs = isyst % nobs;
+                pars[isyst] = 0.05 * (isyst + 1) * (isyst % 2 ? -1 : 1);
+                if (isyst % 3 == 0)
+                    evaluator.AddSystematic(pdfz::ShiftSystematic(obs, isyst));
+                else if (isyst % 3 == 1)
+                    evaluator.AddSystematic(pdfz::ScaleSystematic(obs, isyst));
+                else
+                    evaluator.AddSystematic(pdfz::ResolutionScaleSystematic(obs, nobs, isyst));
+            }
+
+            // Every bin is read back from the histogram
+            std::vector<float> eval_points;
+            for (int ibin=0; ibin < total_nbins; ibin++) {
+                for (int iobs=0, stride=total_nbins / nbins_obs; iobs < nobs; iobs++, stride /= nbins_obs)
+                    eval_points.push_back((ibin / stride % nbins_obs + 0.5) / nbins_obs);
+            }
+            hemi::Array<float> pdf_values(total_nbins, true);
+            evaluator.SetEvalPoints(eval_points);
+            evaluator.SetPDFValueBuffer(&pdf_values);
+            evaluator.EvalAsync();
+            evaluator.EvalFinished();
+            ASSERT_FALSE(evaluator.GetSortedLayout()) << nobs << " obs, " << nsyst << " syst";
+
+            std::vector<unsigned int> expected(total_nbins, 0);
+            unsigned int expected_norm = 0;
+            for (int i=0; i < nsamples; i++) {
+                int bin = 0;
+                bool inside = true;
+                for (int iobs=0; iobs < nobs && inside; iobs++) {
+                    double x = samples[i * nfields + iobs];
+                    for (int isyst=0; isyst < nsyst; isyst++) {
+                        if (isyst % nobs != iobs)
+                            continue;
+                        if (isyst % 3 == 0)
+                            x += pars[isyst];
+                        else if (isyst % 3 == 1)
+                            x *= 1 + pars[isyst];
+                        else
+                            x += pars[isyst] * (x - samples[i * nfields + nobs]);
+                    }
+                    inside = (x >= 0.0 && x < 1.0);
+                    bin = bin * nbins_obs + std::min((int) (x * nbins_obs), nbins_obs - 1);
+                }
+                if (inside) {
+                    expected[bin] += weights[i];
+                    expected_norm += weights[i];
+                }
+            }
+
+            ASSERT_EQ(expected_norm, *norm.readOnlyHostPtr()) << nobs << " obs, " << nsyst << " syst";
+            const double bin_volume = pow(1.0 / nbins_obs, nobs);
+            const float *results = pdf_values.readOnlyHostPtr();
+            for (int ibin=0; ibin < total_nbins; ibin++)
+                EXPECT_FLOAT_EQ(expected[ibin] / (expected_norm * bin_volume), results[ibin])
+                    << nobs << " obs, " << nsyst << " syst, bin " << ibin;
+        }
+    }
+}
+
+////////////// Single precision
+
+TEST(EvalHistSinglePrecision, MatchesDouble)
+{
+    // Random samples with a resolution systematic, which is never sorted;
+    // only samples within float rounding of a bin edge may move
+    const int nsamples = 100000;
+    const int nfields = 3;
+    const int nobs = 2;
+    std::vector<float> samples(nsamples * nfields);
+    std::vector<int> weights(nsamples, 1);
+    srand(23);
+    for (int i=0; i < nsamples; i++) {
+        samples[i * nfields] = -0.2 + 1.4 * rand() / RAND_MAX;
+        samples[i * nfields + 1] = -0.2 + 1.4 * rand() / RAND_MAX;
+        samples[i * nfields + 2] = 0.5;
+    }
+
+    std::vector<double> lower(nobs, 0.0);
+    std::vector<double> upper(nobs, 1.0);
+    std::vector<int> nbins(nobs, 20);
+
+    std::vector<float> eval_points;
+    for (int x=0; x < nbins[0]; x++) {
+        for (int y=0; y < nbins[1]; y++) {
+            eval_points.push_back(0.025 + 0.05 * x);
+            eval_points.push_back(0.025 + 0.05 * y);
+        }
+    }
+    const int npoints = eval_points.size() / nobs;
+
+    hemi::Array<float> pdf_values(2 * npoints, true);
+    hemi::Array<unsigned int> norm(2, true);
+    hemi::Array<double> params(3, true);
+    params.writeOnlyHostPtr()[0] = 0.013;
+    params.hostPtr()[1] = 1.07e-3;
+    params.hostPtr()[2] = 0.21;
+
+    pdfz::EvalHist double_pdf(samples, weights, nfields, nobs, lower, upper, nbins);
+    pdfz::EvalHist single_pdf(samples, weights, nfields, nobs, lower, upper, nbins);
+    single_pdf.SetSinglePrecision(true);
+    EXPECT_FALSE(double_pdf.GetSinglePrecision());
+    EXPECT_TRUE(single_pdf.GetSinglePrecision());
+
+    pdfz::EvalHist *pdfs[2] = {&double_pdf, &single_pdf};
+    for (int i=0; i < 2; i++) {
+        pdfs[i]->SetEvalPoints(eval_points);
+        pdfs[i]->SetPDFValueBuffer(&pdf_values, i * npoints);
+        pdfs[i]->SetNormalizationBuffer(&norm, i);
+        pdfs[i]->SetParameterBuffer(&params);
+        pdfs[i]->AddSystematic(pdfz::ShiftSystematic(0, 0));
+        pdfs[i]->AddSystematic(pdfz::ScaleSystematic(1, 1));
+        pdfs[i]->AddSystematic(pdfz::ResolutionScaleSystematic(1, 2, 2));
+        pdfs[i]->EvalAsync();
+        pdfs[i]->EvalFinished();
+    }
+
+    const unsigned int *norms = norm.readOnlyHostPtr();
+    EXPECT_NEAR(norms[0], norms[1], 5);
+
+    const float *results = pdf_values.readOnlyHostPtr();
+    for (int ipoint=0; ipoint < npoints; ipoint++)
+        EXPECT_NEAR(results[ipoint], results[npoints + ipoint], 0.02 * results[ipoint]) << "point " << ipoint;
+}
+
+////////////// Sorted sample layout
 
+TEST(EvalHistSortedSamples, MatchesDirectBinning)
+{
+    // Enough samples per bin that shifts and scales of observable 1 use the
+    // sorted layout; compare with binning every sample here
+    const int nsamples = 200000;
+    const int nobs = 2;
+    std::vector<float> samples(nsamples * nobs);
+    std::vector<int> weights(nsamples);
+    srand(17);
+    for (int i=0; i < nsamples; i++) {
+        samples[i * nobs] = -0.1 + 1.2 * rand() / RAND_MAX;
+        samples[i * nobs + 1] = -1.5 + 3.0 * rand() / RAND_MAX;
+        weights[i] = 1 + i % 3;
+    }
+
+    std::vector<double> lower(nobs);
+    std::vector<double> upper(nobs);
+    std::vector<int> nbins(nobs);
+    lower[0] = 0.0;
+    upper[0] = 1.0;
+    nbins[0] = 10;
+    lower[1] = -1.0;
+    upper[1] = 1.0;
+    nbins[1] = 20;
+    const double bin_volume = 0.1 * 0.1;
+
+    // One point at the center of each bin
+    std::vector<float> eval_points;
+    for (int x=0; x < nbins[0]; x++) {
+        for (int y=0; y < nbins[1]; y++) {
+            eval_points.push_back(0.05 + 0.1 * x);
+            eval_points.push_back(-0.95 + 0.1 * y);
+        }
+    }
+
+    hemi::Array<float> pdf_values(eval_points.size() / nobs, true);
+    hemi::Array<unsigned int> norm(1, true);
+    hemi::Array<double> params(2, true);
+
+    pdfz::EvalHist evaluator(samples, weights, nobs, nobs, lower, upper, nbins);
+    evaluator.SetEvalPoints(eval_points);
+    evaluator.SetPDFValueBuffer(&pdf_values);
+    evaluator.SetNormalizationBuffer(&norm);
+    evaluator.SetParameterBuffer(&params);
+    evaluator.AddSystematic(pdfz::ShiftSystematic(1, 0));
+    evaluator.AddSystematic(pdfz::ScaleSystematic(1, 1));
+
+    // The last scale reverses the order of the samples
+    const double shifts[] = {0.0, 0.1, -0.3, 0.2};
+    const double scales[] = {0.0, 0.05, -0.2, -1.5};
+
+    for (int iset=0; iset < 4; iset++) {
+        params.writeOnlyHostPtr()[0] = shifts[iset];
+        params.hostPtr()[1] = scales[iset];
+        evaluator.EvalAsync();
+        evaluator.EvalFinished();
+
+        std::vector<unsigned int> expected(nbins[0] * nbins[1], 0);
+        unsigned int expected_norm = 0;
+        for (int i=0; i < nsamples; i++) {
+            double x = samples[i * nobs];
+            double y = samples[i * nobs + 1];
+            y += shifts[iset];
+            y *= 1 + scales[iset];
+            if (x < lower[0] || x >= upper[0] || y < lower[1] || y >= upper[1])
+                continue;
+            int bin = (int)((x - lower[0]) * (nbins[0] / (upper[0] - lower[0]))) * nbins[1] +
+                      (int)((y - lower[1]) * (nbins[1] / (upper[1] - lower[1])));
+            expected[bin] += weights[i];
+            expected_norm += weights[i];
+        }
+
+        EXPECT_EQ(expected_norm, *norm.readOnlyHostPtr()) << "set " << iset;
+
+        const float *results = pdf_values.readOnlyHostPtr();
+        for (size_t ibin=0; ibin < expected.size(); ibin++)
+            EXPECT_FLOAT_EQ(expected[ibin] / (expected_norm * bin_volume), results[ibin])
+                << "set " << iset << " bin " << ibin;
+    }
+}
+
+TEST(EvalHistSharedSamples, MatchesCopy)
+{
+    // Samples saved from one evaluator after it sorted them, and read in
+    // place by another, give the same PDF
+    const int nsamples = 100000;
+    const int nobs = 2;
+    std::vector<float> samples(nsamples * nobs);
+    std::vector<int> weights(nsamples);
+    srand(23);
+    for (int i=0; i < nsamples; i++) {
+        samples[i * nobs] = -0.1 + 1.2 * rand() / RAND_MAX;
+        samples[i * nobs + 1] = -1.5 + 3.0 * rand() / RAND_MAX;
+        weights[i] = 1 + i % 2;
+    }
+
+    std::vector<double> lower(nobs, -1.0);
+    std::vector<double> upper(nobs, 1.0);
+    std::vector<int> nbins(nobs, 10);
+
+    std::vector<float> eval_points;
+    for (int x=0; x < nbins[0]; x++) {
+        for (int y=0; y < nbins[1]; y++) {
+            eval_points.push_back(-0.9 + 0.2 * x);
+            eval_points.push_back(-0.9 + 0.2 * y);
+        }
+    }
+    const size_t npoints = eval_points.size() / nobs;
+
+    hemi::Array<float> pdf_values(npoints, true);
+    hemi::Array<float> shared_pdf_values(npoints, true);
+    hemi::Array<unsigned int> norm(1, true);
+    hemi::Array<unsigned int> shared_norm(1, true);
+    hemi::Array<double> params(1, true);
+    params.writeOnlyHostPtr()[0] = 0.0;
+
+    pdfz::EvalHist evaluator(samples, weights, nobs, nobs, lower, upper, nbins);
+    evaluator.SetEvalPoints(eval_points);
+    evaluator.SetPDFValueBuffer(&pdf_values);
+    evaluator.SetNormalizationBuffer(&norm);
+    evaluator.SetParameterBuffer(&params);
+    evaluator.AddSystematic(pdfz::ShiftSystematic(1, 0));
+    evaluator.EvalAsync();
+    evaluator.EvalFinished();
+
+    std::vector<float> columns;
+    std::vector<int> column_weights;
+    evaluator.GetSamples(columns, column_weights);
+    ASSERT_EQ(samples.size(), columns.size());
+    ASSERT_EQ(weights.size(), column_weights.size());
+    const std::vector<float> saved_columns(columns);
+
+    pdfz::EvalHist shared(&columns.front(), &column_weights.front(), nsamples, nobs, nobs,
+                          lower, upper, nbins);
+    shared.AddSystematic(pdfz::ShiftSystematic(1, 0));
+    pdfz::Eval *clone = shared.Clone();
+
+    pdfz::Eval *evaluators[] = { &shared, clone };
+    const double shifts[] = { 0.0, 0.15, -0.4 };
+    for (int ieval=0; ieval < 2; ieval++) {
+        evaluators[ieval]->SetEvalPoints(eval_points);
+        evaluators[ieval]->SetPDFValueBuffer(&shared_pdf_values);
+        evaluators[ieval]->SetNormalizationBuffer(&shared_norm);
+        evaluators[ieval]->SetParameterBuffer(&params);
+
+        for (int iset=0; iset < 3; iset++) {
+            params.writeOnlyHostPtr()[0] = shifts[iset];
+            evaluator.EvalAsync();
+            evaluator.EvalFinished();
+            evaluators[ieval]->EvalAsync();
+            evaluators[ieval]->EvalFinished();
+
+            EXPECT_EQ(*norm.readOnlyHostPtr(), *shared_norm.readOnlyHostPtr());
+            for (size_t i=0; i < npoints; i++)
+                EXPECT_FLOAT_EQ(pdf_values.readOnlyHostPtr()[i], shared_pdf_values.readOnlyHostPtr()[i])
+                    << "evaluator " << ieval << " set " << iset << " point " << i;
+        }
+    }
+
+    // The shared samples are never written
+    EXPECT_TRUE(saved_columns == columns);
+    delete clone;
+}
@@ -0,0 +1,112 @@
+#include <gtest/gtest.h>
+#include "rng.h"
+
+#include <cmath>
+#include <vector>
+
+TEST(Philox, KnownAnswers)
+{
+    // test vectors from the Random123 distribution
+    unsigned out[4];
+
+    unsigned ctr0[] = {0, 0, 0, 0};
+    unsigned key0[] = {0, 0};
+    philox4x32(ctr0, key0, out);
+    EXPECT_EQ(0x6627e8d5u, out[0]);
+    EXPECT_EQ(0xe169c58du, out[1]);
+    EXPECT_EQ(0xbc57ac4cu, out[2]);
+    EXPECT_EQ(0x9b00dbd8u, out[3]);
+
+    unsigned ctr1[] = {0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff};
+    unsigned key1[] = {0xffffffff, 0xffffffff};
+    philox4x32(ctr1, key1, out);
+    EXPECT_EQ(0x408f276du, out[0]);
+    EXPECT_EQ(0x41c83b0eu, out[1]);
+    EXPECT_EQ(0xa20bc7c6u, out[2]);
+    EXPECT_EQ(0x6d5451fdu, out[3]);
+
+    unsigned ctr2[] = {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344};
+    unsigned key2[] = {0xa4093822, 0x299f31d0};
+    philox4x32(ctr2, key2, out);
+    EXPECT_EQ(0xd16cfe09u, out[0]);
+    EXPECT_EQ(0x94fdccebu, out[1]);
+    EXPECT_EQ(0x5001e420u, out[2]);
+    EXPECT_EQ(0x24126ea1u, out[3]);
+}
+
+TEST(Philox, Reproducible)
+{
+    RNGState a, b, c;
+    rng_init(&a, 42, 3, 1, 7);
+    rng_init(&b, 42, 3, 1, 7);
+    rng_init(&c, 42, 3, 2, 7);  // another chain
+
+    int nsame = 0;
+    for (int i=0; i < 1000; i++) {
+        unsigned x = rng_next(&a);
+        EXPECT_EQ(x, rng_next(&b));
+        if (x == rng_next(&c))
+            nsame++;
+    }
+    EXPECT_EQ(0, nsame);
+}
+
+TEST(Philox, Distributions)
+{
+    RNGState state;
+    rng_init(&state, 1234, 0, 0, 0);
+
+    const int n = 200000;
+    double sum_u = 0, sum_z = 0, sum_z2 = 0;
+    for (int i=0; i < n; i++) {
+        double u = rng_uniform(&state);
+        ASSERT_GT(u, 0.0);
+        ASSERT_LE(u, 1.0);
+        sum_u += u;
+
+        double z = rng_normal(&state);
+        sum_z += z;
+        sum_z2 += z * z;
+    }
+
+    EXPECT_NEAR(0.5, sum_u / n, 0.005);
+    EXPECT_NEAR(0.0, sum_z / n, 0.01);
+    EXPECT_NEAR(1.0, sum_z2 / n, 0.01);
+}
+
+TEST(Philox, SkipCarries)
+{
+    // Skipping past 2^32 blocks carries into the high word of the block
+    // index, and never reaches the next substream
+    RNGState a, b, next;
+    rng_init(&a, 42, 0, 0, 3);
+    rng_init(&b, 42, 0, 0, 3);
+    rng_init(&next, 42, 0, 0, 4);
+
+    const unsigned long long n = (1ull << 32) + 5;
+    rng_skip(&a, n);
+    rng_skip(&b, 0xffffffffull);
+    rng_skip(&b, 6);
+    for (int i=0; i < 16; i++)
+        EXPECT_EQ(rng_next(&a), rng_next(&b));
+
+    rng_skip(&a, 0);
+    EXPECT_EQ(n + 4, a.counter[0] + ((unsigned long long) (a.counter[1] & 0xffff) << 32));
+    EXPECT_EQ(3u, a.counter[1] >> 16);
+
+    // Running off the end of the low word also carries
+    rng_init(&a, 42, 0, 0, 3);
+    rng_skip(&a, 0xffffffffull);
+    rng_next(&a);
+    EXPECT_EQ(0u, a.counter[0]);
+    EXPECT_EQ((3u << 16) + 1, a.counter[1]);
+
+    int nsame = 0;
+    rng_init(&a, 42, 0, 0, 3);
+    rng_skip(&a, 1ull << 32);
+    for (int i=0; i < 100; i++) {
+        if (rng_next(&a) == rng_next(&next))
+            nsame++;
+    }
+    EXPECT_EQ(0, nsame);
+}
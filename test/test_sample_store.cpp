@@ -0,0 +1,71 @@
+#include <gtest/gtest.h>
+#include "sample_store.h"
+
+#include <string>
+#include <vector>
+
+static std::vector<std::string> column_names()
+{
+    std::vector<std::string> names;
+    names.push_back("a");
+    names.push_back("b");
+    names.push_back("likelihood");
+    return names;
+}
+
+TEST(SampleStore, AppendColumns)
+{
+    SampleStore store(column_names());
+    EXPECT_EQ((size_t) 3, store.get_ncolumns());
+    EXPECT_EQ((size_t) 0, store.get_entries());
+    EXPECT_EQ(2, store.get_index("likelihood"));
+    EXPECT_EQ(-1, store.get_index("c"));
+
+    // One row, then several, row-major
+    const float row[] = { 1, 10, 100 };
+    store.append(row);
+    const float rows[] = { 2, 20, 200,
+                           3, 30, 300,
+                           4, 40, 400 };
+    store.append(rows, 3);
+
+    ASSERT_EQ((size_t) 4, store.get_entries());
+    for (size_t j=0; j < store.get_ncolumns(); j++) {
+        const float* column = store.get_column(j);
+        ASSERT_TRUE(column != NULL);
+        float scale = (j == 0 ? 1 : (j == 1 ? 10 : 100));
+        for (size_t i=0; i < store.get_entries(); i++)
+            EXPECT_EQ((i + 1) * scale, column[i]) << "column " << j << " row " << i;
+    }
+    EXPECT_EQ(store.get_column(1), store.get_column("b"));
+}
+
+TEST(SampleStore, ReserveClear)
+{
+    SampleStore store(column_names());
+
+    // Reserving adds no rows, and rows up to the reserved count are
+    // appended in place
+    store.reserve(100);
+    EXPECT_EQ((size_t) 0, store.get_entries());
+    const float row[] = { 1, 2, 3 };
+    store.append(row);
+    const float* column = store.get_column(0);
+    for (int i=0; i < 99; i++)
+        store.append(row);
+    EXPECT_EQ((size_t) 100, store.get_entries());
+    EXPECT_EQ(column, store.get_column(0));
+
+    // Clearing removes the rows but keeps the columns
+    store.clear();
+    EXPECT_EQ((size_t) 0, store.get_entries());
+    EXPECT_EQ((size_t) 3, store.get_ncolumns());
+    EXPECT_TRUE(store.get_column(0) == NULL);
+
+    const float other[] = { 4, 5, 6 };
+    store.append(other);
+    ASSERT_EQ((size_t) 1, store.get_entries());
+    EXPECT_EQ(4, store.get_column("a")[0]);
+    EXPECT_EQ(5, store.get_column("b")[0]);
+    EXPECT_EQ(6, store.get_column("likelihood")[0]);
+}
@@ -0,0 +1,151 @@
+#include <gtest/gtest.h>
+#include "simd_kernels.h"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <limits>
+
+// Vector paths are compared against the scalar reference, for every level
+// this CPU supports
+
+TEST(SIMDKernels, LevelNames)
+{
+    EXPECT_STREQ("scalar", simd::name(simd::SCALAR));
+    EXPECT_STREQ("avx2", simd::name(simd::AVX2));
+    EXPECT_STREQ("avx512", simd::name(simd::AVX512));
+    EXPECT_LE(simd::active(), simd::supported());
+}
+
+TEST(SIMDKernels, LogAccuracy)
+{
+    // one-hot weights select log(s) for a single event
+    const size_t ne = 16;
+    std::vector<float> lut(ne);
+    double values[] = {1.0f, 0.5f, 2.0f, 1.4142135f, 0.70710677f, 3.0e-30f,
+                       1.0e30f, 1.1754944e-38f, 0.999999f, 1.000001f, 12.5f,
+                       7.0e-5f, 1e-20f, 65535.0f, 0.1f, 42.0f};
+    for (size_t i=0; i < ne; i++)
+        lut[i] = values[i];
+    double pars[] = {1.0};
+
+    for (int level=simd::SCALAR; level <= simd::supported(); level++) {
+        for (size_t k=0; k < ne; k++) {
+            std::vector<int> weights(ne, 0);
+            weights[k] = 1;
+            double result = simd::nll_event_sum(&lut.front(), &weights.front(), pars,
+                                                ne, 1, (simd::Level) level);
+            double expected = log((double) lut[k]);
+            EXPECT_NEAR(expected, result, 4e-16 * fabs(expected) + 1e-300)
+                << simd::name((simd::Level) level) << " event " << k;
+        }
+    }
+}
+
+TEST(SIMDKernels, NLLEventSum)
+{
+    const size_t ne = 1003;  // not a multiple of the vector width
+    const size_t ns = 29;
+
+    std::vector<float> lut(ne * ns);
+    std::vector<int> weights(ne);
+    std::vector<double> pars(ns);
+
+    srand(1234);
+    for (size_t i=0; i < lut.size(); i++) {
+        lut[i] = 1.0 * rand() / RAND_MAX;
+        if (i % 97 == 0)
+            lut[i] = std::numeric_limits<float>::quiet_NaN();
+    }
+    for (size_t i=0; i < ne; i++)
+        weights[i] = 1 + i % 3;
+    for (size_t j=0; j < ns; j++)
+        pars[j] = 10.0 + 100.0 * j;
+
+    double expected = simd::nll_event_sum(&lut.front(), &weights.front(), &pars.front(),
+                                          ne, ns, simd::SCALAR);
+
+    for (int level=simd::AVX2; level <= simd::supported(); level++) {
+        double result = simd::nll_event_sum(&lut.front(), &weights.front(), &pars.front(),
+                                            ne, ns, (simd::Level) level);
+        EXPECT_NEAR(expected, result, 1e-12 * fabs(expected)) << simd::name((simd::Level) level);
+    }
+}
+
+TEST(SIMDKernels, NLLEventSumEmptyEvent)
+{
+    // an event with no PDF support gives log(0), as in the scalar code
+    const size_t ne = 32;
+    std::vector<float> lut(ne, 0.5);
+    std::vector<int> weights(ne, 1);
+    double pars[] = {2.0};
+    lut[5] = 0;
+
+    for (int level=simd::SCALAR; level <= simd::supported(); level++) {
+        double result = simd::nll_event_sum(&lut.front(), &weights.front(), pars,
+                                            ne, 1, (simd::Level) level);
+        EXPECT_TRUE(std::isinf(result) && result < 0) << simd::name((simd::Level) level);
+    }
+}
+
+TEST(SIMDKernels, EvalPDFBitIdentical)
+{
+    const int npoints = 1001;
+    const int nbins = 50;
+
+    std::vector<unsigned int> bins(nbins);
+    std::vector<int> read_bins(npoints);
+
+    srand(4321);
+    for (int i=0; i < nbins; i++)
+        bins[i] = rand();
+    bins[7] = 0;
+    bins[11] = 4000000000u;  // above INT_MAX
+    for (int i=0; i < npoints; i++)
+        read_bins[i] = (i % 13 == 0) ? -1 : rand() % nbins;
+
+    const double bin_norm = 123456.7 * 0.02;
+
+    for (int stride=1; stride <= 3; stride += 2) {
+        std::vector<float> expected(npoints * stride, 0);
+        simd::eval_pdf(npoints, &read_bins.front(), &bins.front(), bin_norm,
+                       &expected.front(), stride, simd::SCALAR);
+
+        for (int level=simd::AVX2; level <= simd::supported(); level++) {
+            std::vector<float> result(npoints * stride, 0);
+            simd::eval_pdf(npoints, &read_bins.front(), &bins.front(), bin_norm,
+                           &result.front(), stride, (simd::Level) level);
+            EXPECT_EQ(0, memcmp(&expected.front(), &result.front(),
+                                expected.size() * sizeof(float)))
+                << simd::name((simd::Level) level) << " stride " << stride;
+        }
+    }
+}
+
+TEST(SIMDKernels, SumHistograms)
+{
+    const size_t nbins = 1001;
+    const int nhists = 5;
+    const size_t first = 3;  // unaligned range
+    const size_t last = 997;
+
+    std::vector<unsigned int> hists(nhists * nbins);
+    srand(99);
+    for (size_t i=0; i < hists.size(); i++)
+        hists[i] = rand() % 1000;
+
+    std::vector<unsigned int> expected(nbins, 7);
+    for (size_t i=first; i < last; i++) {
+        expected[i] = 0;
+        for (int k=0; k < nhists; k++)
+            expected[i] += hists[k * nbins + i];
+    }
+
+    for (int level=simd::SCALAR; level <= simd::supported(); level++) {
+        std::vector<unsigned int> output(nbins, 7);
+        simd::sum_histograms(&hists.front(), nhists, nbins, first, last,
+                             &output.front(), (simd::Level) level);
+        for (size_t i=0; i < nbins; i++)
+            EXPECT_EQ(expected[i], output[i]) << simd::name((simd::Level) level) << " bin " << i;
+    }
+}
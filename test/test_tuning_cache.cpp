@@ -0,0 +1,79 @@
+#include <gtest/gtest.h>
+#include "tuning_cache.h"
+
+#include <cstdio>
+#include <string>
+
+static TuningKey make_key(const char* device, int nsamples, int nbins,
+                          int nsyst, int npoints)
+{
+    TuningKey key;
+    key.device = device;
+    key.nsamples = nsamples;
+    key.nbins = nbins;
+    key.nsyst = nsyst;
+    key.npoints = npoints;
+    return key;
+}
+
+static LaunchConfig make_config(int bin_nblocks, int bin_nthreads,
+                                int eval_nblocks, int eval_nthreads)
+{
+    LaunchConfig config;
+    config.bin_nblocks = bin_nblocks;
+    config.bin_nthreads_per_block = bin_nthreads;
+    config.eval_nblocks = eval_nblocks;
+    config.eval_nthreads_per_block = eval_nthreads;
+    return config;
+}
+
+TEST(TuningCache, FindAndPersist)
+{
+    std::string filename("/tmp/sxmc_test_tuning_cache");
+    remove(filename.c_str());
+
+    TuningKey key = make_key("Tesla K40m sm_35", 100000, 50, 2, 1000);
+    LaunchConfig config;
+    {
+        TuningCache cache(filename);
+        EXPECT_FALSE(cache.find(key, config));
+        cache.insert(key, make_config(16, 256, 4, 128));
+        cache.insert(key, make_config(32, 128, 8, 64));
+        ASSERT_TRUE(cache.find(key, config));
+        EXPECT_EQ(32, config.bin_nblocks);
+    }
+
+    // A new cache reads the entries back, and the last one wins
+    TuningCache cache(filename);
+    EXPECT_EQ(2u, cache.size());
+    ASSERT_TRUE(cache.find(key, config));
+    EXPECT_EQ(32, config.bin_nblocks);
+    EXPECT_EQ(128, config.bin_nthreads_per_block);
+    EXPECT_EQ(8, config.eval_nblocks);
+    EXPECT_EQ(64, config.eval_nthreads_per_block);
+
+    key.nsyst = 3;
+    EXPECT_FALSE(cache.find(key, config));
+
+    remove(filename.c_str());
+}
+
+TEST(TuningCache, Predict)
+{
+    TuningCache cache("");
+    cache.insert(make_key("dev", 100000, 50, 2, 1000), make_config(16, 256, 4, 128));
+    cache.insert(make_key("dev", 1000000, 50, 2, 1000), make_config(64, 512, 4, 128));
+
+    // Nearest tuned shape within a factor of two
+    LaunchConfig config;
+    ASSERT_TRUE(cache.predict(make_key("dev", 150000, 60, 2, 900), config));
+    EXPECT_EQ(16, config.bin_nblocks);
+    ASSERT_TRUE(cache.predict(make_key("dev", 800000, 50, 2, 1000), config));
+    EXPECT_EQ(64, config.bin_nblocks);
+
+    // Nothing close enough
+    EXPECT_FALSE(cache.predict(make_key("dev", 400000, 50, 2, 1000), config));
+    EXPECT_FALSE(cache.predict(make_key("dev", 100000, 500, 2, 1000), config));
+    EXPECT_FALSE(cache.predict(make_key("dev", 100000, 50, 1, 1000), config));
+    EXPECT_FALSE(cache.predict(make_key("other", 100000, 50, 2, 1000), config));
+}
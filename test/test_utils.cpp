@@ -0,0 +1,117 @@
+#include <gtest/gtest.h>
+#include "utils.h"
+
+#include <cstdlib>
+#include <vector>
+
+// Covariance of rows of a row-major array, in two passes
+static double two_pass_covariance(const std::vector<double>& x, size_t dim,
+                                  size_t i, size_t j)
+{
+    const size_t n = x.size() / dim;
+    double mi = 0, mj = 0;
+    for (size_t k=0; k < n; k++) {
+        mi += x[k * dim + i];
+        mj += x[k * dim + j];
+    }
+    mi /= n;
+    mj /= n;
+
+    double sum = 0;
+    for (size_t k=0; k < n; k++)
+        sum += (x[k * dim + i] - mi) * (x[k * dim + j] - mj);
+    return sum / (n - 1);
+}
+
+TEST(RunningCovariance, MergeMatchesOnePass)
+{
+    const size_t dim = 3;
+    const size_t n = 1000;
+    const size_t nfirst = 377;
+    std::vector<double> x(n * dim);
+    srand(11);
+    for (size_t k=0; k < n; k++) {
+        double a = 1.0 * rand() / RAND_MAX;
+        double b = 1.0 * rand() / RAND_MAX;
+        x[k * dim] = 100 + a;
+        x[k * dim + 1] = 2 * a + 0.5 * b;
+        x[k * dim + 2] = -b;
+    }
+
+    RunningCovariance all(dim), first(dim), second(dim);
+    for (size_t k=0; k < n; k++) {
+        all.add(&x[k * dim]);
+        if (k < nfirst)
+            first.add(&x[k * dim]);
+        else
+            second.add(&x[k * dim]);
+    }
+    first.merge(second);
+
+    // Merging into an empty accumulator copies the other one
+    RunningCovariance empty(dim);
+    empty.merge(all);
+
+    RunningCovariance* merged[] = { &first, &empty };
+    for (int m=0; m < 2; m++) {
+        ASSERT_EQ(n, merged[m]->entries());
+        for (size_t i=0; i < dim; i++) {
+            EXPECT_NEAR(all.mean(i), merged[m]->mean(i), 1e-9);
+            for (size_t j=0; j < dim; j++) {
+                const double expected = two_pass_covariance(x, dim, i, j);
+                EXPECT_NEAR(expected, all.covariance(i, j), 1e-9);
+                EXPECT_NEAR(expected, merged[m]->covariance(i, j), 1e-9);
+                EXPECT_NEAR(all.correlation(i, j), merged[m]->correlation(i, j), 1e-9);
+            }
+        }
+    }
+
+    // Merging an empty accumulator changes nothing
+    RunningCovariance unchanged(all);
+    unchanged.merge(RunningCovariance(dim));
+    EXPECT_EQ(n, unchanged.entries());
+    EXPECT_DOUBLE_EQ(all.covariance(0, 1), unchanged.covariance(0, 1));
+}
+
+TEST(Cholesky, Reconstructs)
+{
+    const size_t n = 3;
+    const double a[] = {  4, 12, -16,
+                         12, 37, -43,
+                        -16, -43, 98 };
+    std::vector<double> m(a, a + n * n);
+    std::vector<double> l;
+    ASSERT_TRUE(cholesky_decompose(m, n, l));
+    ASSERT_EQ(n * n, l.size());
+
+    // Known factor, lower triangular
+    const double expected[] = { 2, 0, 0,
+                                6, 1, 0,
+                               -8, 5, 3 };
+    for (size_t i=0; i < n * n; i++)
+        EXPECT_NEAR(expected[i], l[i], 1e-12);
+
+    for (size_t i=0; i < n; i++) {
+        for (size_t j=0; j < n; j++) {
+            double sum = 0;
+            for (size_t k=0; k < n; k++)
+                sum += l[i * n + k] * l[j * n + k];
+            EXPECT_NEAR(m[i * n + j], sum, 1e-12);
+        }
+    }
+}
+
+TEST(Cholesky, NotPositiveDefinite)
+{
+    std::vector<double> l;
+
+    // Eigenvalues 3 and -1
+    const double indefinite[] = { 1, 2,
+                                  2, 1 };
+    EXPECT_FALSE(cholesky_decompose(std::vector<double>(indefinite, indefinite + 4), 2, l));
+
+    // Singular
+    const double singular[] = { 1, 1,
+                                1, 1 };
+    EXPECT_FALSE(cholesky_decompose(std::vector<double>(singular, singular + 4), 2, l));
+}